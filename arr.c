@@ -1,11 +1,13 @@
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <endian.h>
 #include <assert.h>
 
 #include "structs.h"
 #include "helper.h"
 #include "arr.h"
+#include "metrics.h"
 
 /*
  * Implementation of an array that sorts file_t structs based on name or offset
@@ -17,17 +19,171 @@
  * iterating over an array sorted by offset, repack can be streamlined, as
  * opposed to sorting files during each individual repack.
  *
- * Zero size files are assigned an offset equal to the maximum size of
- * file_data (2^32), as it allows all new zero size files to be appended to end
- * of the offset array, minimising the cost of create_file. Comparison of files
- * using a key accounts for the insertion of zero size files at the end of the
- * offset array, redirecting the binary search to lower indices.
+ * Zero size files do not occupy space in file_data, so they are only stored in
+ * the name array (their o_index is -1). Every file in an offset array has a
+ * unique offset, which allows offsets to be compared directly without any
+ * special cases. Name arrays contain all files, and are responsible for
+ * freeing them.
  *
- * Although internally these files have an offset of 2^32, the offset update
- * helper for dir_table writes 0 to the dir_table file, as expected by the
- * filesystem specifications. To accommodate this, uint64_t is used instead
- * of uint32_t.
+ * Offset arrays also keep a dense copy of each file's offset and extent (its
+ * length plus any space reserved after it for appends, rounded up to the
+ * alignment of file offsets), stored in the same order as the list.
+ * Allocation scans and repack only need these two fields, so iterating over
+ * the dense arrays avoids dereferencing every file_t (and pulling its 64 byte
+ * name into cache). The dense entries are maintained by insertion, removal
+ * and shifting, and arr_update must be called whenever the offset or length
+ * of a file in the array is modified in place. As every change to the
+ * filesystem offset array passes through these functions, they also maintain
+ * its gap metrics (see metrics.c).
+ *
+ * Similarly, name arrays store the first PREFIX_LEN characters of each name as
+ * a pair of big endian integers beside the list. Comparing two prefixes as
+ * integers gives the same ordering as strncmp, so most binary search probes
+ * resolve without dereferencing the file_t, and only matching prefixes fall
+ * back to comparing the remainder of the names.
+ *
+ * When a filesystem is initialised, arrays are built in bulk using arr_build,
+ * which sorts every file once rather than inserting files one at a time
+ * (each insertion shifts the array, so building an array from unsorted
+ * insertions takes quadratic time).
+ *
+ * The binary search is generated separately for each array type using the
+ * ARR_GET_INDEX macro, so the array type is only checked once per search
+ * rather than once per comparison. The search loop selects the next half of
+ * the array using a conditional move, and comparators avoid branching on
+ * their result where possible.
+ */
+
+// Branch-free three way comparison of two integers
+#define CMP_INT(a, b) (((a) > (b)) - ((a) < (b)))
+
+// Search key for name arrays
+typedef struct name_key_t {
+	prefix_t prefix;		// Inline prefix of name
+	char* name;				// Full name
+} name_key_t;
+
+/*
+ * Packs the first PREFIX_LEN characters of a name into a pair of integers,
+ * such that integer comparison of two prefixes matches strncmp ordering
+ * The name must be zero padded (see update_file_name), so the prefix can be
+ * loaded directly without searching for the null terminator
+ *
+ * name: zero padded file name
+ *
+ * returns: big endian integer representation of the name prefix
+ */
+static prefix_t name_prefix(char* name) {
+	uint64_t words[2];
+	memcpy(words, name, sizeof(words));
+	
+	prefix_t prefix = {be64toh(words[0]), be64toh(words[1])};
+	return prefix;
+}
+
+/*
+ * Search key constructors for each array type
+ */
+static inline uint64_t offset_key(file_t* file) {
+	return file->offset;
+}
+
+static inline name_key_t name_key(file_t* file) {
+	name_key_t key = {name_prefix(file->name), file->name};
+	return key;
+}
+
+/*
+ * Checks whether a key is positioned after the array element at index, using
+ * only the inline keys stored in the array
+ * For name arrays, this compares name prefixes, so the result is only exact
+ * when prefixes differ
+ *
+ * returns: 1 if key is positioned after the element at index, else 0
+ */
+static inline int32_t offset_after_index(uint64_t* key, int32_t index,
+		arr_t* arr) {
+	return *key > arr->offset[index];
+}
+
+static inline int32_t name_after_index(name_key_t* key, int32_t index,
+		arr_t* arr) {
+	prefix_t prefix = arr->prefix[index];
+	return (key->prefix.hi > prefix.hi) |
+	       ((key->prefix.hi == prefix.hi) & (key->prefix.lo > prefix.lo));
+}
+
+/*
+ * Compares a key with the array element at index
+ * Name elements are only dereferenced if the inline prefixes match
+ *
+ * returns: negative, 0 or positive, representing the position of key
+ * 			relative to the element at index
+ */
+static inline int32_t cmp_offset_index(uint64_t* key, int32_t index,
+		arr_t* arr) {
+	return CMP_INT(*key, arr->offset[index]);
+}
+
+static inline int32_t cmp_name_index(name_key_t* key, int32_t index,
+		arr_t* arr) {
+	prefix_t prefix = arr->prefix[index];
+	int32_t cmp = 2 * CMP_INT(key->prefix.hi, prefix.hi) +
+	              CMP_INT(key->prefix.lo, prefix.lo);
+	
+	// Names terminating within the prefix are equal once prefixes match
+	if (cmp != 0 || (prefix.lo & 0xFF) == 0) {
+		return cmp;
+	}
+	
+	// Compare the zero padded names in full
+	return name_cmp(key->name, arr->list[index]->name);
+}
+
+/*
+ * Generates a binary search for an array type, used by arr_get_index
+ *
+ * suffix: suffix of the generated function name
+ * key_type: type of search key
+ * make_key: function constructing a key_type from a file_t
+ * after: function checking if a key_type* is after the inline key at an index
+ * cmp: function comparing a key_type* with the array element at an index
+ *
+ * The generated function finds the lowest index with an inline key greater
+ * than or equal to the key, steps over elements with matching inline keys
+ * that are still less than the key, then checks whether the element found
+ * matches the key. Arrays must not be empty.
  */
+#define ARR_GET_INDEX(suffix, key_type, make_key, after, cmp) \
+static int32_t arr_get_index_##suffix(file_t* file, arr_t* arr, \
+		int32_t insert) { \
+	key_type key = make_key(file); \
+	int32_t size = arr->size; \
+	int32_t base = 0; \
+	int32_t len = size; \
+	\
+	while (len > 1) { \
+		int32_t half = len / 2; \
+		base = after(&key, base + half, arr) ? base + half : base; \
+		len -= half; \
+	} \
+	base += after(&key, base, arr); \
+	\
+	int32_t c = 1; \
+	while (base < size && (c = cmp(&key, base, arr)) > 0) { \
+		++base; \
+	} \
+	\
+	int32_t found = base < size && c == 0; \
+	if (insert) { \
+		return found ? -1 : base; \
+	} \
+	return found ? base : -1; \
+}
+
+ARR_GET_INDEX(offset, uint64_t, offset_key, offset_after_index,
+		cmp_offset_index)
+ARR_GET_INDEX(name, name_key_t, name_key, name_after_index, cmp_name_index)
 
 /*
  * Compares the key field of file_t structs based on array type
@@ -36,38 +192,57 @@
  * b: second file_t being compared
  * arr: address of array, used to determine array sorting type
  *
- * returns: -1, 0, or 1, representing the position of a relative to the
- * 			position of b
+ * returns: negative, 0 or positive, representing the position of a relative
+ * 			to the position of b
  */
 int32_t cmp_key(file_t* a, file_t* b, arr_t* arr) {
 	assert(a != NULL && b != NULL && arr != NULL && "invalid args");
 	
 	if (arr->type == OFFSET) {
-		if (a->offset < b->offset) {
-			return -1;
-		} else if (a->offset > b->offset) {
-			return 1;
-		} else {
-			// Check if file_t* b refers to a zero size file
-			// (zero size files should be found by name, not offset)
-			if (b->length > 0) {
-				// Valid non-zero size file found
-				return 0;
-			} else {
-				if (b->offset >= MAX_FILE_DATA_LEN) {
-					// Redirect search to lower indices if encountering newly
-					// created zero size file
-					return -1;
-				} else {
-					// Redirect search to higher indices if encountering file
-					// resized to 0 bytes
-					return 1;
-				}
-			}
-		}
+		return CMP_INT(a->offset, b->offset);
 	} else {
 		// Only compare the first 63 characters of names
-		return strncmp(a->name, b->name, NAME_LEN - 1);
+		return name_cmp(a->name, b->name);
+	}
+}
+
+/*
+ * qsort comparators for lists of file_t pointers
+ * Files with equal keys are ordered by dir_table index
+ */
+static int sort_cmp_offset(const void* a, const void* b) {
+	file_t* fa = *(file_t**)a;
+	file_t* fb = *(file_t**)b;
+	int32_t cmp = CMP_INT(fa->offset, fb->offset);
+	return cmp != 0 ? cmp : CMP_INT(fa->index, fb->index);
+}
+
+static int sort_cmp_name(const void* a, const void* b) {
+	file_t* fa = *(file_t**)a;
+	file_t* fb = *(file_t**)b;
+	int32_t cmp = name_cmp(fa->name, fb->name);
+	return cmp != 0 ? cmp : CMP_INT(fa->index, fb->index);
+}
+
+/*
+ * Whether an array is the offset array of its filesystem, whose gaps are
+ * tracked by the filesystem metrics
+ */
+static inline int32_t arr_tracked(arr_t* arr) {
+	return arr->type == OFFSET && arr == arr->fs->o_list;
+}
+
+/*
+ * Copies the key of the file at index into the dense arrays, without
+ * updating metrics
+ */
+static inline void arr_set_key(int32_t index, arr_t* arr) {
+	if (arr->type == OFFSET) {
+		arr->offset[index] = arr->list[index]->offset;
+		arr->length[index] = align_len(arr->list[index]->length +
+				arr->list[index]->reserve, arr->fs);
+	} else {
+		arr->prefix[index] = name_prefix(arr->list[index]->name);
 	}
 }
 
@@ -94,12 +269,24 @@ arr_t* arr_init(int32_t capacity, TYPE type, filesys_t* fs) {
 	arr->type = type;
 	arr->fs = fs;
 	arr->list = salloc(sizeof(*arr->list) * capacity);
+	arr->offset = NULL;
+	arr->length = NULL;
+	arr->prefix = NULL;
+	
+	// Allocate dense key arrays for the type of array
+	if (type == OFFSET) {
+		arr->offset = salloc(sizeof(*arr->offset) * capacity);
+		arr->length = salloc(sizeof(*arr->length) * capacity);
+	} else {
+		arr->prefix = salloc(sizeof(*arr->prefix) * capacity);
+	}
 	
 	return arr;
 }
 
 /*
  * Frees file_t structs pointed to by the array
+ * Only name arrays are guaranteed to contain every file in the filesystem
  *
  * arr: address of arr_t struct containing file_t pointers to free
  */
@@ -129,6 +316,9 @@ void free_arr(arr_t* arr) {
 	
 	free_arr_list(arr);
 	free(arr->list);
+	free(arr->offset);
+	free(arr->length);
+	free(arr->prefix);
 	free(arr);
 }
 
@@ -154,6 +344,17 @@ void arr_rshift(int32_t start, int32_t end, arr_t* arr) {
 		}
 		list[i + 1] = list[i];
 	}
+	
+	// Shift dense key entries
+	if (type == OFFSET) {
+		memmove(arr->offset + start + 1, arr->offset + start,
+				sizeof(*arr->offset) * (end - start + 1));
+		memmove(arr->length + start + 1, arr->length + start,
+				sizeof(*arr->length) * (end - start + 1));
+	} else {
+		memmove(arr->prefix + start + 1, arr->prefix + start,
+				sizeof(*arr->prefix) * (end - start + 1));
+	}
 }
 
 /*
@@ -171,6 +372,12 @@ int32_t arr_insert(int32_t index, file_t* file, arr_t* arr) {
 	       index <= arr->size && "invalid args");
 	assert(arr->size < arr->capacity && "array full");
 	
+	// The gap at index is split by the new file
+	int32_t tracked = arr_tracked(arr);
+	if (tracked) {
+		metrics_gaps(index, index, -1, arr);
+	}
+	
 	// Shift elements to the right (higher index) if required
 	if (index < arr->size) {
 		arr_rshift(index, arr->size - 1, arr);
@@ -184,6 +391,10 @@ int32_t arr_insert(int32_t index, file_t* file, arr_t* arr) {
 	} else {
 		file->n_index = index;
 	}
+	arr_set_key(index, arr);
+	if (tracked) {
+		metrics_gaps(index, index + 1, 1, arr);
+	}
 	
 	return index;
 }
@@ -191,7 +402,6 @@ int32_t arr_insert(int32_t index, file_t* file, arr_t* arr) {
 /*
  * Get index for insertion of a new file_t pointer, or for an existing element
  * Binary search is used to traverse the sorted array
- * Zero size files are appended to the end of offset arrays
  *
  * file: file_t struct with the appropriate field populated for the array
  * 		 (offset if offset sorted array, or name if name sorted array)
@@ -214,58 +424,11 @@ int32_t arr_get_index(file_t* file, arr_t* arr, int32_t insert) {
 		}
 	}
 	
-	// Append zero size_files to end of offset array
-	if (insert && arr->type == OFFSET && file->length == 0) {
-		return arr->size;
-	}
-	
-	int32_t size = arr->size;
-	file_t** list = arr->list;
-	
-	// Index variables for low, high and middle index of binary search
-	int32_t l = 0;
-	int32_t h = size - 1;
-	int32_t m = 0;
-	int32_t cmp = 0;
-	
-	// Loop until file_t found, or low and high converge with the middle index
-	while (1) {
-		m = (l + h) / 2;
-		cmp = cmp_key(file, list[m], arr);
-
-		if (cmp < 0) {
-			// Check for low and middle index convergence
-			if (l >= m) {
-				if (insert) {
-					return m; // Insert at current index
-				} else {
-					return -1; // File not found
-				}
-			}
-			
-			// Update high index for next iteration
-			h = m - 1;
-			
-		} else if (cmp > 0) {
-			// Check for high and middle index convergence
-			if (h <= m) {
-				if (insert) {
-					return m + 1; // Insert at next index
-				} else {
-					return -1; // File not found
-				}
-			}
-			
-			// Update low index for next iteration
-			l = m + 1;
-			
-		} else {
-			if (insert) {
-				return -1; // File exists
-			} else {
-				return m; // Return index of file found
-			}
-		}
+	// Dispatch to the search generated for the array type
+	if (arr->type == OFFSET) {
+		return arr_get_index_offset(file, arr, insert);
+	} else {
+		return arr_get_index_name(file, arr, insert);
 	}
 }
 
@@ -280,6 +443,8 @@ int32_t arr_get_index(file_t* file, arr_t* arr, int32_t insert) {
 int32_t arr_sorted_insert(file_t* file, arr_t* arr) {
 	assert(file != NULL && arr != NULL && "invalid args");
 	assert(arr->size < arr->capacity && "array full");
+	assert((arr->type == NAME || file->length > 0) &&
+	       "zero size files are not stored in offset arrays");
 	
 	// Find insertion index
 	int32_t index = arr_get_index(file, arr, 1);
@@ -291,6 +456,104 @@ int32_t arr_sorted_insert(file_t* file, arr_t* arr) {
 	return index;
 }
 
+/*
+ * Builds an empty array from an unsorted list of files
+ * The list is sorted once (using up to n_threads threads) and copied into the
+ * array, taking O(n log n) time rather than O(n^2) for individual sorted
+ * insertions. Files with the same key as a previous file in the list are not
+ * stored (the file with the lowest dir_table index is kept), and the index of
+ * these files for the array type is set to -1.
+ *
+ * files: list of file_t pointers to store (the list is sorted in place)
+ * count: number of file_t pointers in list
+ * arr: address of an empty arr_t struct
+ * n_threads: maximum number of threads used for sorting
+ *
+ * returns: number of files stored in the array
+ */
+int32_t arr_build(file_t** files, int32_t count, arr_t* arr,
+		int32_t n_threads) {
+	assert(count >= 0 && (files != NULL || count == 0) && arr != NULL &&
+	       "invalid args");
+	assert(arr->size == 0 && count <= arr->capacity && "array not empty");
+	
+	if (arr->type == OFFSET) {
+		sort_files(files, count, sort_cmp_offset, n_threads);
+	} else {
+		sort_files(files, count, sort_cmp_name, n_threads);
+	}
+	
+	for (int32_t i = 0; i < count; ++i) {
+		file_t* f = files[i];
+		int32_t duplicate = arr->size > 0 &&
+				cmp_key(arr->list[arr->size - 1], f, arr) == 0;
+		
+		if (arr->type == OFFSET) {
+			assert(f->length > 0 &&
+			       "zero size files are not stored in offset arrays");
+			f->o_index = duplicate ? -1 : arr->size;
+		} else {
+			f->n_index = duplicate ? -1 : arr->size;
+		}
+		
+		if (!duplicate) {
+			arr->list[arr->size] = f;
+			++arr->size;
+			arr_set_key(arr->size - 1, arr);
+		}
+	}
+	
+	if (arr_tracked(arr)) {
+		metrics_rebuild(arr->fs);
+	}
+	return arr->size;
+}
+
+/*
+ * Fills an empty array with a list of files which is already sorted
+ * The list is checked while it is copied, so a list loaded from an untrusted
+ * source (e.g. an index sidecar) cannot produce an unsorted array.
+ *
+ * files: list of file_t pointers sorted by the key of the array type
+ * count: number of file_t pointers in list
+ * arr: address of an empty arr_t struct
+ *
+ * returns: 0 on success
+ * 			-1 if keys are not strictly increasing (array is left empty)
+ */
+int32_t arr_load(file_t** files, int32_t count, arr_t* arr) {
+	assert(count >= 0 && (files != NULL || count == 0) && arr != NULL &&
+	       "invalid args");
+	assert(arr->size == 0 && "array not empty");
+	
+	if (count > arr->capacity) {
+		return -1;
+	}
+	
+	for (int32_t i = 0; i < count; ++i) {
+		file_t* f = files[i];
+		if ((arr->type == OFFSET && f->length == 0) ||
+			(i > 0 && cmp_key(files[i - 1], f, arr) >= 0)) {
+			arr->size = 0;
+			return -1;
+		}
+		
+		if (arr->type == OFFSET) {
+			f->o_index = i;
+		} else {
+			f->n_index = i;
+		}
+		arr->list[i] = f;
+		++arr->size;
+		arr_set_key(i, arr);
+	}
+	
+	if (arr_tracked(arr)) {
+		metrics_rebuild(arr->fs);
+	}
+	return 0;
+}
+
 /*
  * Decrease the index of elements from start to end by 1, overwriting the
  * address of a file_t pointer being removed
@@ -313,6 +576,17 @@ void arr_lshift(int32_t start, int32_t end, arr_t* arr) {
 		}
 		list[i - 1] = list[i];
 	}
+	
+	// Shift dense key entries
+	if (type == OFFSET) {
+		memmove(arr->offset + start - 1, arr->offset + start,
+				sizeof(*arr->offset) * (end - start + 1));
+		memmove(arr->length + start - 1, arr->length + start,
+				sizeof(*arr->length) * (end - start + 1));
+	} else {
+		memmove(arr->prefix + start - 1, arr->prefix + start,
+				sizeof(*arr->prefix) * (end - start + 1));
+	}
 }
 
 /*
@@ -332,6 +606,12 @@ file_t* arr_remove(int32_t index, arr_t* arr) {
 	// Retrieve file_t* from array
 	file_t* f = arr_get(index, arr);
 	
+	// The gaps either side of the file are joined
+	int32_t tracked = arr_tracked(arr);
+	if (tracked) {
+		metrics_gaps(index, index + 1, -1, arr);
+	}
+	
 	// Shift elements to the left (lower index) if required
 	if (index < arr->size - 1) {
 		arr_lshift(index + 1, arr->size - 1, arr);
@@ -344,6 +624,9 @@ file_t* arr_remove(int32_t index, arr_t* arr) {
 	} else {
 		f->n_index = -1;
 	}
+	if (tracked) {
+		metrics_gaps(index, index, 1, arr);
+	}
 	
 	return f;
 }
@@ -383,6 +666,29 @@ file_t* arr_remove_by_key(file_t* key, arr_t* arr) {
 	return f;
 }
 
+/*
+ * Copies the key of the file at index into the dense arrays
+ * Must be called after modifying the offset, length or reserve of a file
+ * which is currently stored in an offset sorted array (names are only
+ * modified after removal from name sorted arrays)
+ *
+ * index: position of file_t* in array
+ * arr: address of arr_t struct containing a list of file_t pointers
+ */
+void arr_update(int32_t index, arr_t* arr) {
+	assert(index >= 0 && arr != NULL && index < arr->size && "invalid args");
+	
+	// Gaps either side of the file change with its offset and extent
+	int32_t tracked = arr_tracked(arr);
+	if (tracked) {
+		metrics_gaps(index, index + 1, -1, arr);
+	}
+	arr_set_key(index, arr);
+	if (tracked) {
+		metrics_gaps(index, index + 1, 1, arr);
+	}
+}
+
 /*
  * Retrieves the file_t pointer at the given index of an array
  *
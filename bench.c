@@ -0,0 +1,293 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <time.h>
+#include <assert.h>
+
+#include "structs.h"
+#include "helper.h"
+#include "arr.h"
+#include "myfilesystem.h"
+
+// Macro for running benchmark functions
+#define BENCH(x) bench(x, #x)
+
+// Defined benchmark sizes
+#define NUM_FILES (65536)
+#define NUM_LOOKUPS (1000000)
+#define NUM_MOUNTS (5)
+#define NUM_COMPACTIONS (200)
+
+// Defined file length values (one block per file)
+#define B1_LEN ((int64_t)NUM_FILES * BLOCK_LEN) // file_data length
+#define B2_LEN ((int64_t)NUM_FILES * META_LEN) // dir_table length
+#define B3_LEN ((2 * (int64_t)NUM_FILES - 1) * HASH_LEN) // hash_data length
+
+// Static filesystem filenames
+static char* f1 = "bench_file_data.bin";
+static char* f2 = "bench_directory_table.bin";
+static char* f3 = "bench_hash_data.bin";
+static char* f4 = "bench_index_sidecar.bin";
+
+// Filesystem shared by benchmarks
+static filesys_t* fs = NULL;
+
+/*
+ * Filesystem Benchmarks
+ *
+ * This file contains benchmarks for operations whose cost depends on the
+ * number of files in the filesystem. A dir_table with NUM_FILES entries is
+ * generated, with each file occupying one block of file_data. Names are
+ * assigned to dir_table entries in a shuffled order, so neither the name nor
+ * the offset order matches dir_table order. Each benchmark returns the average
+ * time per operation in nanoseconds.
+ */
+
+/*
+ * Helper Functions
+ */
+
+/*
+ * Returns the current monotonic time in nanoseconds
+ */
+double now_ns() {
+	struct timespec t;
+	clock_gettime(CLOCK_MONOTONIC, &t);
+	return t.tv_sec * 1e9 + t.tv_nsec;
+}
+
+/*
+ * Runs a benchmark and prints the average time per operation
+ */
+void bench(double (*bench_function) (), char * function_name) {
+	double ns = bench_function();
+	printf("%-28s %12.1f ns/op\n", function_name, ns);
+}
+
+/*
+ * Writes the name of the file stored at a dir_table index to name
+ */
+void bench_name(int32_t index, char* name) {
+	snprintf(name, NAME_LEN, "bench_file_%05d.txt", index);
+}
+
+/*
+ * Generates file_data, dir_table and hash_data with NUM_FILES files
+ */
+void gen_bench_files() {
+	int fds[3] = {
+		open(f1, O_RDWR | O_CREAT | O_TRUNC, S_IRUSR | S_IWUSR),
+		open(f2, O_RDWR | O_CREAT | O_TRUNC, S_IRUSR | S_IWUSR),
+		open(f3, O_RDWR | O_CREAT | O_TRUNC, S_IRUSR | S_IWUSR)
+	};
+	assert(fds[0] >= 0 && fds[1] >= 0 && fds[2] >= 0 &&
+	       "failed to open files");
+
+	assert(!ftruncate(fds[0], B1_LEN) && !ftruncate(fds[2], B3_LEN) &&
+	       "failed to size files");
+
+	// Shuffle the order of names and offsets in dir_table
+	int32_t* order = salloc(sizeof(*order) * NUM_FILES);
+	unsigned int seed = 1;
+	for (int32_t i = 0; i < NUM_FILES; ++i) {
+		order[i] = i;
+	}
+	for (int32_t i = NUM_FILES - 1; i > 0; --i) {
+		int32_t j = rand_r(&seed) % (i + 1);
+		int32_t temp = order[i];
+		order[i] = order[j];
+		order[j] = temp;
+	}
+
+	// Build dir_table in memory before writing it in one call
+	uint8_t* dir = scalloc(B2_LEN);
+	uint32_t offset = 0;
+	uint32_t length = BLOCK_LEN;
+	for (int32_t i = 0; i < NUM_FILES; ++i) {
+		bench_name(order[i], (char*)dir + i * META_LEN);
+		offset = order[i] * BLOCK_LEN;
+		memcpy(dir + i * META_LEN + NAME_LEN, &offset, sizeof(uint32_t));
+		memcpy(dir + i * META_LEN + NAME_LEN + OFFSET_LEN, &length,
+				sizeof(uint32_t));
+	}
+	assert(pwrite(fds[1], dir, B2_LEN, 0) == B2_LEN && "dir_table failed");
+	free(dir);
+	free(order);
+
+	for (int i = 0; i < 3; ++i) {
+		close(fds[i]);
+	}
+}
+
+/*
+ * Benchmark Functions
+ */
+
+// Binary search of the name sorted array
+double bench_name_lookup() {
+	file_t* keys = salloc(sizeof(*keys) * NUM_FILES);
+	char* key_names = salloc(NAME_LEN * NUM_FILES);
+	for (int32_t i = 0; i < NUM_FILES; ++i) {
+		char name[NAME_LEN];
+		bench_name(i, name);
+		keys[i].name = key_names + i * NAME_LEN;
+		update_file_name(name, &keys[i]);
+	}
+
+	unsigned int seed = 1;
+	double start = now_ns();
+	for (int32_t i = 0; i < NUM_LOOKUPS; ++i) {
+		file_t* f = arr_get_by_key(&keys[rand_r(&seed) % NUM_FILES],
+				fs->n_list);
+		assert(f != NULL && "lookup failed");
+	}
+	double elapsed = now_ns() - start;
+
+	free(keys);
+	free(key_names);
+	return elapsed / NUM_LOOKUPS;
+}
+
+// Binary search of the offset sorted array
+double bench_offset_lookup() {
+	file_t key;
+	unsigned int seed = 1;
+	double start = now_ns();
+	for (int32_t i = 0; i < NUM_LOOKUPS; ++i) {
+		update_file_offset((rand_r(&seed) % NUM_FILES) * BLOCK_LEN, &key);
+		file_t* f = arr_get_by_key(&key, fs->o_list);
+		assert(f != NULL && "lookup failed");
+	}
+	return (now_ns() - start) / NUM_LOOKUPS;
+}
+
+// Name lookup through the filesystem interface (includes locking)
+double bench_file_size() {
+	char name[NAME_LEN];
+	unsigned int seed = 1;
+	double start = now_ns();
+	for (int32_t i = 0; i < NUM_LOOKUPS; ++i) {
+		bench_name(rand_r(&seed) % NUM_FILES, name);
+		assert(file_size(name, fs) == BLOCK_LEN && "file_size failed");
+	}
+	return (now_ns() - start) / NUM_LOOKUPS;
+}
+
+// Initialising a filesystem with a full dir_table
+double bench_mount() {
+	double elapsed = 0;
+	for (int32_t i = 0; i < NUM_MOUNTS; ++i) {
+		double start = now_ns();
+		filesys_t* temp = init_fs(f1, f2, f3, fs->n_processors);
+		elapsed += now_ns() - start;
+		
+		assert(temp->n_list->size == NUM_FILES && "mount failed");
+		close_fs(temp);
+	}
+	return elapsed / NUM_MOUNTS;
+}
+
+// Initialising a filesystem with a full dir_table from an index sidecar
+double bench_mount_sidecar() {
+	fs_opts_t opts = {0};
+	opts.index_path = f4;
+	
+	// Write sidecar in a later timestamp tick than dir_table
+	unlink(f4);
+	filesys_t* temp = init_fs_opts(f1, f2, f3, fs->n_processors, &opts);
+	usleep(20000);
+	close_fs(temp);
+	
+	double elapsed = 0;
+	for (int32_t i = 0; i < NUM_MOUNTS; ++i) {
+		double start = now_ns();
+		temp = init_fs_opts(f1, f2, f3, fs->n_processors, &opts);
+		elapsed += now_ns() - start;
+		
+		assert(temp->n_list->size == NUM_FILES && "mount failed");
+		close_fs(temp);
+	}
+	
+	unlink(f4);
+	return elapsed / NUM_MOUNTS;
+}
+
+// Creating a file which requires files to be moved to open a gap
+// Two files separated by one file are deleted, so a gap for a file of two
+// blocks can be opened by moving a single block
+// Changes the offsets of files, so must run after other benchmarks
+double bench_create_compact() {
+	char name[NAME_LEN];
+	unsigned int seed = 1;
+	double elapsed = 0;
+	for (int32_t i = 0; i < NUM_COMPACTIONS; ++i) {
+		int32_t index = rand_r(&seed) % (NUM_FILES - 2);
+		bench_name(index, name);
+		assert(!delete_file(name, fs) && "delete failed");
+		bench_name(index + 2, name);
+		assert(!delete_file(name, fs) && "delete failed");
+		
+		double start = now_ns();
+		assert(!create_file("compact.txt", 2 * BLOCK_LEN, fs) &&
+		       "create failed");
+		elapsed += now_ns() - start;
+		
+		// Restore files in the gap left by compact.txt
+		assert(!delete_file("compact.txt", fs) && "delete failed");
+		bench_name(index, name);
+		assert(!create_file(name, BLOCK_LEN, fs) && "create failed");
+		bench_name(index + 2, name);
+		assert(!create_file(name, BLOCK_LEN, fs) && "create failed");
+	}
+	return elapsed / NUM_COMPACTIONS;
+}
+
+// Full repack after deleting every second file
+// Deletes files, so must run after other benchmarks
+double bench_repack() {
+	char name[NAME_LEN];
+	for (int32_t i = 0; i < NUM_FILES; i += 2) {
+		bench_name(i, name);
+		assert(!delete_file(name, fs) && "delete failed");
+	}
+	
+	double start = now_ns();
+	repack(fs);
+	return now_ns() - start;
+}
+
+/*
+ * Main Method
+ */
+
+int main(int argc, char * argv[]) {
+	// Optional number of processors passed to init_fs
+	int n_processors = 1;
+	if (argc > 1) {
+		n_processors = atoi(argv[1]);
+	}
+	
+	gen_bench_files();
+	fs = init_fs(f1, f2, f3, n_processors);
+
+	printf("Lookup Benchmarks (%d files)\n", NUM_FILES);
+	BENCH(bench_name_lookup);
+	BENCH(bench_offset_lookup);
+	BENCH(bench_file_size);
+	
+	printf("\nMount Benchmarks (%d files, %d processors)\n", NUM_FILES,
+			n_processors);
+	BENCH(bench_mount);
+	BENCH(bench_mount_sidecar);
+	
+	printf("\nAllocation Benchmarks (%d files)\n", NUM_FILES);
+	BENCH(bench_create_compact);
+	BENCH(bench_repack);
+
+	close_fs(fs);
+	return 0;
+}
@@ -0,0 +1,525 @@
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/types.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <sys/mman.h>
+#include <linux/falloc.h>
+#include <assert.h>
+
+#include "structs.h"
+#include "helper.h"
+#include "myfilesystem.h"
+#include "cache.h"
+#include "uring.h"
+
+/*
+ * Block Cache (STORAGE_PREAD and STORAGE_URING)
+ *
+ * file_data is read with pread in blocks of CACHE_BLOCK_LEN bytes, which are
+ * kept in a cache of at most opts.cache_bytes (CACHE_BYTES if 0). The least
+ * recently used block is replaced when the cache is full, so memory use is
+ * bounded regardless of the length of file_data.
+ *
+ * The cache is write-through: writes are passed to pwrite immediately and
+ * copied into blocks already held, so blocks are never dirty. Eviction never
+ * writes, synchronisation only needs to flush the kernel page cache (as
+ * msync does for the mapping), and file_data modified through its file
+ * descriptor (such as by FALLOC_FL_COLLAPSE_RANGE) is reread once its blocks
+ * are invalidated.
+ *
+ * The missing blocks of a range are read together (see cache_fetch), which
+ * with STORAGE_URING submits their reads in one batch (see uring.c).
+ * read_file prefetches the blocks it verifies and reads before hashing them,
+ * so a multi-block read waits for the device once rather than per block.
+ *
+ * Hash tree levels are hashed by multiple threads, so every access takes the
+ * cache lock.
+ */
+
+/*
+ * Removes a slot from the LRU list
+ */
+static void lru_unlink(int32_t slot, cache_t* c) {
+	if (c->prev[slot] >= 0) {
+		c->next[c->prev[slot]] = c->next[slot];
+	} else {
+		c->head = c->next[slot];
+	}
+	if (c->next[slot] >= 0) {
+		c->prev[c->next[slot]] = c->prev[slot];
+	} else {
+		c->tail = c->prev[slot];
+	}
+}
+
+/*
+ * Inserts a slot at the head (most recently used) of the LRU list
+ */
+static void lru_push(int32_t slot, cache_t* c) {
+	c->prev[slot] = -1;
+	c->next[slot] = c->head;
+	if (c->head >= 0) {
+		c->prev[c->head] = slot;
+	} else {
+		c->tail = slot;
+	}
+	c->head = slot;
+}
+
+/*
+ * Assigns a slot to a block which is not held, replacing the least recently
+ * used block if the cache is full, and makes it the most recently used
+ * Must be called while holding the cache lock.
+ *
+ * block: index of block in file_data
+ *
+ * returns: slot assigned (its data is read by cache_fill)
+ */
+static int32_t cache_slot(int64_t block, cache_t* c) {
+	int32_t slot;
+	if (c->used < c->n_slots) {
+		slot = c->used++;
+	} else {
+		slot = c->tail;
+		lru_unlink(slot, c);
+		c->slot_of[c->block_of[slot]] = -1;
+	}
+
+	c->slot_of[block] = slot;
+	c->block_of[slot] = block;
+	lru_push(slot, c);
+	return slot;
+}
+
+/*
+ * Reads blocks into their slots, submitting them together through io_uring
+ * when the cache has a ring, and completing reads which failed or were short
+ * (every read without a ring) with pread
+ * Must be called while holding the cache lock.
+ *
+ * n: number of blocks (at most URING_DEPTH)
+ * blocks: indices of blocks in file_data, which have slots
+ */
+static void cache_fill(int32_t n, const int64_t* blocks, filesys_t* fs) {
+	assert(n <= URING_DEPTH && "too many blocks");
+
+	cache_t* c = fs->cache;
+	uint8_t* bufs[URING_DEPTH];
+	uint64_t offsets[URING_DEPTH];
+	uint32_t lens[URING_DEPTH];
+	uint32_t done[URING_DEPTH];
+	for (int32_t i = 0; i < n; ++i) {
+		bufs[i] = c->data + (uint64_t)c->slot_of[blocks[i]] * CACHE_BLOCK_LEN;
+		offsets[i] = blocks[i] * CACHE_BLOCK_LEN;
+		lens[i] = fs->file_data_len - offsets[i] < CACHE_BLOCK_LEN ?
+				fs->file_data_len - offsets[i] : CACHE_BLOCK_LEN;
+		done[i] = 0;
+	}
+
+	if (c->ring != NULL) {
+		if (n > 1) {
+			++c->batches;
+		}
+		if (uring_read(n, bufs, offsets, lens, done, fs->file_fd, c->ring)) {
+			// A ring which failed is not used again
+			uring_close(c->ring);
+			c->ring = NULL;
+		}
+	}
+
+	for (int32_t i = 0; i < n; ++i) {
+		while (done[i] < lens[i]) {
+			ssize_t r = pread(fs->file_fd, bufs[i] + done[i],
+					lens[i] - done[i], offsets[i] + done[i]);
+			assert(r > 0 && "failed to read file_data");
+			done[i] += r;
+		}
+		memset(bufs[i] + lens[i], 0, CACHE_BLOCK_LEN - lens[i]);
+	}
+	c->misses += n;
+}
+
+/*
+ * Makes the blocks holding a range the most recently used, reading the
+ * blocks which are not held together
+ * Blocks are fetched in groups of at most the number of slots (and
+ * URING_DEPTH), so the blocks of a range longer than the cache replace
+ * earlier blocks of the same range.
+ * Must be called while holding the cache lock.
+ *
+ * offset: offset of range in file_data
+ * length: length of range (bytes after the end of file_data are ignored)
+ */
+static void cache_fetch(uint64_t offset, uint64_t length, filesys_t* fs) {
+	cache_t* c = fs->cache;
+	if (length == 0 || offset >= (uint64_t)fs->file_data_len) {
+		return;
+	}
+	if (length > fs->file_data_len - offset) {
+		length = fs->file_data_len - offset;
+	}
+
+	int32_t group = c->n_slots < URING_DEPTH ? c->n_slots : URING_DEPTH;
+	int64_t last = (offset + length - 1) / CACHE_BLOCK_LEN;
+	for (int64_t first = offset / CACHE_BLOCK_LEN; first <= last;
+			first += group) {
+		int64_t missing[URING_DEPTH];
+		int32_t n = 0;
+		for (int64_t block = first; block <= last && block < first + group;
+				++block) {
+			int32_t slot = c->slot_of[block];
+			if (slot < 0) {
+				missing[n++] = block;
+				cache_slot(block, c);
+				continue;
+			}
+
+			++c->hits;
+			if (c->head != slot) {
+				lru_unlink(slot, c);
+				lru_push(slot, c);
+			}
+		}
+		if (n > 0) {
+			cache_fill(n, missing, fs);
+		}
+	}
+}
+
+/*
+ * Returns the cached data of a block of file_data, reading it if it is not
+ * held (replacing the least recently used block if the cache is full)
+ * Must be called while holding the cache lock.
+ *
+ * block: index of block in file_data
+ *
+ * returns: address of CACHE_BLOCK_LEN bytes of the block (bytes after the end
+ * 			of file_data are zero)
+ */
+static uint8_t* cache_get(int64_t block, filesys_t* fs) {
+	cache_fetch(block * CACHE_BLOCK_LEN, 1, fs);
+	return fs->cache->data +
+			(uint64_t)fs->cache->slot_of[block] * CACHE_BLOCK_LEN;
+}
+
+/*
+ * Writes a range to file_data with pwrite, and to the blocks holding it
+ */
+static void cache_put(uint64_t offset, uint64_t length, const uint8_t* in,
+		filesys_t* fs) {
+	uint64_t pos = 0;
+	while (pos < length) {
+		ssize_t n = pwrite(fs->file_fd, in + pos, length - pos, offset + pos);
+		assert(n > 0 && "failed to write file_data");
+		pos += n;
+	}
+
+	cache_t* c = fs->cache;
+	for (pos = 0; pos < length; ) {
+		int64_t block = (offset + pos) / CACHE_BLOCK_LEN;
+		uint64_t in_block = (offset + pos) % CACHE_BLOCK_LEN;
+		uint64_t n = CACHE_BLOCK_LEN - in_block < length - pos ?
+				CACHE_BLOCK_LEN - in_block : length - pos;
+		if (c->slot_of[block] >= 0) {
+			memcpy(c->data + (uint64_t)c->slot_of[block] * CACHE_BLOCK_LEN +
+					in_block, in + pos, n);
+		}
+		pos += n;
+	}
+}
+
+static void cache_open(filesys_t* fs) {
+	cache_t* c = salloc(sizeof(*c));
+	uint64_t budget = fs->opts.cache_bytes > 0 ?
+			fs->opts.cache_bytes : CACHE_BYTES;
+	int64_t n_blocks = (fs->file_data_len + CACHE_BLOCK_LEN - 1) /
+			CACHE_BLOCK_LEN;
+
+	// At least one block is held, and never more than file_data
+	c->n_slots = budget / CACHE_BLOCK_LEN;
+	if (c->n_slots < 1) {
+		c->n_slots = 1;
+	}
+	if (c->n_slots > n_blocks) {
+		c->n_slots = n_blocks > 0 ? n_blocks : 1;
+	}
+
+	pthread_mutex_init(&c->lock, NULL);
+	c->used = 0;
+	c->slot_of = salloc(sizeof(*c->slot_of) * (n_blocks + 1));
+	memset(c->slot_of, -1, sizeof(*c->slot_of) * (n_blocks + 1));
+	c->block_of = salloc(sizeof(*c->block_of) * c->n_slots);
+	c->prev = salloc(sizeof(*c->prev) * c->n_slots);
+	c->next = salloc(sizeof(*c->next) * c->n_slots);
+	c->head = -1;
+	c->tail = -1;
+	c->data = salloc((uint64_t)c->n_slots * CACHE_BLOCK_LEN);
+	c->hits = 0;
+	c->misses = 0;
+	c->batches = 0;
+	c->ring = fs->opts.storage == STORAGE_URING ?
+			uring_open(fs->file_fd, c->data,
+					(uint64_t)c->n_slots * CACHE_BLOCK_LEN) : NULL;
+
+	fs->cache = c;
+	fs->file = NULL;
+}
+
+static void cache_close(filesys_t* fs) {
+	cache_t* c = fs->cache;
+	uring_close(c->ring);
+	pthread_mutex_destroy(&c->lock);
+	free(c->slot_of);
+	free(c->block_of);
+	free(c->prev);
+	free(c->next);
+	free(c->data);
+	free(c);
+	fs->cache = NULL;
+}
+
+/*
+ * Fetches the blocks of a range in groups, so the missing blocks of each
+ * group are read together, then copies each group
+ */
+static void cache_read(uint64_t offset, uint64_t length, uint8_t* out,
+		filesys_t* fs) {
+	cache_t* c = fs->cache;
+	LOCK(&c->lock);
+	uint64_t group = (uint64_t)(c->n_slots < URING_DEPTH ?
+			c->n_slots : URING_DEPTH) * CACHE_BLOCK_LEN;
+	for (uint64_t pos = 0; pos < length; ) {
+		// Group ends at a block boundary
+		uint64_t end = (offset + pos) / CACHE_BLOCK_LEN * CACHE_BLOCK_LEN +
+				group - offset;
+		if (end > length) {
+			end = length;
+		}
+		cache_fetch(offset + pos, end - pos, fs);
+
+		while (pos < end) {
+			int64_t block = (offset + pos) / CACHE_BLOCK_LEN;
+			uint64_t in_block = (offset + pos) % CACHE_BLOCK_LEN;
+			uint64_t n = CACHE_BLOCK_LEN - in_block < end - pos ?
+					CACHE_BLOCK_LEN - in_block : end - pos;
+			memcpy(out + pos, c->data + (uint64_t)c->slot_of[block] *
+					CACHE_BLOCK_LEN + in_block, n);
+			pos += n;
+		}
+	}
+	UNLOCK(&c->lock);
+}
+
+static void cache_write(uint64_t offset, uint64_t length, const uint8_t* in,
+		filesys_t* fs) {
+	LOCK(&fs->cache->lock);
+	cache_put(offset, length, in, fs);
+	UNLOCK(&fs->cache->lock);
+}
+
+static void cache_zero(uint64_t offset, uint64_t length, filesys_t* fs) {
+	uint8_t* zeros = scalloc(CACHE_BLOCK_LEN);
+	for (uint64_t pos = 0; pos < length; pos += CACHE_BLOCK_LEN) {
+		cache_write(offset + pos, length - pos < CACHE_BLOCK_LEN ?
+				length - pos : CACHE_BLOCK_LEN, zeros, fs);
+	}
+	free(zeros);
+}
+
+static void cache_hash(uint64_t offset, uint64_t length, uint8_t* out,
+		filesys_t* fs) {
+	assert(offset % CACHE_BLOCK_LEN + length <= CACHE_BLOCK_LEN &&
+	       "range spans cache blocks");
+
+	LOCK(&fs->cache->lock);
+	fletcher(cache_get(offset / CACHE_BLOCK_LEN, fs) +
+			offset % CACHE_BLOCK_LEN, length, out);
+	UNLOCK(&fs->cache->lock);
+}
+
+/*
+ * Writes are already in the page cache, so only page cache writeback of the
+ * range is required (started for MS_ASYNC, and waited for with MS_SYNC)
+ */
+static void cache_sync(uint64_t offset, uint64_t length, int flags,
+		filesys_t* fs) {
+	unsigned int sync_flags = flags & MS_SYNC ? SYNC_FILE_RANGE_WAIT_BEFORE |
+			SYNC_FILE_RANGE_WRITE | SYNC_FILE_RANGE_WAIT_AFTER :
+			SYNC_FILE_RANGE_WRITE;
+	sync_file_range(fs->file_fd, offset, length, sync_flags);
+}
+
+/*
+ * sync_file_range does not write the metadata of the file (such as the
+ * allocation of punched pages written since) or flush the device cache, so
+ * the ranges of a flush are made durable with one fdatasync
+ */
+static void cache_flush(filesys_t* fs) {
+	fdatasync(fs->file_fd);
+}
+
+/*
+ * Punches a hole with fallocate, then zeroes the range in the blocks holding
+ * it
+ */
+static int32_t cache_punch(uint64_t offset, uint64_t length, filesys_t* fs) {
+	if (fallocate(fs->file_fd, FALLOC_FL_PUNCH_HOLE | FALLOC_FL_KEEP_SIZE,
+			offset, length)) {
+		return -1;
+	}
+
+	cache_t* c = fs->cache;
+	LOCK(&c->lock);
+	for (uint64_t pos = 0; pos < length; ) {
+		int64_t block = (offset + pos) / CACHE_BLOCK_LEN;
+		uint64_t in_block = (offset + pos) % CACHE_BLOCK_LEN;
+		uint64_t n = CACHE_BLOCK_LEN - in_block < length - pos ?
+				CACHE_BLOCK_LEN - in_block : length - pos;
+		if (c->slot_of[block] >= 0) {
+			memset(c->data + (uint64_t)c->slot_of[block] * CACHE_BLOCK_LEN +
+					in_block, 0, n);
+		}
+		pos += n;
+	}
+	UNLOCK(&c->lock);
+	return 0;
+}
+
+/*
+ * Releases the blocks holding a range, so they are reread when next accessed
+ */
+static void cache_invalidate(uint64_t offset, uint64_t length, filesys_t* fs) {
+	if (length == 0) {
+		return;
+	}
+
+	cache_t* c = fs->cache;
+	LOCK(&c->lock);
+	int64_t last = (offset + length - 1) / CACHE_BLOCK_LEN;
+	for (int64_t block = offset / CACHE_BLOCK_LEN; block <= last; ++block) {
+		int32_t slot = c->slot_of[block];
+		if (slot < 0) {
+			continue;
+		}
+
+		// Move the last used slot into the released slot, so used slots stay
+		// contiguous
+		lru_unlink(slot, c);
+		c->slot_of[block] = -1;
+		int32_t moved = --c->used;
+		if (moved != slot) {
+			lru_unlink(moved, c);
+			memcpy(c->data + (uint64_t)slot * CACHE_BLOCK_LEN,
+					c->data + (uint64_t)moved * CACHE_BLOCK_LEN,
+					CACHE_BLOCK_LEN);
+			c->block_of[slot] = c->block_of[moved];
+			c->slot_of[c->block_of[slot]] = slot;
+			lru_push(slot, c);
+		}
+	}
+	UNLOCK(&c->lock);
+}
+
+/*
+ * Fetches the blocks at the start of a range, at most the number of slots, so
+ * the blocks about to be hashed and read are requested together
+ */
+static void cache_prefetch(uint64_t offset, uint64_t length, filesys_t* fs) {
+	cache_t* c = fs->cache;
+	LOCK(&c->lock);
+	uint64_t limit = (uint64_t)c->n_slots * CACHE_BLOCK_LEN -
+			offset % CACHE_BLOCK_LEN;
+	cache_fetch(offset, length < limit ? length : limit, fs);
+	UNLOCK(&c->lock);
+}
+
+/*
+ * Copies a range of at most CACHE_MOVE_LEN bytes within file_data
+ * Ranges which do not overlap their destination are copied with
+ * copy_file_range, so the data is not copied through user space. Otherwise,
+ * or where copy_file_range is not supported, the whole range is read into a
+ * buffer (allocated on first use) before it is written.
+ *
+ * buf: pointer to the buffer (NULL if not yet allocated)
+ * copy: pointer to whether copy_file_range may be used, cleared if it fails
+ */
+static void cache_copy(uint64_t dest, uint64_t src, uint64_t length,
+		uint8_t** buf, int32_t* copy, filesys_t* fs) {
+	uint64_t distance = dest < src ? src - dest : dest - src;
+	while (*copy && distance >= length && length > 0) {
+		loff_t in = src;
+		loff_t out = dest;
+		ssize_t n = copy_file_range(fs->file_fd, &in, fs->file_fd, &out,
+				length, 0);
+		if (n <= 0) {
+			*copy = 0;
+			break;
+		}
+		src += n;
+		dest += n;
+		length -= n;
+	}
+	if (length == 0) {
+		return;
+	}
+
+	if (*buf == NULL) {
+		*buf = salloc(CACHE_MOVE_LEN);
+	}
+	for (uint64_t pos = 0; pos < length; ) {
+		ssize_t n = pread(fs->file_fd, *buf + pos, length - pos, src + pos);
+		assert(n > 0 && "failed to read file_data");
+		pos += n;
+	}
+	for (uint64_t pos = 0; pos < length; ) {
+		ssize_t n = pwrite(fs->file_fd, *buf + pos, length - pos, dest + pos);
+		assert(n > 0 && "failed to write file_data");
+		pos += n;
+	}
+}
+
+/*
+ * Copies a range within file_data through its file descriptor in chunks of
+ * CACHE_MOVE_LEN bytes, in the direction which reads each source byte before
+ * it is overwritten
+ * The cache is write-through, so file_data is current, and the cache lock is
+ * not held while copying. The blocks holding the destination are released
+ * once it is written.
+ */
+static void cache_move(uint64_t dest, uint64_t src, uint64_t length,
+		filesys_t* fs) {
+	if (dest == src || length == 0) {
+		return;
+	}
+
+	uint8_t* buf = NULL;
+	int32_t copy = 1;
+	for (uint64_t done = 0; done < length; ) {
+		uint64_t n = length - done < CACHE_MOVE_LEN ?
+				length - done : CACHE_MOVE_LEN;
+		uint64_t pos = dest < src ? done : length - done - n;
+		cache_copy(dest + pos, src + pos, n, &buf, &copy, fs);
+		done += n;
+	}
+	free(buf);
+	cache_invalidate(dest, length, fs);
+}
+
+const storage_ops_t pread_storage = {
+	.open = cache_open,
+	.close = cache_close,
+	.read = cache_read,
+	.write = cache_write,
+	.move = cache_move,
+	.zero = cache_zero,
+	.hash = cache_hash,
+	.sync = cache_sync,
+	.flush = cache_flush,
+	.punch = cache_punch,
+	.invalidate = cache_invalidate,
+	.prefetch = cache_prefetch
+};
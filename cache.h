@@ -0,0 +1,8 @@
+#ifndef CACHE_H
+#define CACHE_H
+
+#include "structs.h"
+
+extern const storage_ops_t pread_storage;
+
+#endif
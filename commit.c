@@ -0,0 +1,307 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <pthread.h>
+#include <sys/mman.h>
+#include <assert.h>
+
+#include "structs.h"
+#include "helper.h"
+#include "commit.h"
+#include "journal.h"
+#include "storage.h"
+
+/*
+ * Durability and Group Commit
+ *
+ * Each operation records the ranges it modifies in the dirty lists of the
+ * filesystem (see dirty_add). When the operation completes, commit_op moves
+ * the ranges to the pending lists and gives the operation a ticket. How the
+ * pending ranges are written to disk depends on opts.durability.
+ *
+ * DURABILITY_NONE: ranges are discarded and data reaches disk when the
+ * kernel writes back the page cache (or on sync_fs).
+ *
+ * DURABILITY_PERIODIC: a flush thread synchronises all pending ranges every
+ * opts.flush_ms milliseconds, so writes are coalesced across operations.
+ *
+ * DURABILITY_SYNC: operations wait (after releasing the filesystem lock)
+ * until their ticket has been synchronised. One waiting operation flushes
+ * the ranges of every operation committed so far with msync(MS_SYNC), while
+ * the others wait. Operations committed during a flush are all covered by
+ * the next flush, so concurrent operations share a single sync.
+ *
+ * With a journal, a flush synchronises the file_data ranges and writes one
+ * journal record instead of synchronising dir_table and hash_data (see
+ * journal.c). Operations moving files or freeing space wait for their
+ * journal records with commit_barrier, and moves checkpoint the journal with
+ * commit_checkpoint, while holding the filesystem lock (flushes never take
+ * it), so no other operation reuses space the journal still refers to.
+ *
+ * The pending lists and tickets are protected by commit_lock, which is
+ * never held while synchronising, and is only taken while holding the
+ * filesystem lock (never the reverse).
+ */
+
+/*
+ * Adds every range of one dirty list to another
+ */
+static void dirty_merge(dirty_t* dst, dirty_t* src) {
+	for (int32_t i = 0; i < src->count; ++i) {
+		dirty_add(dst, src->start[i], src->end[i] - src->start[i]);
+	}
+}
+
+/*
+ * Synchronises all pending ranges, marking every ticket committed so far as
+ * synchronised
+ * Must be called while holding commit_lock when no flush is in progress,
+ * which is released during the flush.
+ */
+static void commit_flush(filesys_t* fs) {
+	dirty_t file = fs->pending_file;
+	dirty_t dir = fs->pending_dir;
+	dirty_t hash = fs->pending_hash;
+	uint8_t* journal_buf = fs->journal_buf;
+	uint64_t journal_buf_len = fs->journal_buf_len;
+	uint64_t seq = fs->commit_seq;
+	fs->pending_file.count = 0;
+	fs->pending_dir.count = 0;
+	fs->pending_hash.count = 0;
+	fs->journal_buf = NULL;
+	fs->journal_buf_len = 0;
+	fs->flushing = 1;
+	UNLOCK(&fs->commit_lock);
+
+	// Data and hashes are synchronised before the dir_table entries
+	// referring to them
+	storage_sync(&file, MS_SYNC, fs);
+	if (fs->journal_fd >= 0) {
+		journal_flush(journal_buf, journal_buf_len, fs);
+		free(journal_buf);
+	} else {
+		dirty_sync(&hash, fs->hash, MS_SYNC);
+		dirty_sync(&dir, fs->dir, MS_SYNC);
+	}
+
+	LOCK(&fs->commit_lock);
+	fs->flushing = 0;
+	fs->synced_seq = seq;
+	++fs->flushes;
+	pthread_cond_broadcast(&fs->commit_cond);
+}
+
+/*
+ * Moves the ranges recorded by an operation to the pending lists
+ * Must be called while holding the filesystem lock
+ *
+ * returns: ticket of the ranges
+ */
+static uint64_t commit_ranges(filesys_t* fs) {
+	LOCK(&fs->commit_lock);
+	dirty_merge(&fs->pending_file, &fs->dirty_file);
+	dirty_merge(&fs->pending_dir, &fs->dirty_dir);
+	dirty_merge(&fs->pending_hash, &fs->dirty_hash);
+	if (fs->journal_fd >= 0) {
+		journal_append(fs);
+	}
+	uint64_t ticket = ++fs->commit_seq;
+	UNLOCK(&fs->commit_lock);
+
+	fs->dirty_file.count = 0;
+	fs->dirty_dir.count = 0;
+	fs->dirty_hash.count = 0;
+	return ticket;
+}
+
+/*
+ * Commits the ranges modified by an operation, called at the end of each
+ * operation while holding the filesystem lock
+ *
+ * returns: ticket to pass to commit_wait once the lock is released, or 0 if
+ * 			the operation does not wait for its ranges to be synchronised
+ */
+uint64_t commit_op(filesys_t* fs) {
+	if (fs->opts.durability == DURABILITY_NONE) {
+		fs->dirty_file.count = 0;
+		fs->dirty_dir.count = 0;
+		fs->dirty_hash.count = 0;
+		return 0;
+	}
+
+	// With a journal, space freed by the operation may still be referred to
+	// by the last record written, so it is only reused once the record of
+	// the operation is written
+	if (fs->journal_fd >= 0 && fs->journal_freed) {
+		fs->journal_freed = 0;
+		commit_barrier(fs);
+		return 0;
+	}
+
+	uint64_t ticket = commit_ranges(fs);
+	return fs->opts.durability == DURABILITY_SYNC ? ticket : 0;
+}
+
+/*
+ * Waits until the ranges of a ticket are synchronised, flushing the pending
+ * ranges if no other thread is
+ * Must be called without holding the filesystem lock (except by
+ * commit_barrier), so other operations continue while it waits.
+ *
+ * ticket: ticket returned by commit_op (0 returns immediately)
+ */
+void commit_wait(uint64_t ticket, filesys_t* fs) {
+	if (ticket == 0) {
+		return;
+	}
+
+	LOCK(&fs->commit_lock);
+	while (fs->synced_seq < ticket) {
+		if (fs->flushing) {
+			pthread_cond_wait(&fs->commit_cond, &fs->commit_lock);
+		} else {
+			commit_flush(fs);
+		}
+	}
+	UNLOCK(&fs->commit_lock);
+}
+
+/*
+ * Commits the ranges recorded so far by the current operation and waits
+ * until they are synchronised, with its journal record written
+ * Must be called while holding the filesystem lock, with a journal.
+ */
+void commit_barrier(filesys_t* fs) {
+	assert(fs->journal_fd >= 0 && "no journal");
+
+	uint64_t ticket = commit_ranges(fs);
+	commit_wait(ticket, fs);
+}
+
+/*
+ * Commits the ranges recorded so far by the current operation, waits until
+ * every committed operation is synchronised, then checkpoints the journal
+ * with no flush in progress
+ * Must be called while holding the filesystem lock, with a journal.
+ */
+void commit_checkpoint(filesys_t* fs) {
+	assert(fs->journal_fd >= 0 && "no journal");
+
+	uint64_t ticket = commit_ranges(fs);
+	LOCK(&fs->commit_lock);
+	while (fs->synced_seq < ticket || fs->flushing) {
+		if (fs->flushing) {
+			pthread_cond_wait(&fs->commit_cond, &fs->commit_lock);
+		} else {
+			commit_flush(fs);
+		}
+	}
+	fs->flushing = 1;
+	UNLOCK(&fs->commit_lock);
+
+	journal_checkpoint(fs);
+
+	LOCK(&fs->commit_lock);
+	fs->flushing = 0;
+	pthread_cond_broadcast(&fs->commit_cond);
+	UNLOCK(&fs->commit_lock);
+}
+
+/*
+ * Periodic flush thread
+ * Flushes pending ranges every opts.flush_ms milliseconds (FLUSH_INTERVAL_MS
+ * if 0) until stopped
+ */
+static void* flush_worker(void* arg) {
+	filesys_t* fs = arg;
+	uint32_t interval = fs->opts.flush_ms > 0 ?
+			fs->opts.flush_ms : FLUSH_INTERVAL_MS;
+
+	LOCK(&fs->commit_lock);
+	while (!fs->flush_stop) {
+		struct timespec t;
+		clock_gettime(CLOCK_REALTIME, &t);
+		t.tv_nsec += interval * 1000000L;
+		t.tv_sec += t.tv_nsec / 1000000000L;
+		t.tv_nsec %= 1000000000L;
+		pthread_cond_timedwait(&fs->flush_cond, &fs->commit_lock, &t);
+
+		if (!fs->flushing && fs->synced_seq < fs->commit_seq) {
+			commit_flush(fs);
+		}
+	}
+	UNLOCK(&fs->commit_lock);
+
+	return NULL;
+}
+
+/*
+ * Initialises commit state, starting the flush thread for
+ * DURABILITY_PERIODIC
+ */
+void commit_start(filesys_t* fs) {
+	assert(fs != NULL && "invalid args");
+
+	pthread_mutex_init(&fs->commit_lock, NULL);
+	pthread_cond_init(&fs->commit_cond, NULL);
+	pthread_cond_init(&fs->flush_cond, NULL);
+	memset(&fs->pending_file, 0, sizeof(fs->pending_file));
+	memset(&fs->pending_dir, 0, sizeof(fs->pending_dir));
+	memset(&fs->pending_hash, 0, sizeof(fs->pending_hash));
+	fs->commit_seq = 0;
+	fs->synced_seq = 0;
+	fs->flushing = 0;
+	fs->flushes = 0;
+	fs->flush_stop = 0;
+
+	if (fs->opts.durability == DURABILITY_PERIODIC) {
+		assert(!pthread_create(&fs->flusher, NULL, flush_worker, fs) &&
+		       "failed to create flush thread");
+	}
+}
+
+/*
+ * Stops the flush thread and synchronises any pending ranges, then frees
+ * commit state
+ */
+void commit_stop(filesys_t* fs) {
+	assert(fs != NULL && "invalid args");
+
+	if (fs->opts.durability == DURABILITY_PERIODIC) {
+		LOCK(&fs->commit_lock);
+		fs->flush_stop = 1;
+		pthread_cond_signal(&fs->flush_cond);
+		UNLOCK(&fs->commit_lock);
+		pthread_join(fs->flusher, NULL);
+	}
+	commit_wait(fs->commit_seq, fs);
+
+	pthread_mutex_destroy(&fs->commit_lock);
+	pthread_cond_destroy(&fs->commit_cond);
+	pthread_cond_destroy(&fs->flush_cond);
+}
+
+/*
+ * Writes every completed operation to disk, as for fsync
+ * With DURABILITY_NONE, no ranges are pending, so the whole of each mapping
+ * is synchronised.
+ */
+void sync_fs(void* helper) {
+	filesys_t* fs = (filesys_t*)helper;
+	assert(fs != NULL && "invalid args");
+	LOCK_FS(fs);
+
+	if (fs->opts.durability == DURABILITY_NONE) {
+		fs->storage->sync(0, fs->file_data_len, MS_SYNC, fs);
+		fs->storage->flush(fs);
+		msync(fs->hash, fs->hash_data_len, MS_SYNC);
+		msync(fs->dir, fs->dir_table_len, MS_SYNC);
+		UNLOCK_FS(fs);
+		return;
+	}
+
+	uint64_t ticket = commit_ranges(fs);
+	UNLOCK_FS(fs);
+	commit_wait(ticket, fs);
+}
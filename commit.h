@@ -0,0 +1,20 @@
+#ifndef COMMIT_H
+#define COMMIT_H
+
+#include "structs.h"
+
+uint64_t commit_op(filesys_t* fs);
+
+void commit_wait(uint64_t ticket, filesys_t* fs);
+
+void commit_barrier(filesys_t* fs);
+
+void commit_checkpoint(filesys_t* fs);
+
+void commit_start(filesys_t* fs);
+
+void commit_stop(filesys_t* fs);
+
+void sync_fs(void* helper);
+
+#endif
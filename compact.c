@@ -0,0 +1,233 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <sched.h>
+#include <sys/mman.h>
+#include <assert.h>
+
+#include "structs.h"
+#include "helper.h"
+#include "arr.h"
+#include "myfilesystem.h"
+#include "compact.h"
+#include "metrics.h"
+#include "commit.h"
+#include "storage.h"
+
+/*
+ * Background Compaction
+ *
+ * Repacking during create_file, resize_file or write_file delays the operation
+ * by the time taken to move files. When enabled (opts.compactor), a
+ * background thread instead fills gaps in file_data with files from later in
+ * file_data whenever free space is fragmented (the largest free extent is
+ * smaller than the total free space), so foreground operations usually find
+ * a contiguous gap.
+ *
+ * Each compaction step moves one file while holding the filesystem lock.
+ * Steps only start with pthread_mutex_trylock when no operation is waiting
+ * for the lock (see LOCK_FS), so client operations take priority, and files
+ * larger than the step size are never moved by the compactor.
+ *
+ * Files are only moved to a gap at least as large as the file, so the source
+ * and destination never overlap. The data and the hashes of its blocks are
+ * synchronised at its new offset before the dir_table offset is updated (the
+ * new offset was free, so no file refers to those hashes yet), then the
+ * dir_table entry is synchronised. After a crash dir_table refers to either
+ * the old or new copy, and both are intact with matching hashes. With a
+ * journal, the hashes and entry are instead written in a journal record
+ * (see journal.c), which the step waits for before releasing the lock, so
+ * the old copy is not reused while the journal still refers to it.
+ */
+
+/*
+ * Returns the largest free extent in file_data by scanning the offset array
+ * Free space is fragmented if this is less than the free bytes outside the
+ * extents of files (space after files lost to alignment or reserved for
+ * appends is not free). compact_step uses the incrementally maintained
+ * metrics_largest_free, which only calls this when the previous largest
+ * extent has been removed.
+ */
+uint64_t largest_free_extent(filesys_t* fs) {
+	assert(fs != NULL && "invalid args");
+
+	uint64_t* offsets = fs->o_list->offset;
+	uint32_t* lengths = fs->o_list->length;
+	uint64_t end_prev_file = 0;
+	uint64_t largest = 0;
+	for (int32_t i = 0; i <= fs->o_list->size; ++i) {
+		uint64_t start = i < fs->o_list->size ?
+				offsets[i] : (uint64_t)fs->file_data_len;
+		if (start - end_prev_file > largest) {
+			largest = start - end_prev_file;
+		}
+		if (i < fs->o_list->size) {
+			end_prev_file = offsets[i] + lengths[i];
+		}
+	}
+	return largest;
+}
+
+/*
+ * Moves a file to a free offset without overlapping its current data
+ * The new copy and the hashes of its blocks are synchronised before
+ * dir_table refers to it
+ *
+ * file: file_t of file being moved
+ * new_offset: offset of free space of at least file->length bytes
+ */
+static void compact_move(file_t* file, uint64_t new_offset, filesys_t* fs) {
+	assert(new_offset + file->length <= file->offset ||
+	       file->offset + file->length <= new_offset);
+
+	fs->storage->move(new_offset, file->offset, file->length, fs);
+	dirty_add(&fs->dirty_file, new_offset, file->length);
+	compute_hash_block_range(new_offset, file->length, fs);
+	storage_sync(&fs->dirty_file, MS_SYNC, fs);
+	if (fs->journal_fd < 0) {
+		dirty_sync(&fs->dirty_hash, fs->hash, MS_SYNC);
+	}
+
+	// The file may move before other files, so its position in the offset
+	// array is found again
+	arr_remove(file->o_index, fs->o_list);
+	update_file_offset(new_offset, file);
+	arr_sorted_insert(file, fs->o_list);
+
+	update_dir_offset(file, fs);
+	if (fs->journal_fd < 0) {
+		dirty_sync(&fs->dirty_dir, fs->dir, MS_SYNC);
+		commit_op(fs);
+	} else {
+		commit_barrier(fs);
+	}
+}
+
+/*
+ * Performs one compaction step, independent of the filesystem lock state
+ * Starting from the first gap, the file directly after a gap is moved to the
+ * start of the gap if it fits. Otherwise the last file in file_data which
+ * fits is moved into the gap.
+ *
+ * step: maximum length of file moved
+ *
+ * returns: number of bytes moved, 0 if free space is not fragmented or no
+ * 			file could be moved
+ */
+uint64_t compact_step(uint64_t step, filesys_t* fs) {
+	assert(fs != NULL && "invalid args");
+
+	if (metrics_largest_free(fs) >= fs->metrics.free_bytes) {
+		return 0;
+	}
+
+	int32_t size = fs->o_list->size;
+	uint64_t* offsets = fs->o_list->offset;
+	uint32_t* lengths = fs->o_list->length;
+	uint64_t end_prev_file = 0;
+	for (int32_t i = 0; i < size; ++i) {
+		uint64_t gap = offsets[i] - end_prev_file;
+		if (gap > 0) {
+			// File directly after gap
+			if (lengths[i] <= gap && lengths[i] <= step) {
+				uint32_t moved = lengths[i];
+				compact_move(fs->o_list->list[i], end_prev_file, fs);
+				fs->metrics.compact_bytes += moved;
+				return moved;
+			}
+
+			// Last file which fits in gap
+			for (int32_t j = size - 1; j > i; --j) {
+				if (lengths[j] <= gap && lengths[j] <= step) {
+					uint32_t moved = lengths[j];
+					compact_move(fs->o_list->list[j], end_prev_file, fs);
+					fs->metrics.compact_bytes += moved;
+					return moved;
+				}
+			}
+		}
+		end_prev_file = offsets[i] + lengths[i];
+	}
+
+	return 0;
+}
+
+/*
+ * Background compaction thread
+ * Runs compaction steps while no operation is waiting for the filesystem
+ * lock, and waits for COMPACT_IDLE_MS (or until woken by compact_wake) when
+ * no step is possible
+ */
+static void* compact_worker(void* arg) {
+	filesys_t* fs = arg;
+	uint64_t step = fs->opts.compact_step > 0 ?
+			fs->opts.compact_step : COMPACT_STEP_LEN;
+
+	while (!__atomic_load_n(&fs->compact_stop, __ATOMIC_SEQ_CST)) {
+		// Give priority to operations waiting for the lock
+		if (__atomic_load_n(&fs->lock_waiters, __ATOMIC_SEQ_CST) > 0 ||
+			pthread_mutex_trylock(&fs->lock)) {
+			usleep(COMPACT_BACKOFF_US);
+			continue;
+		}
+
+		if (!fs->compact_stop && compact_step(step, fs) > 0) {
+			UNLOCK_FS(fs);
+			sched_yield();
+			continue;
+		}
+
+		// Wait while free space is not fragmented
+		if (!fs->compact_stop) {
+			struct timespec t;
+			clock_gettime(CLOCK_REALTIME, &t);
+			t.tv_nsec += COMPACT_IDLE_MS * 1000000L;
+			t.tv_sec += t.tv_nsec / 1000000000L;
+			t.tv_nsec %= 1000000000L;
+			pthread_cond_timedwait(&fs->compact_cond, &fs->lock, &t);
+		}
+		UNLOCK_FS(fs);
+	}
+
+	return NULL;
+}
+
+/*
+ * Starts the background compaction thread
+ */
+void compact_start(filesys_t* fs) {
+	assert(fs != NULL && "invalid args");
+
+	fs->compact_stop = 0;
+	assert(!pthread_create(&fs->compactor, NULL, compact_worker, fs) &&
+	       "failed to create compaction thread");
+}
+
+/*
+ * Wakes the background compaction thread after space is freed
+ * Must be called while holding the filesystem lock
+ */
+void compact_wake(filesys_t* fs) {
+	assert(fs != NULL && "invalid args");
+
+	if (fs->opts.compactor) {
+		pthread_cond_signal(&fs->compact_cond);
+	}
+}
+
+/*
+ * Stops the background compaction thread, waiting for the current step
+ */
+void compact_stop(filesys_t* fs) {
+	assert(fs != NULL && "invalid args");
+
+	LOCK_FS(fs);
+	__atomic_store_n(&fs->compact_stop, 1, __ATOMIC_SEQ_CST);
+	pthread_cond_signal(&fs->compact_cond);
+	UNLOCK_FS(fs);
+
+	pthread_join(fs->compactor, NULL);
+}
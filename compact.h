@@ -0,0 +1,16 @@
+#ifndef COMPACT_H
+#define COMPACT_H
+
+#include "structs.h"
+
+uint64_t largest_free_extent(filesys_t* fs);
+
+uint64_t compact_step(uint64_t step, filesys_t* fs);
+
+void compact_start(filesys_t* fs);
+
+void compact_wake(filesys_t* fs);
+
+void compact_stop(filesys_t* fs);
+
+#endif
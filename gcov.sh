@@ -12,13 +12,13 @@ cd cov
 
 # Compile program
 gcc -O0 -std=gnu11 -fsanitize=address -Wall -Werror -g -fprofile-arcs -ftest-coverage \
--o runtest runtest.c myfilesystem.c helper.c arr.c -lfuse -lm -lpthread
+-o runtest runtest.c myfilesystem.c helper.c arr.c sidecar.c compact.c metrics.c commit.c journal.c storage.c cache.c uring.c -lfuse -lm -lpthread
 
 # Run program
 ./runtest
 
 # Generate coverage data
-gcov runtest.c myfilesystem.c helper.c arr.c
+gcov runtest.c myfilesystem.c helper.c arr.c sidecar.c compact.c metrics.c commit.c journal.c storage.c cache.c uring.c
 
 # Remove .c and .h files to prevent conflicts with Ed "Run" button
 rm *.c *.h
\ No newline at end of file
@@ -3,9 +3,21 @@
 #include <stdint.h>
 #include <string.h>
 #include <unistd.h>
+#include <pthread.h>
 #include <sys/mman.h>
 #include <assert.h>
 
+#if defined(__SSE2__)
+#include <immintrin.h>
+#endif
+
+// AVX2 variants are compiled for x86-64 regardless of the target flags, and
+// selected at run time when the processor supports them
+#if defined(__x86_64__) && defined(__GNUC__)
+#define AVX2_DISPATCH
+#define HAS_AVX2 (__builtin_cpu_supports("avx2"))
+#endif
+
 #include "structs.h"
 #include "helper.h"
 
@@ -38,6 +50,7 @@ void* scalloc(size_t size) {
 
 /*
  * Creates a new dynamically allocated file_t struct
+ * Storage for the name is allocated directly after the struct
  *
  * name: name of file
  * offset: file offset in file_data
@@ -47,10 +60,56 @@ void* scalloc(size_t size) {
  * returns: address of heap allocated file_t struct
  */
 file_t* file_init(char* name, uint64_t offset, uint32_t length, int32_t index) {
-	file_t* f = salloc(sizeof(*f));
+	file_t* f = salloc(sizeof(*f) + NAME_LEN);
+	f->name = (char*)(f + 1);
 	update_file_name(name, f);
 	update_file_offset(offset, f);
 	update_file_length(length, f);
+	f->written = length;
+	f->reserve = 0;
+	f->writes = 0;
+	f->grows = 0;
+	f->index = index;
+	f->o_index = -1;
+	f->n_index = -1;
+	return f;
+}
+
+/*
+ * Creates a new dynamically allocated file_t struct for an entry in dir_table
+ *
+ * If the mapped_names option is set, the name of the file_t references the
+ * name field of the entry in the dir_table mapping rather than a copy, so
+ * name updates are written to dir_table directly. Existing names which are
+ * not zero padded (see name_cmp) are copied instead, as entries are loaded
+ * concurrently and must not be modified. Otherwise, this is equivalent to
+ * file_init.
+ *
+ * name: name of file, or the name field of the entry if already written
+ * offset: file offset in file_data
+ * length: number of bytes in file_data used by file
+ * index: entry number in dir_table
+ *
+ * returns: address of heap allocated file_t struct
+ */
+file_t* file_init_dir(char* name, uint64_t offset, uint32_t length,
+		int32_t index, filesys_t* fs) {
+	char* entry = (char*)fs->dir + index * META_LEN;
+	if (!fs->opts.mapped_names || (name == entry && !name_padded(entry))) {
+		return file_init(name, offset, length, index);
+	}
+
+	file_t* f = salloc(sizeof(*f));
+	f->name = entry;
+	if (name != entry) {
+		update_file_name(name, f);
+	}
+	update_file_offset(offset, f);
+	update_file_length(length, f);
+	f->written = length;
+	f->reserve = 0;
+	f->writes = 0;
+	f->grows = 0;
 	f->index = index;
 	f->o_index = -1;
 	f->n_index = -1;
@@ -68,6 +127,7 @@ void free_file(file_t* file) {
 
 /*
  * Updates name field of file_t struct
+ * The name is zero padded to NAME_LEN bytes, as required by name_cmp
  * Other file_t field update helpers are defined as macros in helper.h
  *
  * name: new name for file_t struct
@@ -78,6 +138,99 @@ void update_file_name(char* name, file_t* file) {
 	file->name[NAME_LEN - 1] = '\0';
 }
 
+/*
+ * Checks whether a name field is terminated within NAME_LEN - 1 characters
+ * and zero padded after the null terminator (as written by update_file_name)
+ *
+ * name: address of NAME_LEN byte name field
+ *
+ * returns: 1 if the field is zero padded, 0 otherwise
+ */
+int32_t name_padded(char* name) {
+	size_t len = strnlen(name, NAME_LEN - 1);
+	for (size_t i = len; i < NAME_LEN; ++i) {
+		if (name[i] != '\0') {
+			return 0;
+		}
+	}
+	return 1;
+}
+
+#if defined(AVX2_DISPATCH)
+// name_cmp comparing 32 bytes at a time
+__attribute__((target("avx2")))
+static int32_t name_cmp_avx2(const uint8_t* x, const uint8_t* y) {
+	for (int32_t i = 0; i < NAME_LEN; i += 32) {
+		__m256i eq = _mm256_cmpeq_epi8(
+				_mm256_loadu_si256((const __m256i*)(x + i)),
+				_mm256_loadu_si256((const __m256i*)(y + i)));
+		uint32_t mask = ~(uint32_t)_mm256_movemask_epi8(eq);
+		if (mask != 0) {
+			int32_t j = i + __builtin_ctz(mask);
+			return (int32_t)x[j] - (int32_t)y[j];
+		}
+	}
+	return 0;
+}
+#endif
+
+/*
+ * Compares two file names stored in NAME_LEN byte fields
+ * Both names must be zero padded to NAME_LEN bytes (as written by
+ * update_file_name), which allows entire fields to be compared with vector
+ * instructions instead of testing each byte for a null terminator
+ *
+ * a: first zero padded name
+ * b: second zero padded name
+ *
+ * returns: negative, 0 or positive, matching strncmp(a, b, NAME_LEN - 1)
+ */
+int32_t name_cmp(char* a, char* b) {
+	const uint8_t* x = (const uint8_t*)a;
+	const uint8_t* y = (const uint8_t*)b;
+
+#if defined(AVX2_DISPATCH)
+	if (HAS_AVX2) {
+		return name_cmp_avx2(x, y);
+	}
+#endif
+#if defined(__SSE2__)
+	for (int32_t i = 0; i < NAME_LEN; i += 16) {
+		__m128i eq = _mm_cmpeq_epi8(
+				_mm_loadu_si128((const __m128i*)(x + i)),
+				_mm_loadu_si128((const __m128i*)(y + i)));
+		uint32_t mask = ~(uint32_t)_mm_movemask_epi8(eq) & 0xFFFF;
+		if (mask != 0) {
+			int32_t j = i + __builtin_ctz(mask);
+			return (int32_t)x[j] - (int32_t)y[j];
+		}
+	}
+	return 0;
+#else
+	for (int32_t i = 0; i < NAME_LEN; ++i) {
+		if (x[i] != y[i]) {
+			return (int32_t)x[i] - (int32_t)y[i];
+		}
+	}
+	return 0;
+#endif
+}
+
+/*
+ * Updates the name field for a file in dir_table
+ * Names which reference dir_table directly (see file_init_dir) are already
+ * up to date
+ *
+ * file: address of heap allocated file_t struct to update
+ */
+void update_dir_name(file_t* file, filesys_t* fs) {
+	char* entry = (char*)fs->dir + file->index * META_LEN;
+	if (file->name != entry) {
+		memcpy(entry, file->name, strlen(file->name) + 1);
+	}
+	dirty_add(&fs->dirty_dir, file->index * META_LEN, NAME_LEN);
+}
+
 /*
  * Updates the offset field for a file in dir_table
  * Other dir_table field update helpers are defined as macros in helper.h
@@ -85,16 +238,10 @@ void update_file_name(char* name, file_t* file) {
  * file: address of heap allocated file_t struct to update
  */
 void update_dir_offset(file_t* file, filesys_t* fs) {
-	// Write 0 to dir_table if newly created zero size file
-	if (file->offset >=  MAX_FILE_DATA_LEN) {
-		memset(fs->dir + file->index * META_LEN + NAME_LEN,
-			   '\0', sizeof(uint32_t));
-
-	// Otherwise write the internal file offset to dir_table
-	} else {
-		memcpy(fs->dir + file->index * META_LEN + NAME_LEN,
-			   &file->offset, sizeof(uint32_t));
-	}
+	memcpy(fs->dir + file->index * META_LEN + NAME_LEN,
+		   &file->offset, sizeof(uint32_t));
+	dirty_add(&fs->dirty_dir, file->index * META_LEN + NAME_LEN,
+			sizeof(uint32_t));
 }
 
 /*
@@ -109,37 +256,304 @@ void write_dir_file(file_t* file, filesys_t* fs) {
 }
 
 /*
- * Finds the first non-zero size file in file_data, starting at index
+ * Runs tasks on separate threads, returning once all tasks are complete
+ * The last task is run on the calling thread
+ *
+ * tasks: array of task structs, each passed by address to worker
+ * task_len: size of each task struct in bytes
+ * count: number of tasks
+ * worker: function run for each task
+ */
+void run_tasks(void* tasks, size_t task_len, int32_t count,
+		void* (*worker)(void*)) {
+	assert(tasks != NULL && count > 0 && worker != NULL && "invalid args");
+	
+	uint8_t* task = tasks;
+	pthread_t* threads = salloc(sizeof(*threads) * count);
+	for (int32_t i = 0; i < count - 1; ++i) {
+		assert(!pthread_create(&threads[i], NULL, worker, task + i * task_len) &&
+		       "failed to create thread");
+	}
+	worker(task + (count - 1) * task_len);
+	for (int32_t i = 0; i < count - 1; ++i) {
+		pthread_join(threads[i], NULL);
+	}
+	free(threads);
+}
+
+#if defined(AVX2_DISPATCH)
+/*
+ * Sets the bits of dir_used_mask for whole groups of eight entries, gathering
+ * and comparing their first bytes at once
+ *
+ * returns: number of entries checked (a multiple of eight)
+ */
+__attribute__((target("avx2")))
+static int32_t dir_used_mask_avx2(uint8_t* dir, int32_t count,
+		uint32_t* mask) {
+	// Offsets of eight consecutive entries
+	const __m256i stride = _mm256_setr_epi32(0, META_LEN, 2 * META_LEN,
+			3 * META_LEN, 4 * META_LEN, 5 * META_LEN, 6 * META_LEN,
+			7 * META_LEN);
+	const __m256i low_byte = _mm256_set1_epi32(0xFF);
+	int32_t i = 0;
+	for (; i + 8 <= count; i += 8) {
+		__m256i first = _mm256_and_si256(_mm256_i32gather_epi32(
+				(const int*)(dir + i * META_LEN), stride, 1), low_byte);
+		__m256i unused = _mm256_cmpeq_epi32(first, _mm256_setzero_si256());
+		uint32_t bits = ~_mm256_movemask_ps(_mm256_castsi256_ps(unused)) & 0xFF;
+		*mask |= bits << i;
+	}
+	return i;
+}
+#endif
+
+/*
+ * Returns a bit mask of used dir_table entries (entries with a name that does
+ * not start with a null byte), starting from the entry at dir
+ * The first bytes of eight entries are gathered and compared at once when
+ * the processor supports AVX2
  *
- * index: first index to start searching for non-zero size files
- * o_list: address of offset sorted array
+ * dir: address of first dir_table entry to check
+ * count: number of entries to check (at most 32)
  *
- * returns: file_t* for first non-zero size file from index
- * 			to the end of the array
- * 			NULL if no non-zero size files found
+ * returns: mask with bit i set if entry i is used
  */
-file_t* find_next_nonzero_file(int32_t index, arr_t* arr) {
-	file_t** o_list = arr->list;
-	int32_t size = arr->size;
-	uint64_t start_curr_file = 0;
-	uint64_t curr_file_len = 0;
+uint32_t dir_used_mask(uint8_t* dir, int32_t count) {
+	assert(dir != NULL && count >= 0 && count <= 32 && "invalid args");
+	
+	uint32_t mask = 0;
+	int32_t i = 0;
+#if defined(AVX2_DISPATCH)
+	if (HAS_AVX2) {
+		i = dir_used_mask_avx2(dir, count, &mask);
+	}
+#endif
+	for (; i < count; ++i) {
+		mask |= (uint32_t)(dir[i * META_LEN] != '\0') << i;
+	}
+	return mask;
+}
 
-	for (int32_t i = index; i < size; ++i) {
-		start_curr_file = o_list[i]->offset;
-		curr_file_len = o_list[i]->length;
+// Range of a file_t pointer list sorted or merged by a worker thread
+typedef struct sort_task_t {
+	file_t** list;			// List being sorted
+	file_t** temp;			// Buffer for merging (same length as list)
+	int32_t start;			// First index of range
+	int32_t mid;			// First index of second run (merges only)
+	int32_t end;			// Index after the last index of range
+	int (*cmp)(const void*, const void*);	// qsort style comparator
+} sort_task_t;
+
+/*
+ * Worker thread which sorts a range of a list with qsort
+ */
+static void* sort_worker(void* arg) {
+	sort_task_t* task = arg;
+	qsort(task->list + task->start, task->end - task->start,
+			sizeof(*task->list), task->cmp);
+	return NULL;
+}
+
+/*
+ * Worker thread which merges two adjacent sorted runs of a list
+ * Equal elements are taken from the first run, so the merge is stable
+ */
+static void* merge_worker(void* arg) {
+	sort_task_t* task = arg;
+	file_t** list = task->list;
+	int32_t i = task->start;
+	int32_t j = task->mid;
+	int32_t k = task->start;
+	
+	while (i < task->mid && j < task->end) {
+		if (task->cmp(&list[j], &list[i]) < 0) {
+			task->temp[k++] = list[j++];
+		} else {
+			task->temp[k++] = list[i++];
+		}
+	}
+	while (i < task->mid) {
+		task->temp[k++] = list[i++];
+	}
+	while (j < task->end) {
+		task->temp[k++] = list[j++];
+	}
+	
+	memcpy(list + task->start, task->temp + task->start,
+			sizeof(*list) * (task->end - task->start));
+	return NULL;
+}
 
-		// Break if newly created zero size files encountered
-		if (start_curr_file >= MAX_FILE_DATA_LEN) {
-			break;
+/*
+ * Sorts a list of file_t pointers using multiple threads
+ * The list is split into one run per thread, each run is sorted with qsort,
+ * and pairs of adjacent runs are then merged in parallel until one run
+ * remains. Small lists are sorted on the calling thread.
+ *
+ * list: list of file_t pointers to sort
+ * count: number of elements in list
+ * cmp: qsort style comparator for two file_t** elements
+ * n_threads: maximum number of threads to use
+ */
+void sort_files(file_t** list, int32_t count,
+		int (*cmp)(const void*, const void*), int32_t n_threads) {
+	assert(count >= 0 && (list != NULL || count == 0) && cmp != NULL &&
+	       "invalid args");
+	
+	// Limit threads so each run has a reasonable number of elements
+	if (n_threads > count / SORT_MIN_RUN) {
+		n_threads = count / SORT_MIN_RUN;
+	}
+	if (n_threads <= 1) {
+		qsort(list, count, sizeof(*list), cmp);
+		return;
+	}
+	
+	// Split list into runs and sort each run
+	int32_t* bounds = salloc(sizeof(*bounds) * (n_threads + 1));
+	sort_task_t* tasks = salloc(sizeof(*tasks) * n_threads);
+	for (int32_t i = 0; i <= n_threads; ++i) {
+		bounds[i] = (int64_t)count * i / n_threads;
+	}
+	for (int32_t i = 0; i < n_threads; ++i) {
+		tasks[i] = (sort_task_t){list, NULL, bounds[i], 0, bounds[i + 1], cmp};
+	}
+	run_tasks(tasks, sizeof(*tasks), n_threads, sort_worker);
+	
+	// Merge pairs of adjacent runs until a single run remains
+	file_t** temp = salloc(sizeof(*temp) * count);
+	int32_t runs = n_threads;
+	while (runs > 1) {
+		int32_t merges = runs / 2;
+		for (int32_t i = 0; i < merges; ++i) {
+			tasks[i] = (sort_task_t){list, temp, bounds[2 * i],
+					bounds[2 * i + 1], bounds[2 * i + 2], cmp};
+		}
+		run_tasks(tasks, sizeof(*tasks), merges, merge_worker);
+		
+		// Remove boundaries between merged runs (an odd run is carried over)
+		for (int32_t i = 0; i <= runs / 2; ++i) {
+			bounds[i] = bounds[2 * i];
 		}
+		if (runs % 2 == 1) {
+			bounds[merges + 1] = bounds[runs];
+		}
+		runs = (runs + 1) / 2;
+	}
+	
+	free(temp);
+	free(tasks);
+	free(bounds);
+}
+
+/*
+ * Synchronises the pages of a memory mapped file containing a byte range
+ *
+ * map: pointer to start of a memory mapped file
+ * offset: offset of first byte in range
+ * length: number of bytes in range
+ * flags: flags passed to msync (MS_SYNC or MS_ASYNC)
+ */
+void msync_range(uint8_t* map, int64_t offset, int64_t length, int flags) {
+	if (length <= 0) {
+		return;
+	}
+	
+	assert(map != NULL && offset >= 0 && "invalid args");
+	
+	// msync requires a page aligned address
+	int64_t page_len = sysconf(_SC_PAGESIZE);
+	int64_t start = offset - offset % page_len;
+	msync(map + start, offset + length - start, flags);
+}
+
+/*
+ * Dirty Range Tracking
+ *
+ * Operations record the byte ranges of each mapping they modify, and only
+ * those ranges are synchronised once the operation is committed (see
+ * commit.c), so mappings an operation did not modify are not synchronised at
+ * all. Each mapping keeps up to DIRTY_RANGES sorted, disjoint ranges.
+ * Overlapping or adjacent ranges are joined, and once the list is full the
+ * two closest ranges are joined, so the ranges always cover every modified
+ * byte.
+ */
+
+/*
+ * Records a modified byte range of a mapping
+ *
+ * dirty: address of dirty_t for the mapping
+ * offset: offset of first byte modified
+ * length: number of bytes modified
+ */
+void dirty_add(dirty_t* dirty, int64_t offset, int64_t length) {
+	if (length <= 0) {
+		return;
+	}
 
-		// Non-zero size file found
-		if (curr_file_len > 0) {
-			return o_list[i];
+	int64_t start = offset;
+	int64_t end = offset + length;
+	
+	// Find the first range ending at or after start
+	int32_t i = 0;
+	while (i < dirty->count && dirty->end[i] < start) {
+		++i;
+	}
+	
+	// Join ranges overlapping or adjacent to the new range
+	int32_t j = i;
+	while (j < dirty->count && dirty->start[j] <= end) {
+		start = dirty->start[j] < start ? dirty->start[j] : start;
+		end = dirty->end[j] > end ? dirty->end[j] : end;
+		++j;
+	}
+	
+	// Replace ranges i to j - 1 with the new range
+	int32_t moved = dirty->count - j;
+	if (j != i + 1) {
+		memmove(dirty->start + i + 1, dirty->start + j,
+				sizeof(*dirty->start) * moved);
+		memmove(dirty->end + i + 1, dirty->end + j,
+				sizeof(*dirty->end) * moved);
+	}
+	dirty->count = i + 1 + moved;
+	dirty->start[i] = start;
+	dirty->end[i] = end;
+	
+	// Join the closest ranges if the list is full (one slot is kept spare
+	// for insertion)
+	if (dirty->count == DIRTY_RANGES) {
+		int32_t closest = 0;
+		for (int32_t k = 1; k < dirty->count - 1; ++k) {
+			if (dirty->start[k + 1] - dirty->end[k] <
+					dirty->start[closest + 1] - dirty->end[closest]) {
+				closest = k;
+			}
 		}
+		dirty->end[closest] = dirty->end[closest + 1];
+		moved = dirty->count - closest - 2;
+		memmove(dirty->start + closest + 1, dirty->start + closest + 2,
+				sizeof(*dirty->start) * moved);
+		memmove(dirty->end + closest + 1, dirty->end + closest + 2,
+				sizeof(*dirty->end) * moved);
+		--dirty->count;
 	}
+}
 
-	return NULL;
+/*
+ * Synchronises the recorded ranges of a mapping and clears them
+ *
+ * dirty: address of dirty_t for the mapping
+ * map: pointer to start of the memory mapped file
+ * flags: flags passed to msync (MS_SYNC or MS_ASYNC)
+ */
+void dirty_sync(dirty_t* dirty, uint8_t* map, int flags) {
+	for (int32_t i = 0; i < dirty->count; ++i) {
+		msync_range(map, dirty->start[i], dirty->end[i] - dirty->start[i],
+				flags);
+	}
+	dirty->count = 0;
 }
 
 /*
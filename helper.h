@@ -16,18 +16,39 @@
 #define update_file_offset(off,file) (((file)->offset)=(off))
 #define update_file_length(len,file) (((file)->length)=(len))
 
-// dir_table name and length update macros
-#define update_dir_name(file,fs) \
-	(memcpy((fs)->dir + (file)->index * META_LEN, \
-	(file)->name, strlen((file)->name) + 1))
+// Rounds a length up to the alignment of file offsets (opts.align)
+#define align_len(len,fs) ((fs)->opts.align > 1 ? \
+	((uint64_t)(len) + (fs)->opts.align - 1) / (fs)->opts.align * \
+	(fs)->opts.align : (uint64_t)(len))
+
+// Whether a file has been written or grown frequently since the last repack
+#define file_hot(file) \
+	((file)->grows >= HOT_GROWS || (file)->writes >= HOT_WRITES)
+
+// Declares a file_t key with stack storage for its name
+#define FILE_KEY(key) \
+	char key##_name[NAME_LEN]; \
+	file_t key = {.name = key##_name}
+
+// dir_table length update macro
 #define update_dir_length(file,fs) \
 	(memcpy(fs->dir + file->index * META_LEN + NAME_LEN + OFFSET_LEN, \
-	&file->length, sizeof(uint32_t)))
+	&file->length, sizeof(uint32_t)), \
+	dirty_add(&fs->dirty_dir, file->index * META_LEN + NAME_LEN + OFFSET_LEN, \
+	sizeof(uint32_t)))
 
 // Macros for locking and unlocking synchronisation variables
 #define LOCK(mutex) pthread_mutex_lock(mutex)
 #define UNLOCK(mutex) pthread_mutex_unlock(mutex)
 
+// Locks the filesystem, counting the operation as waiting until the lock is
+// acquired (background compaction yields to waiting operations)
+#define LOCK_FS(fs) \
+	(__atomic_add_fetch(&(fs)->lock_waiters, 1, __ATOMIC_SEQ_CST), \
+	LOCK(&(fs)->lock), \
+	__atomic_sub_fetch(&(fs)->lock_waiters, 1, __ATOMIC_SEQ_CST))
+#define UNLOCK_FS(fs) UNLOCK(&(fs)->lock)
+
 // Macro for suppressing unused variable warnings
 #define UNUSED(x) ((void)(x))
 
@@ -37,15 +58,36 @@ void* scalloc(size_t size);
 
 file_t* file_init(char* name, uint64_t offset, uint32_t length, int32_t index);
 
+file_t* file_init_dir(char* name, uint64_t offset, uint32_t length,
+		int32_t index, filesys_t* fs);
+
 void free_file(file_t* file);
 
 void update_file_name(char* name, file_t* file);
 
+int32_t name_padded(char* name);
+
+int32_t name_cmp(char* a, char* b);
+
+void run_tasks(void* tasks, size_t task_len, int32_t count,
+		void* (*worker)(void*));
+
+uint32_t dir_used_mask(uint8_t* dir, int32_t count);
+
+void sort_files(file_t** list, int32_t count,
+		int (*cmp)(const void*, const void*), int32_t n_threads);
+
+void update_dir_name(file_t* file, filesys_t* fs);
+
 void update_dir_offset(file_t* file, filesys_t* fs);
 
 void write_dir_file(file_t* file, filesys_t* fs);
 
-file_t* find_next_nonzero_file(int32_t index, arr_t* arr);
+void msync_range(uint8_t* map, int64_t offset, int64_t length, int flags);
+
+void dirty_add(dirty_t* dirty, int64_t offset, int64_t length);
+
+void dirty_sync(dirty_t* dirty, uint8_t* map, int flags);
 
 uint64_t write_null_byte(uint8_t* f, int64_t offset, int64_t count);
 
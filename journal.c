@@ -0,0 +1,452 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <sys/mman.h>
+#include <assert.h>
+
+#include "structs.h"
+#include "helper.h"
+#include "myfilesystem.h"
+#include "journal.h"
+
+/*
+ * Write-Ahead Journal
+ *
+ * Without a journal, making an operation durable requires synchronising its
+ * ranges of all three mappings, and a crash while dir_table is partly
+ * written (such as during repack) leaves entries referring to moved data.
+ * When opts.journal_path is set (with DURABILITY_PERIODIC or
+ * DURABILITY_SYNC), dir_table and hash_data are mapped privately, so the
+ * kernel never writes them back, and each flush of committed operations
+ * (see commit.c) synchronises the file_data ranges, then appends one record
+ * holding the new bytes of every dir_table and hash_data range modified and
+ * synchronises the journal with a single sequential write. dir_table and
+ * hash_data are only written at checkpoints, from the records in the
+ * journal, so they never hold changes which are not journalled.
+ *
+ * Moving files over data still referred to by dir_table (repack and the
+ * compaction opening a gap for an allocation) cannot be undone, so moves
+ * are journalled before they are made: the bytes each file will hold at its
+ * new offset are written in a record with its new entry, and the data is
+ * only moved once the record is written (see journal_move_files). Once the
+ * operation has moved every file, the journal is checkpointed, so these
+ * bytes are never replayed over later writes.
+ *
+ * The journal starts with a header storing the sequence number of the last
+ * record applied to the filesystem, followed by records with consecutive
+ * sequence numbers. Each record holds segments of bytes of dir_table,
+ * hash_data or file_data (type, offset and length, then the bytes). A
+ * checkpoint writes the dir_table and hash_data segments of every record
+ * since the last checkpoint to their files, synchronises the file_data
+ * ranges of moves, then rewrites the header so writing continues from the
+ * start of the journal. Checkpoints occur when a record would not fit
+ * before the end of the journal (which is extended for records longer than
+ * the journal), when an operation has moved files, and when the filesystem
+ * is opened or closed.
+ *
+ * When the filesystem is opened, records following the header are applied in
+ * order, stopping at the first record which is incomplete, fails its
+ * checksum or does not have the next sequence number (records left from
+ * before the last checkpoint have lower sequence numbers). Hashes are
+ * journalled with the entries referring to them, so only the blocks written
+ * by replayed moves are hashed again (their hashes may be in a record which
+ * was not written), and data outside them is never hashed as part of
+ * recovery.
+ */
+
+/*
+ * Calculates the checksum of a journal header and the payload following it,
+ * treating the checksum field as zero
+ *
+ * hdr: address of header
+ * payload: address of hdr->length bytes following the header (may be NULL
+ * 			if hdr->length is 0)
+ * out: buffer of HASH_LEN bytes for the checksum
+ */
+static void journal_checksum(journal_hdr_t* hdr, uint8_t* payload,
+		uint8_t* out) {
+	journal_hdr_t temp = *hdr;
+	memset(temp.checksum, 0, HASH_LEN);
+	uint8_t empty = 0;
+	if (payload == NULL) {
+		payload = &empty;
+	}
+
+	uint8_t hashes[2 * HASH_LEN];
+	fletcher((uint8_t*)&temp, sizeof(temp), hashes);
+	fletcher(payload, hdr->length, hashes + HASH_LEN);
+	fletcher(hashes, 2 * HASH_LEN, out);
+}
+
+/*
+ * Writes the journal header, marking every record up to journal_seq as
+ * applied, so writing continues from the start of the journal
+ */
+static void journal_write_hdr(filesys_t* fs) {
+	journal_hdr_t hdr = {JOURNAL_MAGIC, fs->journal_seq, 0, 0, {0}};
+	journal_checksum(&hdr, NULL, hdr.checksum);
+	assert(pwrite(fs->journal_fd, &hdr, sizeof(hdr), 0) == sizeof(hdr) &&
+	       !fdatasync(fs->journal_fd) && "failed to write journal header");
+	fs->journal_pos = sizeof(hdr);
+}
+
+/*
+ * Writes bytes to a file, asserting every byte is written
+ */
+static void journal_pwrite(int fd, uint8_t* buf, uint64_t length,
+		uint64_t offset) {
+	while (length > 0) {
+		ssize_t n = pwrite(fd, buf, length, offset);
+		assert(n > 0 && "failed to write journalled bytes");
+		buf += n;
+		length -= n;
+		offset += n;
+	}
+}
+
+/*
+ * Applies the segments of a record to the filesystem files
+ * When replaying, file_data segments are written and their ranges are added
+ * to replay_ranges. At a checkpoint they were already written by the move
+ * journalled, so their ranges are synchronised instead.
+ *
+ * payload: segments of record
+ * length: length of segments
+ * replay: whether the record is being replayed after a crash
+ *
+ * returns: 0 on success, -1 if a segment is outside its file (nothing is
+ * 			applied)
+ */
+static int32_t journal_apply(uint8_t* payload, uint32_t length,
+		int32_t replay, filesys_t* fs) {
+	int64_t lengths[3] = {fs->dir_table_len, fs->hash_data_len,
+			fs->file_data_len};
+	int fds[3] = {fs->dir_fd, fs->hash_fd, fs->file_fd};
+
+	// Check every segment before applying any
+	for (int32_t apply = 0; apply < 2; ++apply) {
+		uint32_t pos = 0;
+		while (pos < length) {
+			journal_seg_t seg;
+			if (length - pos < sizeof(seg)) {
+				return -1;
+			}
+			memcpy(&seg, payload + pos, sizeof(seg));
+			pos += sizeof(seg);
+
+			if (seg.type > SEGMENT_DATA || seg.length > length - pos ||
+				seg.offset > (uint64_t)lengths[seg.type] ||
+				seg.length > lengths[seg.type] - seg.offset) {
+				return -1;
+			}
+
+			if (apply && (replay || seg.type != SEGMENT_DATA)) {
+				journal_pwrite(fds[seg.type], payload + pos, seg.length,
+						seg.offset);
+			} else if (apply) {
+				fs->storage->sync(seg.offset, seg.length, MS_SYNC, fs);
+			}
+			if (apply && replay && seg.type == SEGMENT_DATA) {
+				fs->replay_ranges = realloc(fs->replay_ranges,
+						sizeof(*fs->replay_ranges) * 2 *
+						(fs->replay_count + 1));
+				assert(fs->replay_ranges != NULL &&
+				       "failed to allocate memory");
+				fs->replay_ranges[2 * fs->replay_count] = seg.offset;
+				fs->replay_ranges[2 * fs->replay_count + 1] = seg.length;
+				++fs->replay_count;
+			}
+			pos += seg.length;
+		}
+	}
+	return 0;
+}
+
+/*
+ * Reads the records following the journal header, applying each record with
+ * the next sequence number
+ *
+ * seq: pointer to the sequence number of the last record applied, which is
+ * 		updated as records are applied
+ * end: offset after the last record to read (records may end before it)
+ * replay: whether the records are being replayed after a crash
+ *
+ * returns: number of records applied
+ */
+static int32_t journal_apply_records(uint64_t* seq, int64_t end,
+		int32_t replay, filesys_t* fs) {
+	int32_t applied = 0;
+	int64_t pos = sizeof(journal_hdr_t);
+	uint8_t checksum[HASH_LEN];
+	while (1) {
+		journal_hdr_t rec;
+		if (end - pos < (int64_t)sizeof(rec) ||
+			pread(fs->journal_fd, &rec, sizeof(rec), pos) != sizeof(rec) ||
+			rec.magic != JOURNAL_MAGIC || rec.seq != *seq + 1 ||
+			rec.length > end - pos - sizeof(rec)) {
+			break;
+		}
+
+		uint8_t* payload = salloc(rec.length + 1);
+		int32_t valid = pread(fs->journal_fd, payload, rec.length,
+				pos + sizeof(rec)) == rec.length;
+		if (valid) {
+			journal_checksum(&rec, payload, checksum);
+			valid = memcmp(checksum, rec.checksum, HASH_LEN) == 0 &&
+					!journal_apply(payload, rec.length, replay, fs);
+		}
+		free(payload);
+		if (!valid) {
+			break;
+		}
+
+		*seq = rec.seq;
+		pos += sizeof(rec) + rec.length;
+		++applied;
+	}
+	return applied;
+}
+
+/*
+ * Opens (creating if required) the journal of a filesystem and applies its
+ * records to the filesystem files
+ * Must be called after file_data is opened by its storage backend, but
+ * before dir_table and hash_data are mapped. The journal is checkpointed by
+ * journal_recover once they are mapped.
+ *
+ * returns: number of records applied
+ */
+int32_t journal_open(filesys_t* fs) {
+	assert(fs != NULL && fs->opts.journal_path != NULL && "invalid args");
+
+	fs->journal_fd = open(fs->opts.journal_path, O_RDWR | O_CREAT, 0644);
+	assert(fs->journal_fd >= 0 && "failed to open journal");
+
+	struct stat stats;
+	assert(!fstat(fs->journal_fd, &stats) && "failed to get journal length");
+	if (stats.st_size < JOURNAL_LEN) {
+		assert(!ftruncate(fs->journal_fd, JOURNAL_LEN) &&
+		       "failed to extend journal");
+		stats.st_size = JOURNAL_LEN;
+	}
+	fs->journal_len = stats.st_size;
+	fs->journal_buf = NULL;
+	fs->journal_buf_len = 0;
+	fs->journal_moves = NULL;
+	fs->journal_moves_len = 0;
+	fs->replay_ranges = NULL;
+	fs->replay_count = 0;
+
+	// Records are only applied if the header is valid
+	journal_hdr_t hdr;
+	uint8_t checksum[HASH_LEN];
+	int32_t valid = pread(fs->journal_fd, &hdr, sizeof(hdr), 0) ==
+			sizeof(hdr) && hdr.magic == JOURNAL_MAGIC && hdr.length == 0;
+	if (valid) {
+		journal_checksum(&hdr, NULL, checksum);
+		valid = memcmp(checksum, hdr.checksum, HASH_LEN) == 0;
+	}
+	fs->journal_seq = valid ? hdr.seq : 0;
+
+	int32_t applied = 0;
+	if (valid) {
+		applied = journal_apply_records(&fs->journal_seq, fs->journal_len, 1,
+				fs);
+	}
+	if (applied > 0) {
+		assert(!fdatasync(fs->file_fd) && !fdatasync(fs->dir_fd) &&
+		       !fdatasync(fs->hash_fd) && "failed to synchronise replay");
+	}
+	return applied;
+}
+
+/*
+ * Hashes the blocks written by replayed moves and writes their hashes, then
+ * checkpoints the journal
+ * Must be called once dir_table and hash_data are mapped, before operations
+ * start.
+ */
+void journal_recover(filesys_t* fs) {
+	assert(fs != NULL && fs->journal_fd >= 0 && "invalid args");
+
+	for (int32_t i = 0; i < fs->replay_count; ++i) {
+		compute_hash_block_range(fs->replay_ranges[2 * i],
+				fs->replay_ranges[2 * i + 1], fs);
+	}
+	dirty_t* dirty = &fs->dirty_hash;
+	for (int32_t i = 0; i < dirty->count; ++i) {
+		journal_pwrite(fs->hash_fd, fs->hash + dirty->start[i],
+				dirty->end[i] - dirty->start[i], dirty->start[i]);
+	}
+	if (dirty->count > 0) {
+		assert(!fdatasync(fs->hash_fd) && "failed to synchronise hashes");
+	}
+	dirty->count = 0;
+
+	free(fs->replay_ranges);
+	fs->replay_ranges = NULL;
+	fs->replay_count = 0;
+	journal_write_hdr(fs);
+}
+
+/*
+ * Extends the pending record, reserving space for the record header if it is
+ * empty
+ * Must be called while holding commit_lock.
+ *
+ * length: number of bytes added
+ *
+ * returns: address of the bytes added
+ */
+static uint8_t* journal_reserve(uint64_t length, filesys_t* fs) {
+	uint64_t len = fs->journal_buf_len > 0 ?
+			fs->journal_buf_len : sizeof(journal_hdr_t);
+	fs->journal_buf = realloc(fs->journal_buf, len + length);
+	assert(fs->journal_buf != NULL && "failed to allocate memory");
+	fs->journal_buf_len = len + length;
+	return fs->journal_buf + len;
+}
+
+/*
+ * Appends a segment to the pending record
+ * Must be called while holding commit_lock.
+ *
+ * returns: address of the bytes of the segment
+ */
+static uint8_t* journal_segment(SEGMENT type, uint64_t offset,
+		uint64_t length, filesys_t* fs) {
+	journal_seg_t seg = {type, 0, offset, length};
+	uint8_t* bytes = journal_reserve(sizeof(seg) + length, fs);
+	memcpy(bytes, &seg, sizeof(seg));
+	return bytes + sizeof(seg);
+}
+
+/*
+ * Appends the file data moved and the dir_table and hash_data ranges
+ * modified by an operation to the pending record, called as the operation
+ * is committed
+ * Moved data is always in the same record as the entries referring to it,
+ * as replaying it without them would overwrite data they still refer to.
+ * Must be called while holding the filesystem lock and commit_lock, so the
+ * bytes are copied between operations.
+ */
+void journal_append(filesys_t* fs) {
+	if (fs->journal_moves_len > 0) {
+		memcpy(journal_reserve(fs->journal_moves_len, fs), fs->journal_moves,
+				fs->journal_moves_len);
+		fs->journal_moves_len = 0;
+	}
+
+	dirty_t* dirty[2] = {&fs->dirty_dir, &fs->dirty_hash};
+	uint8_t* maps[2] = {fs->dir, fs->hash};
+	SEGMENT types[2] = {SEGMENT_DIR, SEGMENT_HASH};
+	for (int32_t m = 0; m < 2; ++m) {
+		for (int32_t i = 0; i < dirty[m]->count; ++i) {
+			uint64_t length = dirty[m]->end[i] - dirty[m]->start[i];
+			memcpy(journal_segment(types[m], dirty[m]->start[i], length, fs),
+					maps[m] + dirty[m]->start[i], length);
+		}
+	}
+}
+
+/*
+ * Records the data of a file which is about to move, as the bytes of
+ * file_data at its new offset, to be journalled when the operation next
+ * commits its ranges (see commit_barrier)
+ * Must be called while holding the filesystem lock, before the file is
+ * moved.
+ *
+ * new_offset: offset the data is moving to
+ * offset: current offset of the data
+ * length: number of bytes moving
+ */
+void journal_data(uint64_t new_offset, uint64_t offset, uint64_t length,
+		filesys_t* fs) {
+	journal_seg_t seg = {SEGMENT_DATA, 0, new_offset, length};
+	uint64_t len = fs->journal_moves_len;
+	fs->journal_moves = realloc(fs->journal_moves, len + sizeof(seg) + length);
+	assert(fs->journal_moves != NULL && "failed to allocate memory");
+	memcpy(fs->journal_moves + len, &seg, sizeof(seg));
+	fs->storage->read(offset, length, fs->journal_moves + len + sizeof(seg),
+			fs);
+	fs->journal_moves_len = len + sizeof(seg) + length;
+}
+
+/*
+ * Writes a pending record, once the file_data ranges of the operations are
+ * synchronised
+ * The record is written after a checkpoint if it does not fit, and the
+ * journal is extended if it is longer than the journal. No record is written
+ * if no dir_table or hash_data ranges were modified.
+ * Called by the thread flushing committed operations.
+ *
+ * buf: pending record (with space for its header), or NULL if empty
+ * len: length of pending record
+ */
+void journal_flush(uint8_t* buf, uint64_t len, filesys_t* fs) {
+	if (buf == NULL) {
+		return;
+	}
+
+	if (len > fs->journal_len - fs->journal_pos) {
+		journal_checkpoint(fs);
+	}
+	if (len > fs->journal_len - fs->journal_pos) {
+		assert(!ftruncate(fs->journal_fd, fs->journal_pos + len) &&
+		       "failed to extend journal");
+		fs->journal_len = fs->journal_pos + len;
+	}
+
+	assert(len - sizeof(journal_hdr_t) <= UINT32_MAX && "record too long");
+	journal_hdr_t hdr = {JOURNAL_MAGIC, fs->journal_seq + 1,
+			len - sizeof(hdr), 0, {0}};
+	journal_checksum(&hdr, buf + sizeof(hdr), hdr.checksum);
+	memcpy(buf, &hdr, sizeof(hdr));
+	journal_pwrite(fs->journal_fd, buf, len, fs->journal_pos);
+	assert(!fdatasync(fs->journal_fd) && "failed to synchronise journal");
+	fs->journal_pos += len;
+	fs->journal_seq = hdr.seq;
+}
+
+/*
+ * Writes the records since the last checkpoint to dir_table and hash_data
+ * and synchronises the file_data they moved, then restarts the journal
+ * Only journalled bytes are written, so operations may modify the mappings
+ * during a checkpoint.
+ * Called by the thread flushing committed operations, or while no flush is
+ * in progress and no operation is committed (see commit_checkpoint).
+ */
+void journal_checkpoint(filesys_t* fs) {
+	if (fs->journal_pos <= (int64_t)sizeof(journal_hdr_t)) {
+		return;
+	}
+
+	// Records follow the sequence number of the header
+	journal_hdr_t hdr;
+	assert(pread(fs->journal_fd, &hdr, sizeof(hdr), 0) == sizeof(hdr) &&
+	       "failed to read journal header");
+	journal_apply_records(&hdr.seq, fs->journal_pos, 0, fs);
+	assert(hdr.seq == fs->journal_seq && "journal records not applied");
+	fs->storage->flush(fs);
+	assert(!fdatasync(fs->dir_fd) && !fdatasync(fs->hash_fd) &&
+	       "failed to synchronise checkpoint");
+	journal_write_hdr(fs);
+}
+
+/*
+ * Checkpoints and closes the journal, once committed operations are flushed
+ */
+void journal_close(filesys_t* fs) {
+	assert(fs != NULL && fs->journal_fd >= 0 && "invalid args");
+
+	journal_checkpoint(fs);
+	close(fs->journal_fd);
+	free(fs->journal_buf);
+	free(fs->journal_moves);
+	fs->journal_fd = -1;
+}
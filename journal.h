@@ -0,0 +1,21 @@
+#ifndef JOURNAL_H
+#define JOURNAL_H
+
+#include "structs.h"
+
+int32_t journal_open(filesys_t* fs);
+
+void journal_recover(filesys_t* fs);
+
+void journal_append(filesys_t* fs);
+
+void journal_data(uint64_t new_offset, uint64_t offset, uint64_t length,
+		filesys_t* fs);
+
+void journal_flush(uint8_t* buf, uint64_t len, filesys_t* fs);
+
+void journal_checkpoint(filesys_t* fs);
+
+void journal_close(filesys_t* fs);
+
+#endif
@@ -12,7 +12,7 @@ cd cov
 
 # Compile program
 gcc -O0 -std=gnu11 -fsanitize=address -Wall -Werror -g -fprofile-arcs -ftest-coverage \
--o runtest runtest.c myfilesystem.c helper.c arr.c -lfuse -lm -lpthread
+-o runtest runtest.c myfilesystem.c helper.c arr.c sidecar.c compact.c metrics.c commit.c journal.c storage.c cache.c uring.c -lfuse -lm -lpthread
 
 # Run program
 ./runtest
@@ -0,0 +1,191 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <pthread.h>
+#include <assert.h>
+
+#include "structs.h"
+#include "helper.h"
+#include "arr.h"
+#include "compact.h"
+#include "metrics.h"
+
+/*
+ * Allocator Metrics
+ *
+ * Fragmentation of file_data determines how often allocations must compact
+ * files, so the free space is summarised by the number of gaps, a histogram
+ * of gap lengths (powers of 2), the total free bytes and the largest gap.
+ * Gap i of the offset array is the free space before the file at index i, and
+ * gap size is the free space at the end of file_data.
+ *
+ * Rather than scanning the offset array for each query, the gap metrics are
+ * maintained by the offset array itself: insertion, removal and arr_update
+ * remove the gaps around the index before the change and add them again
+ * afterwards (see arr.c), which takes constant time per change. Only the
+ * largest gap cannot be maintained this way, so it is rescanned on the next
+ * query after a gap of its length is removed. Arrays built in bulk recompute
+ * every gap metric once (metrics_rebuild).
+ *
+ * Counters of repacks, bytes moved and resizes are updated by the operations
+ * themselves. All metrics are read and modified while holding the filesystem
+ * lock, except the commit and cache counters, which are read from the commit
+ * state (see commit.c) and block cache (see cache.c).
+ */
+
+/*
+ * Returns the length of gap i in an offset array, or 0 if the extents on
+ * either side overlap (only possible while files are being moved)
+ */
+static inline uint64_t gap_len(int32_t i, arr_t* arr) {
+	int64_t start = i < arr->size ?
+			(int64_t)arr->offset[i] : arr->fs->file_data_len;
+	int64_t end_prev_file = i > 0 ?
+			(int64_t)(arr->offset[i - 1] + arr->length[i - 1]) : 0;
+	return start > end_prev_file ? start - end_prev_file : 0;
+}
+
+/*
+ * Adds or removes gaps first to last of the filesystem offset array from the
+ * gap metrics
+ * Gaps are removed before the offset array is modified around them, and added
+ * again once it has been modified
+ *
+ * first: index of first gap
+ * last: index of last gap (at most the size of the array)
+ * sign: 1 to add the gaps, -1 to remove them
+ */
+void metrics_gaps(int32_t first, int32_t last, int32_t sign, arr_t* arr) {
+	fs_metrics_t* m = &arr->fs->metrics;
+	for (int32_t i = first; i <= last && i <= arr->size; ++i) {
+		uint64_t len = gap_len(i, arr);
+		if (len == 0) {
+			continue;
+		}
+
+		int32_t bucket = 63 - __builtin_clzll(len);
+		if (sign > 0) {
+			++m->gap_count;
+			++m->gap_hist[bucket];
+			m->free_bytes += len;
+			if (len > m->largest_free) {
+				m->largest_free = len;
+			}
+		} else {
+			assert(m->gap_count > 0 && m->gap_hist[bucket] > 0 &&
+			       "gap metrics out of sync");
+			--m->gap_count;
+			--m->gap_hist[bucket];
+			m->free_bytes -= len;
+			if (len == m->largest_free) {
+				arr->fs->largest_stale = 1;
+			}
+		}
+	}
+}
+
+/*
+ * Recomputes the gap metrics from the filesystem offset array
+ */
+void metrics_rebuild(filesys_t* fs) {
+	assert(fs != NULL && "invalid args");
+
+	fs_metrics_t* m = &fs->metrics;
+	m->free_bytes = 0;
+	m->largest_free = 0;
+	m->gap_count = 0;
+	memset(m->gap_hist, 0, sizeof(m->gap_hist));
+	fs->largest_stale = 0;
+	metrics_gaps(0, fs->o_list->size, 1, fs->o_list);
+}
+
+/*
+ * Returns the length of the largest gap in file_data, rescanning the offset
+ * array only if the previous largest gap has been removed
+ */
+uint64_t metrics_largest_free(filesys_t* fs) {
+	assert(fs != NULL && "invalid args");
+
+	if (fs->largest_stale) {
+		fs->metrics.largest_free = largest_free_extent(fs);
+		fs->largest_stale = 0;
+	}
+	return fs->metrics.largest_free;
+}
+
+/*
+ * Copies the current allocator metrics of a filesystem
+ *
+ * out: address of fs_metrics_t to fill
+ */
+void get_metrics(fs_metrics_t* out, void* helper) {
+	filesys_t* fs = (filesys_t*)helper;
+	assert(out != NULL && fs != NULL && "invalid args");
+	LOCK_FS(fs);
+
+	metrics_largest_free(fs);
+	*out = fs->metrics;
+	out->padding = fs->padding;
+	out->reserved = fs->reserved;
+	LOCK(&fs->commit_lock);
+	out->commits = fs->commit_seq;
+	out->flushes = fs->flushes;
+	UNLOCK(&fs->commit_lock);
+	if (fs->cache != NULL) {
+		LOCK(&fs->cache->lock);
+		out->cache_hits = fs->cache->hits;
+		out->cache_misses = fs->cache->misses;
+		out->cache_batches = fs->cache->batches;
+		UNLOCK(&fs->cache->lock);
+	}
+
+	UNLOCK_FS(fs);
+}
+
+/*
+ * Formats metrics as text, with one "name value" pair per line and one line
+ * per non-empty histogram bucket (named by the minimum gap length)
+ *
+ * buf: buffer for text (may be NULL if len is 0)
+ * len: length of buffer
+ * m: metrics being formatted
+ *
+ * returns: length of the complete text, which is truncated if it is not
+ * 			less than len (as for snprintf)
+ */
+ssize_t format_metrics(char* buf, size_t len, fs_metrics_t* m) {
+	assert((buf != NULL || len == 0) && m != NULL && "invalid args");
+
+	// Appends to buf while space remains, counting the full length
+	size_t pos = 0;
+	#define APPEND(...) \
+		(pos += snprintf(pos < len ? buf + pos : NULL, \
+				pos < len ? len - pos : 0, __VA_ARGS__))
+
+	APPEND("free_bytes %lu\n", m->free_bytes);
+	APPEND("largest_free %lu\n", m->largest_free);
+	APPEND("gap_count %lu\n", m->gap_count);
+	for (int32_t i = 0; i < GAP_HIST_LEN; ++i) {
+		if (m->gap_hist[i] > 0) {
+			APPEND("gaps_%lu %lu\n", (uint64_t)1 << i, m->gap_hist[i]);
+		}
+	}
+	APPEND("padding %lu\n", m->padding);
+	APPEND("reserved %lu\n", m->reserved);
+	APPEND("repacks %lu\n", m->repacks);
+	APPEND("repack_bytes %lu\n", m->repack_bytes);
+	APPEND("repack_ns %lu\n", m->repack_ns);
+	APPEND("compact_bytes %lu\n", m->compact_bytes);
+	APPEND("resizes %lu\n", m->resizes);
+	APPEND("relocations %lu\n", m->relocations);
+	APPEND("punched_bytes %lu\n", m->punched_bytes);
+	APPEND("commits %lu\n", m->commits);
+	APPEND("flushes %lu\n", m->flushes);
+	APPEND("cache_hits %lu\n", m->cache_hits);
+	APPEND("cache_misses %lu\n", m->cache_misses);
+	APPEND("cache_batches %lu\n", m->cache_batches);
+	APPEND("align_disabled %lu\n", m->align_disabled);
+
+	#undef APPEND
+	return pos;
+}
@@ -0,0 +1,18 @@
+#ifndef METRICS_H
+#define METRICS_H
+
+#include <sys/types.h>
+
+#include "structs.h"
+
+void metrics_gaps(int32_t first, int32_t last, int32_t sign, arr_t* arr);
+
+void metrics_rebuild(filesys_t* fs);
+
+uint64_t metrics_largest_free(filesys_t* fs);
+
+void get_metrics(fs_metrics_t* out, void* helper);
+
+ssize_t format_metrics(char* buf, size_t len, fs_metrics_t* m);
+
+#endif
@@ -1,3 +1,4 @@
+#define _GNU_SOURCE
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
@@ -6,13 +7,20 @@
 #include <fcntl.h>
 #include <unistd.h>
 #include <pthread.h>
+#include <time.h>
 #include <sys/mman.h>
+#include <linux/falloc.h>
 #include <assert.h>
 
 #include "structs.h"
 #include "helper.h"
 #include "arr.h"
 #include "myfilesystem.h"
+#include "sidecar.h"
+#include "compact.h"
+#include "commit.h"
+#include "journal.h"
+#include "storage.h"
 
 /*
  * Filesystem Implementation
@@ -28,12 +36,217 @@
  * mutex was used for the synchronisation of the filesystem.
  */
 
+// Range of dir_table entries scanned by a thread during initialisation
+typedef struct scan_task_t {
+	filesys_t* fs;			// Filesystem being initialised
+	int32_t start;			// First dir_table index of range
+	int32_t end;			// Index after the last dir_table index of range
+	file_t** files;			// Files found in range (at most end - start)
+	int32_t count;			// Number of files found in range
+} scan_task_t;
+
+/*
+ * Worker thread which creates file_t structs for the used entries in a range
+ * of dir_table
+ * Used entries are found 32 at a time using dir_used_mask
+ */
+static void* scan_worker(void* arg) {
+	scan_task_t* task = arg;
+	filesys_t* fs = task->fs;
+	uint64_t offset = 0;
+	uint32_t length = 0;
+	
+	task->count = 0;
+	for (int32_t i = task->start; i < task->end; i += 32) {
+		int32_t n = task->end - i < 32 ? task->end - i : 32;
+		uint32_t mask = dir_used_mask(fs->dir + i * META_LEN, n);
+		
+		while (mask != 0) {
+			int32_t index = i + __builtin_ctz(mask);
+			mask &= mask - 1;
+			
+			// Name field of dir_table entry (first 63 characters are used)
+			uint8_t* entry = fs->dir + index * META_LEN;
+			memcpy(&offset, entry + NAME_LEN, sizeof(uint32_t));
+			memcpy(&length, entry + NAME_LEN + OFFSET_LEN, sizeof(uint32_t));
+			task->files[task->count++] = file_init_dir((char*)entry, offset,
+					length, index, fs);
+		}
+	}
+	
+	return NULL;
+}
+
+/*
+ * Creates file_t structs for every used entry in dir_table
+ * dir_table is split into one range of entries per processor, and each range
+ * is scanned by a separate thread. Files are stored in order of dir_table
+ * index.
+ *
+ * files: list with space for one file_t pointer per dir_table entry
+ *
+ * returns: number of files found
+ */
+int32_t scan_dir(file_t** files, filesys_t* fs) {
+	assert(files != NULL && fs != NULL && "invalid args");
+	
+	// Limit threads so each range has a reasonable number of entries
+	int32_t n_threads = fs->n_processors;
+	if (n_threads > fs->index_len / SCAN_MIN_ENTRIES) {
+		n_threads = fs->index_len / SCAN_MIN_ENTRIES;
+	}
+	if (n_threads < 1) {
+		n_threads = 1;
+	}
+	
+	// Each range stores its files in the matching range of the list
+	scan_task_t* tasks = salloc(sizeof(*tasks) * n_threads);
+	for (int32_t i = 0; i < n_threads; ++i) {
+		int32_t start = (int64_t)fs->index_len * i / n_threads;
+		int32_t end = (int64_t)fs->index_len * (i + 1) / n_threads;
+		tasks[i] = (scan_task_t){fs, start, end, files + start, 0};
+	}
+	run_tasks(tasks, sizeof(*tasks), n_threads, scan_worker);
+	
+	// Remove gaps between ranges
+	int32_t count = 0;
+	for (int32_t i = 0; i < n_threads; ++i) {
+		memmove(files + count, tasks[i].files,
+				sizeof(*files) * tasks[i].count);
+		count += tasks[i].count;
+	}
+	
+	free(tasks);
+	return count;
+}
+
+/*
+ * Builds the sorted arrays, index array and used count from the entries in
+ * dir_table
+ */
+void build_arrays(filesys_t* fs) {
+	assert(fs != NULL && "invalid args");
+	
+	// Read through dir_table for existing files
+	// Files are collected before building the sorted arrays in bulk
+	file_t** files = salloc(sizeof(*files) * (fs->index_len + 1));
+	int32_t count = scan_dir(files, fs);
+	
+	// Build name array, discarding files with duplicate names
+	arr_build(files, count, fs->n_list, fs->n_processors);
+	int32_t o_count = 0;
+	for (int32_t i = 0; i < count; ++i) {
+		file_t* f = files[i];
+		if (f->n_index < 0) {
+			free_file(f);
+			continue;
+		}
+		
+		// Updating filesystem variables
+		fs->used += f->length;
+		fs->index[f->index] = 1;
+		++fs->index_count;
+		
+		// Zero size files are not stored in the offset array
+		if (f->length > 0) {
+			files[o_count++] = f;
+		}
+	}
+	
+	// Build offset array from remaining files
+	arr_build(files, o_count, fs->o_list, fs->n_processors);
+	free(files);
+}
+
+/*
+ * Computes the bytes lost to aligning file offsets to opts.align
+ * Files written without the option may not be aligned, in which case the
+ * option is disabled, as repack cannot move files to later offsets
+ */
+static void check_alignment(filesys_t* fs);
+
+/*
+ * Computes the hash of an all zero subtree for each height of the hash tree
+ * (height 0 is a zero block), so zero filled and punched ranges are rehashed
+ * without reading file_data
+ */
+static void init_zero_hashes(filesys_t* fs) {
+	int32_t heights = 1;
+	while (((int64_t)1 << heights) <= fs->leaf_offset + 1) {
+		++heights;
+	}
+	
+	fs->zero_hashes = salloc(sizeof(*fs->zero_hashes) * heights * HASH_LEN);
+	uint8_t* zero = scalloc(BLOCK_LEN);
+	fletcher(zero, BLOCK_LEN, fs->zero_hashes);
+	free(zero);
+	
+	uint8_t hash_cat[2 * HASH_LEN];
+	for (int32_t h = 1; h < heights; ++h) {
+		memcpy(hash_cat, fs->zero_hashes + (h - 1) * HASH_LEN, HASH_LEN);
+		memcpy(hash_cat + HASH_LEN, fs->zero_hashes + (h - 1) * HASH_LEN,
+				HASH_LEN);
+		fletcher(hash_cat, 2 * HASH_LEN, fs->zero_hashes + h * HASH_LEN);
+	}
+}
+
+/*
+ * Counts the padding after files for opts.align, disabling the option (and
+ * setting metrics.align_disabled) if any file in file_data is not aligned,
+ * such as files written without the option
+ * Files are not moved to realign them, as a mount should not rewrite the
+ * data of every file.
+ */
+static void check_alignment(filesys_t* fs) {
+	if (fs->opts.align <= 1) {
+		return;
+	}
+
+	int32_t size = fs->o_list->size;
+	uint64_t* offsets = fs->o_list->offset;
+	uint32_t* lengths = fs->o_list->length;
+	for (int32_t i = 0; i < size; ++i) {
+		uint64_t end = i + 1 < size ?
+				offsets[i + 1] : (uint64_t)fs->file_data_len;
+		if (offsets[i] % fs->opts.align || offsets[i] + lengths[i] > end) {
+			fs->opts.align = 0;
+			fs->metrics.align_disabled = 1;
+			for (int32_t j = 0; j < size; ++j) {
+				arr_update(j, fs->o_list);
+			}
+			fs->padding = 0;
+			return;
+		}
+		fs->padding += lengths[i] - fs->o_list->list[i]->length;
+	}
+}
+
 void * init_fs(char * f1, char * f2, char * f3, int n_processors) {
+	return init_fs_opts(f1, f2, f3, n_processors, NULL);
+}
+
+/*
+ * Initialises the filesystem with the options specified
+ *
+ * opts: address of filesystem options, or NULL for default options
+ * 		 (all options zero)
+ */
+void * init_fs_opts(char * f1, char * f2, char * f3, int n_processors,
+		fs_opts_t * opts) {
     // Allocate space for filesystem helper
 	filesys_t* fs = salloc(sizeof(*fs));
 	
-	// Initialise filesystem lock
+	// Store filesystem options
+	memset(&fs->opts, 0, sizeof(fs->opts));
+	if (opts != NULL) {
+		fs->opts = *opts;
+	}
+	
+	// Initialise filesystem lock and compaction thread variables
 	pthread_mutex_init(&fs->lock, NULL);
+	pthread_cond_init(&fs->compact_cond, NULL);
+	fs->lock_waiters = 0;
+	fs->compact_stop = 0;
 	
 	// Check if files exist
 	fs->file_fd = open(f1, O_RDWR);
@@ -52,15 +265,30 @@ void * init_fs(char * f1, char * f2, char * f3, int n_processors) {
 	fs->dir_table_len = stats[1].st_size;
 	fs->hash_data_len = stats[2].st_size;
 	
-	// Map files to memory using mmap
-	fs->file = mmap(NULL, fs->file_data_len, PROT_READ | PROT_WRITE,
-			MAP_SHARED, fs->file_fd, 0);
+	// Open file_data with the storage backend
+	fs->cache = NULL;
+	fs->storage = storage_select(fs);
+	fs->storage->open(fs);
+	
+	// Apply records from the journal before dir_table and hash_data are
+	// mapped
+	int32_t replayed = 0;
+	fs->journal_fd = -1;
+	fs->journal_freed = 0;
+	if (fs->opts.journal_path != NULL) {
+		replayed = journal_open(fs);
+	}
+	
+	// Map dir_table and hash_data to memory using mmap, privately if the
+	// journal is written (only for durability levels which synchronise
+	// committed operations), so they are only written at checkpoints
+	int flags = fs->opts.journal_path != NULL &&
+			fs->opts.durability != DURABILITY_NONE ? MAP_PRIVATE : MAP_SHARED;
 	fs->dir = mmap(NULL, fs->dir_table_len, PROT_READ | PROT_WRITE,
-			MAP_SHARED, fs->dir_fd, 0);
+			flags, fs->dir_fd, 0);
 	fs->hash = mmap(NULL, fs->hash_data_len, PROT_READ | PROT_WRITE,
-			MAP_SHARED, fs->hash_fd, 0);
-	assert(fs->file != MAP_FAILED && fs->dir != MAP_FAILED &&
-		   fs->hash != MAP_FAILED && "mmap failed");
+			flags, fs->hash_fd, 0);
+	assert(fs->dir != MAP_FAILED && fs->hash != MAP_FAILED && "mmap failed");
 
 	// Initialise filesystem variables
 	fs->n_processors = n_processors;
@@ -70,48 +298,45 @@ void * init_fs(char * f1, char * f2, char * f3, int n_processors) {
 	fs->o_list = arr_init(fs->index_len, OFFSET, fs);
 	fs->n_list = arr_init(fs->index_len, NAME, fs);
 	fs->used = 0;
+	fs->reserved = 0;
+	fs->padding = 0;
+	memset(&fs->metrics, 0, sizeof(fs->metrics));
+	memset(&fs->dirty_file, 0, sizeof(fs->dirty_file));
+	memset(&fs->dirty_dir, 0, sizeof(fs->dirty_dir));
+	memset(&fs->dirty_hash, 0, sizeof(fs->dirty_hash));
+	fs->largest_stale = 0;
 	fs->tree_len = fs->hash_data_len / HASH_LEN;
 	fs->leaf_offset = fs->tree_len / 2;
-	UNUSED(fs->n_processors);
-
-	// Read through dir_table for existing files
-	char name[NAME_LEN] = {0};
-	uint64_t offset = 0;
-	uint32_t length = 0;
-	for (int32_t i = 0; i < fs->index_len; ++i) {
-		// Copy 63 characters from name field of dir_table entry
-		memcpy(&name, fs->dir + i * META_LEN, NAME_LEN - 1);
-		
-		// Valid filenames do not start with a null byte
-		if (name[0] != '\0') {
-			memcpy(&length, fs->dir + i * META_LEN + NAME_LEN + OFFSET_LEN,
-					sizeof(uint32_t));
-			
-			// Assign max length of file_data as offset for zero size files
-			// See arr.c for justification
-			if (length == 0) {
-				offset = MAX_FILE_DATA_LEN;
-			} else {
-				memcpy(&offset, fs->dir + i * META_LEN + NAME_LEN,
-						sizeof(uint32_t));
-
-				// Ensure remaining bytes in offset uint64_t are 0
-				memset((uint8_t*)(&offset) + sizeof(uint32_t), 0,
-						sizeof(uint32_t));
-			}
-			
-			// Create file_t and add to sorted arrays
-			file_t* f = file_init(name, offset, length, i);
-			arr_sorted_insert(f, fs->o_list);
-			arr_sorted_insert(f, fs->n_list);
-			
-			// Updating filesystem variables
-			fs->used += f->length;
-			fs->index[i] = 1;
-			++fs->index_count;
+	init_zero_hashes(fs);
+	
+	// Hash blocks written by replayed moves and checkpoint the journal
+	if (fs->journal_fd >= 0) {
+		journal_recover(fs);
+		if (fs->opts.durability == DURABILITY_NONE) {
+			journal_close(fs);
 		}
 	}
 	
+	// Adopt sorted arrays from index sidecar if it is valid for dir_table,
+	// otherwise build the arrays by reading dir_table
+	int32_t loaded = -1;
+	if (fs->opts.index_path != NULL) {
+		if (replayed == 0) {
+			loaded = sidecar_load(&stats[1], fs);
+		}
+		sidecar_remove(fs);
+	}
+	if (loaded < 0) {
+		build_arrays(fs);
+	}
+	check_alignment(fs);
+	
+	commit_start(fs);
+	
+	if (fs->opts.compactor) {
+		compact_start(fs);
+	}
+	
 	return fs;
 }
 
@@ -123,19 +348,45 @@ void close_fs(void * helper) {
 	
 	filesys_t* fs = (filesys_t*)helper;
 	
-	munmap(fs->file, fs->file_data_len);
+	// Stop compaction before unmapping files
+	if (fs->opts.compactor) {
+		compact_stop(fs);
+	}
+	
+	// Synchronise ranges committed but not yet flushed, then write the
+	// journalled ranges of dir_table and hash_data
+	commit_stop(fs);
+	if (fs->journal_fd >= 0) {
+		journal_close(fs);
+	}
+	
+	// Synchronise dir_table before unmapping if an index sidecar is written
+	if (fs->opts.index_path != NULL) {
+		msync(fs->dir, fs->dir_table_len, MS_SYNC);
+	}
+	
+	fs->storage->close(fs);
 	munmap(fs->dir, fs->dir_table_len);
 	munmap(fs->hash, fs->hash_data_len);
 	
+	// Write index sidecar tagged with the final state of dir_table
+	struct stat dir_stat;
+	if (fs->opts.index_path != NULL && !fstat(fs->dir_fd, &dir_stat)) {
+		sidecar_save(&dir_stat, fs);
+	}
+	
 	close(fs->file_fd);
 	close(fs->dir_fd);
 	close(fs->hash_fd);
 	
 	pthread_mutex_destroy(&fs->lock);
+	pthread_cond_destroy(&fs->compact_cond);
 	
-	free_arr(fs->o_list);
+	// Name array is freed first as it contains all files
 	free_arr(fs->n_list);
+	free_arr(fs->o_list);
 	free(fs->index);
+	free(fs->zero_hashes);
 	free(fs);
 }
 
@@ -162,6 +413,182 @@ int32_t new_file_index(filesys_t* fs) {
 	return index;
 }
 
+/*
+ * Returns the number of free bytes before the file at index of the offset
+ * list (index equal to the size of the list gives the free bytes at the end
+ * of file_data)
+ */
+static inline uint64_t gap_before(int32_t index, filesys_t* fs) {
+	arr_t* o_list = fs->o_list;
+	uint64_t start = index < o_list->size ?
+			o_list->offset[index] : (uint64_t)fs->file_data_len;
+	uint64_t end_prev_file = index > 0 ?
+			o_list->offset[index - 1] + o_list->length[index - 1] : 0;
+	return start - end_prev_file;
+}
+
+/*
+ * Moves files to lower offsets in file_data with a journal, in batches of up
+ * to JOURNAL_MOVE_LEN bytes (or one larger file)
+ * The data of each batch is journalled at its new offsets with the new
+ * entries, and only moved once the record is written, so dir_table refers
+ * to intact data after a crash at any point (see journal.c). Moved blocks
+ * are hashed, and the journal is checkpointed once every file has moved.
+ * Must be called while holding the filesystem lock.
+ *
+ * files: files in offset order (files already at their target are skipped)
+ * targets: new offset of each file, with files still in offset order
+ * n: number of files
+ */
+static void journal_move_files(file_t** files, uint64_t* targets, int32_t n,
+		filesys_t* fs) {
+	uint64_t* sources = salloc(sizeof(*sources) * (n + 1));
+	int32_t last = 0;
+	for (int32_t first = 0; first < n; first = last) {
+		// Journal the data and entries of the batch
+		uint64_t bytes = 0;
+		for (last = first; last < n && (bytes == 0 ||
+				bytes + files[last]->length <= JOURNAL_MOVE_LEN); ++last) {
+			file_t* file = files[last];
+			sources[last] = file->offset;
+			if (file->offset == targets[last]) {
+				continue;
+			}
+			
+			bytes += file->length;
+			journal_data(targets[last], file->offset, file->length, fs);
+			update_file_offset(targets[last], file);
+			update_dir_offset(file, fs);
+			if (file->o_index >= 0) {
+				arr_update(file->o_index, fs->o_list);
+			}
+		}
+		if (bytes == 0) {
+			continue;
+		}
+		commit_barrier(fs);
+		
+		// Move the data in offset order, then hash from the first target to
+		// the end of the last file's old data
+		int64_t start = -1;
+		uint64_t end = 0;
+		for (int32_t i = first; i < last; ++i) {
+			if (sources[i] != targets[i]) {
+				fs->storage->move(targets[i], sources[i], files[i]->length, fs);
+				dirty_add(&fs->dirty_file, targets[i], files[i]->length);
+				start = start < 0 ? (int64_t)targets[i] : start;
+				end = sources[i] + files[i]->length;
+			}
+		}
+		compute_hash_block_range(start, end - start, fs);
+	}
+	
+	free(sources);
+	commit_checkpoint(fs);
+}
+
+/*
+ * Opens a gap of at least length bytes in file_data by moving the smallest
+ * total number of bytes
+ * A window of consecutive files (in offset order) is compacted towards the
+ * end of the file before the window, which joins every gap in the window into
+ * one gap after the last file moved. The window moving the fewest bytes is
+ * chosen using two pointers over the dense offset and length arrays. A window
+ * containing no files is an existing gap, so no files are moved if a large
+ * enough gap already exists (the first such gap is used).
+ * The total free space in file_data must be at least length bytes.
+ * With a journal, files are moved by journal_move_files, which hashes them.
+ *
+ * length: size of gap required
+ * hash_offset: pointer to variable storing offset of first modified
+ * 				byte in file_data (-1 if no files moved or they were hashed),
+ * 				or NULL
+ *
+ * returns: offset of gap on success
+ * 			OVER_BUDGET if more than opts.repack_budget bytes must be moved
+ * 			(no files are moved)
+ */
+int64_t repack_window(size_t length, int64_t* hash_offset, filesys_t* fs) {
+	assert(fs != NULL && length > 0 && "invalid args");
+
+	int32_t size = fs->o_list->size;
+	uint64_t* offsets = fs->o_list->offset;
+	uint32_t* lengths = fs->o_list->length;
+
+	// Window of files first to last - 1, with gaps first to last
+	int32_t first = 0;
+	uint64_t gaps = 0;
+	uint64_t moved = 0;
+	int32_t best_first = -1;
+	int32_t best_last = -1;
+	uint64_t best_moved = UINT64_MAX;
+
+	for (int32_t last = 0; last <= size && best_moved > 0; ++last) {
+		gaps += gap_before(last, fs);
+		if (last > 0) {
+			moved += lengths[last - 1];
+		}
+
+		// Remove files from the start of the window while it remains large
+		// enough
+		while (first < last && gaps - gap_before(first, fs) >= length) {
+			gaps -= gap_before(first, fs);
+			moved -= lengths[first];
+			++first;
+		}
+
+		if (gaps >= length && moved < best_moved) {
+			best_first = first;
+			best_last = last;
+			best_moved = moved;
+		}
+	}
+
+	assert(best_first >= 0 && "insufficient space in file_data");
+	if (fs->opts.repack_budget > 0 && best_moved > fs->opts.repack_budget) {
+		return OVER_BUDGET;
+	}
+
+	// Compact files in window, tracking first byte modified for hashing
+	file_t** o_list = fs->o_list->list;
+	uint64_t end_prev_file = best_first > 0 ?
+			offsets[best_first - 1] + lengths[best_first - 1] : 0;
+	if (hash_offset != NULL) {
+		*hash_offset = -1;
+	}
+
+	if (fs->journal_fd >= 0 && best_last > best_first) {
+		int32_t n = best_last - best_first;
+		file_t** files = salloc(sizeof(*files) * n);
+		uint64_t* targets = salloc(sizeof(*targets) * n);
+		for (int32_t i = 0; i < n; ++i) {
+			files[i] = o_list[best_first + i];
+			targets[i] = end_prev_file;
+			if (offsets[best_first + i] > end_prev_file) {
+				fs->metrics.compact_bytes += files[i]->length;
+			}
+			end_prev_file += lengths[best_first + i];
+		}
+		journal_move_files(files, targets, n, fs);
+		free(files);
+		free(targets);
+		return end_prev_file;
+	}
+
+	for (int32_t i = best_first; i < best_last; ++i) {
+		if (offsets[i] > end_prev_file) {
+			if (hash_offset != NULL && *hash_offset < 0) {
+				*hash_offset = end_prev_file;
+			}
+			fs->metrics.compact_bytes += o_list[i]->length;
+			repack_move(o_list[i], end_prev_file, fs);
+		}
+		end_prev_file = offsets[i] + lengths[i];
+	}
+
+	return end_prev_file;
+}
+
 /*
  * Returns offset in file_data for insertion
  *
@@ -169,101 +596,472 @@ int32_t new_file_index(filesys_t* fs) {
  * hash_offset: pointer to variable storing offset of first modified
  * 				byte in file_data
  *
- * returns: valid file_data offset for new file, repacking if required
+ * returns: valid file_data offset for new file, compacting files if required
+ * 			OVER_BUDGET if compaction would exceed opts.repack_budget
  */
-uint64_t new_file_offset(size_t length, int64_t* hash_offset, filesys_t* fs) {
+int64_t new_file_offset(size_t length, int64_t* hash_offset, filesys_t* fs) {
 	assert(fs != NULL && length <= fs->file_data_len && "invalid args");
-	assert(fs->used + length <= fs->file_data_len &&
-	       "insufficient space in file_data");
+	assert(fs->used + fs->padding + align_len(length, fs) <=
+	       fs->file_data_len && "insufficient space in file_data");
 
-	// Return max length of file_data for zero size files
+	// Zero size files do not occupy space in file_data
 	if (length == 0) {
-		return MAX_FILE_DATA_LEN;
+		return 0;
 	}
 
-	// Find offset of first non-zero size file
-	int32_t size = fs->o_list->size;
-	file_t* first_non_zero_file = find_next_nonzero_file(0, fs->o_list);
-	
-	// Return 0 if no files, only zero size files, or if first non-zero size
-	// file offset is large enough
-	if (size <= 0 || first_non_zero_file == NULL ||
-			first_non_zero_file->offset >= length) {
-		return 0;
+	// Reclaim space reserved for appends if required
+	if (fs->used + fs->padding + fs->reserved + align_len(length, fs) >
+			fs->file_data_len) {
+		release_reserves(fs);
 	}
 
-	uint64_t start_curr_file = 0;
-	uint64_t end_prev_file = 0;
-	int32_t search_index = first_non_zero_file->o_index + 1;
-	file_t* prev_non_zero_file = first_non_zero_file;
-	file_t* curr_non_zero_file =
-			find_next_nonzero_file(search_index, fs->o_list);
+	// Use the first large enough gap, or compact the fewest bytes to open one
+	return repack_window(align_len(length, fs), hash_offset, fs);
+}
 
-	// Check space between remaining elements in the offset array
-	while (curr_non_zero_file != NULL) {
-		start_curr_file = curr_non_zero_file->offset;
-		end_prev_file =
-				prev_non_zero_file->offset + prev_non_zero_file->length;
+/*
+ * Releases the space reserved after every file for appends, independent of
+ * the filesystem lock state
+ */
+void release_reserves(filesys_t* fs) {
+	if (fs->reserved == 0) {
+		return;
+	}
 
-		// Return offset of first byte after end of previous
-		// file if sufficient space
-		if (start_curr_file - end_prev_file >= length) {
-			return end_prev_file;
+	for (int32_t i = 0; i < fs->o_list->size; ++i) {
+		if (fs->o_list->list[i]->reserve > 0) {
+			fs->o_list->list[i]->reserve = 0;
+			arr_update(i, fs->o_list);
 		}
+	}
+	fs->reserved = 0;
+}
 
-		prev_non_zero_file = curr_non_zero_file;
-		search_index = curr_non_zero_file->o_index + 1;
-		curr_non_zero_file =
-				find_next_nonzero_file(search_index, fs->o_list);
+/*
+ * Returns the offset of the first (or last) free extent of at least length
+ * bytes in file_data, or -1 if there is none
+ *
+ * last: whether the last free extent is returned instead of the first
+ */
+static int64_t free_extent(size_t length, int32_t last, filesys_t* fs) {
+	int32_t size = fs->o_list->size;
+	for (int32_t j = 0; j <= size; ++j) {
+		int32_t i = last ? size - j : j;
+		if (gap_before(i, fs) >= length) {
+			return i > 0 ? fs->o_list->offset[i - 1] +
+					fs->o_list->length[i - 1] : 0;
+		}
 	}
+	return -1;
+}
 
-	uint64_t end_last_file =
-			prev_non_zero_file->offset + prev_non_zero_file->length;
+/*
+ * Zero Subtrees
+ *
+ * The hash of an all zero subtree only depends on its height (see
+ * init_zero_hashes), so a node storing the zero hash of its height is the
+ * root of a zero subtree: every block below it is zero, and the hashes
+ * stored below it are not used (they may be left from earlier data). Zero
+ * filled ranges then only write the O(log n) nodes covering them and their
+ * ancestors, rather than a leaf per block. Before blocks below a zero
+ * subtree root are hashed, the roots on the paths to the edges of the range
+ * are pushed down to their children (see hash_expand), so every hash read
+ * while rehashing the range is current. Verification checks a block below a
+ * zero subtree root is zero (see verify_hash_range).
+ */
 
-	// Check space between last non-zero size file in offset list and the end
-	// of file_data
-	if (fs->file_data_len - end_last_file >= length) {
-		return end_last_file;
+/*
+ * Returns the height of the root of the hash tree (leaves have height 0)
+ */
+static int32_t tree_height(filesys_t* fs) {
+	int32_t height = 0;
+	while (((int64_t)1 << height) < (int64_t)fs->leaf_offset + 1) {
+		++height;
+	}
+	return height;
+}
+
+/*
+ * Returns whether a node stores the zero hash of its height
+ */
+static inline int32_t node_zero(int32_t n_index, int32_t height,
+		filesys_t* fs) {
+	return memcmp(fs->hash + n_index * HASH_LEN,
+			fs->zero_hashes + height * HASH_LEN, HASH_LEN) == 0;
+}
+
+/*
+ * Sets a node to the zero hash of its height
+ */
+static inline void set_node_zero(int32_t n_index, int32_t height,
+		filesys_t* fs) {
+	memcpy(fs->hash + n_index * HASH_LEN,
+			fs->zero_hashes + height * HASH_LEN, HASH_LEN);
+	dirty_add(&fs->dirty_hash, n_index * HASH_LEN, HASH_LEN);
+}
+
+// Range of blocks updated below a subtree of the hash tree
+typedef struct subtree_t {
+	int32_t n_index;		// Root of subtree
+	int32_t height;			// Height of root
+	int64_t lo;				// First block below root
+	int64_t hi;				// Last block below root
+} subtree_t;
+
+/*
+ * Pushes the zero subtree roots overlapping blocks first to last down to
+ * their children, until no zero subtree root partly overlaps the range
+ * With full set, zero subtrees within the range are also pushed down to the
+ * leaves, so every hash in the range is current.
+ */
+static void expand_subtree(subtree_t t, int64_t first, int64_t last,
+		int32_t full, filesys_t* fs) {
+	int32_t within = first <= t.lo && t.hi <= last;
+	if (t.hi < first || t.lo > last || t.height == 0 || (within && !full)) {
+		return;
 	}
 	
-	// Repack file_data if no large enough contiguous space found
-	if (hash_offset != NULL) {
-		*hash_offset = repack_helper(fs);
-	} else {
-		repack_helper(fs);
+	int64_t mid = t.lo + ((t.hi - t.lo + 1) >> 1);
+	if (node_zero(t.n_index, t.height, fs)) {
+		set_node_zero(lc_index(t.n_index), t.height - 1, fs);
+		set_node_zero(rc_index(t.n_index), t.height - 1, fs);
+	}
+	expand_subtree((subtree_t){lc_index(t.n_index), t.height - 1, t.lo,
+			mid - 1}, first, last, full, fs);
+	expand_subtree((subtree_t){rc_index(t.n_index), t.height - 1, mid,
+			t.hi}, first, last, full, fs);
+}
+
+/*
+ * Makes the hashes read when rehashing blocks first to last current, by
+ * pushing down the zero subtree roots at the edges of the range (O(log n)
+ * nodes), or every zero subtree root overlapping it
+ *
+ * first: first block to be rehashed
+ * last: last block to be rehashed
+ * full: whether every hash of the range must be current, as when only
+ * 		 changed hashes are propagated (see hash_worker)
+ */
+static void hash_expand(int64_t first, int64_t last, int32_t full,
+		filesys_t* fs) {
+	subtree_t root = {0, tree_height(fs), 0, fs->leaf_offset};
+	expand_subtree(root, first, last, full, fs);
+}
+
+/*
+ * Sets the nodes of a subtree entirely within blocks first to last to zero
+ * hashes, and rehashes the nodes partly within them
+ */
+static void zero_subtree(subtree_t t, int64_t first, int64_t last,
+		filesys_t* fs) {
+	if (t.hi < first || t.lo > last) {
+		return;
+	} else if (first <= t.lo && t.hi <= last) {
+		set_node_zero(t.n_index, t.height, fs);
+		return;
+	}
+	
+	int64_t mid = t.lo + ((t.hi - t.lo + 1) >> 1);
+	if (node_zero(t.n_index, t.height, fs)) {
+		set_node_zero(lc_index(t.n_index), t.height - 1, fs);
+		set_node_zero(rc_index(t.n_index), t.height - 1, fs);
+	}
+	zero_subtree((subtree_t){lc_index(t.n_index), t.height - 1, t.lo,
+			mid - 1}, first, last, fs);
+	zero_subtree((subtree_t){rc_index(t.n_index), t.height - 1, mid, t.hi},
+			first, last, fs);
+	
+	uint8_t hash_cat[2 * HASH_LEN];
+	hash_node(t.n_index, hash_cat, fs->hash + t.n_index * HASH_LEN, fs);
+	dirty_add(&fs->dirty_hash, t.n_index * HASH_LEN, HASH_LEN);
+}
+
+/*
+ * Sets the hashes of file_data blocks first to last (inclusive), which must
+ * be zero, to the hash of a zero block, and updates their parents up to the
+ * root
+ * Only the O(log n) nodes covering the range are written (the roots of zero
+ * subtrees), and the ancestors of the edges of the range are hashed from
+ * their children.
+ */
+static void zero_hash_range(int32_t first, int32_t last, filesys_t* fs) {
+	subtree_t root = {0, tree_height(fs), 0, fs->leaf_offset};
+	zero_subtree(root, first, last, fs);
+}
+
+/*
+ * Punches a hole of whole pages in file_data (see the punch operation of the
+ * storage backend)
+ *
+ * start: page aligned offset of first byte
+ * end: page aligned offset after the last byte
+ *
+ * returns: 0 on success, -1 if punching is not supported
+ */
+static int32_t punch_pages(uint64_t start, uint64_t end, filesys_t* fs) {
+	return fs->storage->punch(start, end - start, fs);
+}
+
+/*
+ * Releases the whole pages of a freed range of file_data from the backing
+ * file (opts.punch_holes), so free space does not occupy disk space or page
+ * cache
+ * Pages at the edges of the range are included if the rest of the page is
+ * also free (up to the data of the neighbouring files, as space reserved or
+ * lost to alignment holds no data). Punched pages read as zero, so their
+ * blocks are given the constant zero hashes. Nothing is released if punching
+ * is not supported. With a journal, the record of the operation freeing the
+ * range is written first, as the pages may still hold data referred to by
+ * the journal.
+ *
+ * start: offset of first byte freed
+ * end: offset after the last byte freed
+ * index: offset array index of the first file after the freed range (the
+ * 		  range is between the data of files index - 1 and index)
+ */
+static void punch_freed(uint64_t start, uint64_t end, int32_t index,
+		filesys_t* fs) {
+	if (!fs->opts.punch_holes || end <= start) {
+		return;
+	}
+	
+	arr_t* o_list = fs->o_list;
+	uint64_t free_start = index > 0 ? o_list->list[index - 1]->offset +
+			o_list->list[index - 1]->length : 0;
+	uint64_t free_end = index < o_list->size ?
+			o_list->offset[index] : (uint64_t)fs->file_data_len;
+	
+	uint64_t page = sysconf(_SC_PAGESIZE);
+	start -= start % page;
+	if (start < free_start) {
+		start += page;
+	}
+	end += (page - end % page) % page;
+	if (end > free_end) {
+		end -= page;
+	}
+	if (end <= start) {
+		return;
+	}
+	if (fs->journal_fd >= 0) {
+		commit_barrier(fs);
+	}
+	if (punch_pages(start, end, fs)) {
+		return;
 	}
 	
-	// Return offset of first byte in contiguous block after repack
-	return fs->used;
+	fs->metrics.punched_bytes += end - start;
+	zero_hash_range(start / BLOCK_LEN, (end - 1) / BLOCK_LEN, fs);
+}
+
+/*
+ * Zero fills a range of file_data which holds no data of other files, and
+ * updates the hashes of its blocks
+ * The whole pages in the range are punched rather than written, so they are
+ * not allocated (on disk or in the page cache) until data is written to
+ * them, and only the partial pages at the edges are written with zeros (the
+ * whole range is written if punching is not supported). Whole blocks are
+ * given zero hashes (see zero_hash_range), so only the partial blocks at the
+ * edges are read back and hashed. Growing a file by any length therefore
+ * touches O(1) pages of file_data and O(log n) hashes.
+ *
+ * start: offset of first byte
+ * end: offset after the last byte
+ */
+static void zero_range(uint64_t start, uint64_t end, filesys_t* fs) {
+	if (end <= start) {
+		return;
+	}
+	
+	// Punch the whole pages, then write the edges (or the whole range)
+	uint64_t page = sysconf(_SC_PAGESIZE);
+	uint64_t first = (start + page - 1) / page * page;
+	uint64_t last = end / page * page;
+	if (last <= first || punch_pages(first, last, fs)) {
+		first = end;
+		last = end;
+	}
+	fs->storage->zero(start, first - start, fs);
+	fs->storage->zero(last, end - last, fs);
+	dirty_add(&fs->dirty_file, start, first - start);
+	dirty_add(&fs->dirty_file, last, end - last);
+	
+	// Give the whole blocks zero hashes, then hash the edges
+	first = (start + BLOCK_LEN - 1) / BLOCK_LEN * BLOCK_LEN;
+	last = end / BLOCK_LEN * BLOCK_LEN;
+	if (last <= first) {
+		compute_hash_block_range(start, end - start, fs);
+		return;
+	}
+	zero_hash_range(first / BLOCK_LEN, last / BLOCK_LEN - 1, fs);
+	compute_hash_block_range(start, first - start, fs);
+	compute_hash_block_range(last, end - last, fs);
+}
+
+/*
+ * Moves a file growing to a new length to free space in file_data, reserving
+ * space after the file for further appends
+ * The space reserved is equal to the new length (limited by the space which
+ * would remain free), so a file grown by appending chunks is only moved
+ * O(log n) times.
+ *
+ * A free extent large enough for the file and its reserved space is used if
+ * one exists, otherwise a free extent large enough for the file alone, so
+ * only this file is moved and its data is copied directly. With the
+ * hot_placement option, hot files use the last such extent, keeping growing
+ * files after other files. Only if neither exists is a gap opened by
+ * compacting other files (see repack_window), in which case the data is
+ * first copied to a buffer, as compaction may move other files over it. No
+ * space is reserved if compaction for the reserved space would exceed
+ * opts.repack_budget.
+ *
+ * The file must not be in the offset list, and must not have space reserved.
+ * With a journal, a file with data instead stays in the offset list, so its
+ * current extent is neither reused nor overwritten by compaction before the
+ * journal refers to its new offset. Its data is then copied directly once
+ * a gap is open (compaction may move the file, but never into the gap).
+ * The new offset is not written to the file or dir_table.
+ *
+ * file: file_t of file being grown (its length is the old length)
+ * length: new length of file
+ * copy: number of bytes of file data to copy to the new offset
+ * hash_offset: pointer to variable storing offset of first modified
+ * 				byte in file_data (including copied data), which is set
+ * 				whenever the file moves, even with nothing to copy, so
+ * 				callers zero fill the unwritten bytes at the new offset
+ *
+ * returns: valid file_data offset for the file
+ * 			OVER_BUDGET if compaction would exceed opts.repack_budget (no
+ * 			data is moved)
+ * 			NO_SPACE if the file stays in the offset list and the free
+ * 			space is less than its new length (no data is moved)
+ */
+static int64_t relocate_file(file_t* file, size_t length, size_t copy,
+		int64_t* hash_offset, filesys_t* fs) {
+	assert((file->o_index < 0 || fs->journal_fd >= 0) &&
+	       file->reserve == 0 && "invalid args");
+
+	// Reclaim space reserved for other files if required (space used
+	// includes alignment padding, and the file if it stays in the offset
+	// list)
+	uint64_t aligned = align_len(length, fs);
+	int64_t used = fs->used + fs->padding;
+	if (file->o_index < 0) {
+		used -= align_len(file->length, fs);
+	} else if (used + aligned > fs->file_data_len) {
+		return NO_SPACE;
+	}
+	if (used + fs->reserved + aligned > fs->file_data_len) {
+		release_reserves(fs);
+	}
+
+	uint64_t max_slack = length;
+	if (max_slack > fs->file_data_len - used - fs->reserved - aligned) {
+		max_slack = fs->file_data_len - used - fs->reserved - aligned;
+	}
+	if (max_slack > UINT32_MAX - aligned) {
+		max_slack = UINT32_MAX - aligned;
+	}
+	
+	// Reserved space is a multiple of the alignment, so the extent of the
+	// file is its aligned length plus the space reserved
+	if (fs->opts.align > 1) {
+		max_slack -= max_slack % fs->opts.align;
+	}
+
+	// Use a free extent, which may overlap the current data
+	int32_t last = fs->opts.hot_placement && file_hot(file);
+	uint64_t slack = max_slack;
+	int64_t offset = free_extent(align_len(length + slack, fs), last, fs);
+	if (offset < 0) {
+		slack = 0;
+		offset = free_extent(aligned, last, fs);
+	}
+	if (offset >= 0) {
+		if (copy > 0) {
+			fs->storage->move(offset, file->offset, copy, fs);
+			dirty_add(&fs->dirty_file, offset, copy);
+		}
+		*hash_offset = offset;
+		file->reserve = slack;
+		fs->reserved += slack;
+		return offset;
+	}
+
+	// Otherwise compact other files to open a gap, copying the data to a
+	// buffer first unless the file stays in the offset list
+	int32_t listed = file->o_index >= 0;
+	uint8_t* temp = NULL;
+	if (!listed) {
+		temp = salloc(sizeof(*temp) * copy);
+		fs->storage->read(file->offset, copy, temp, fs);
+	}
+
+	slack = max_slack;
+	offset = OVER_BUDGET;
+	if (slack > 0) {
+		offset = repack_window(align_len(length + slack, fs), hash_offset, fs);
+	}
+	if (offset == OVER_BUDGET) {
+		slack = 0;
+		offset = repack_window(aligned, hash_offset, fs);
+	}
+
+	if (offset != OVER_BUDGET) {
+		if (listed && copy > 0) {
+			fs->storage->move(offset, file->offset, copy, fs);
+		} else if (copy > 0) {
+			fs->storage->write(offset, copy, temp, fs);
+		}
+		dirty_add(&fs->dirty_file, offset, copy);
+
+		// Copied data must be hashed at its new offset
+		if (*hash_offset < 0 || *hash_offset > offset) {
+			*hash_offset = offset;
+		}
+		file->reserve = slack;
+		fs->reserved += slack;
+	}
+	free(temp);
+	return offset;
 }
 
 int create_file(char * filename, size_t length, void * helper) {
 	filesys_t* fs = (filesys_t*)helper;
-	LOCK(&fs->lock);
+	LOCK_FS(fs);
 
 	// Return 1 if file already exists
-	file_t temp;
+	FILE_KEY(temp);
 	update_file_name(filename, &temp);
 	if (arr_get_by_key(&temp, fs->n_list) != NULL) {
-		UNLOCK(&fs->lock);
+		UNLOCK_FS(fs);
 		return 1;
 	}
 	
 	// Return 2 if insufficient space in file_data or dir_table
-	if (fs->used + length > fs->file_data_len ||
+	if (fs->used + fs->padding + align_len(length, fs) > fs->file_data_len ||
 		fs->index_count >= fs->index_len) {
-		UNLOCK(&fs->lock);
+		UNLOCK_FS(fs);
 		return 2;
 	}
 	
-	// Find available index in dir_table and space in file_data
+	// Find space in file_data, returning 4 if compaction exceeds the budget
+	// (the space exists, but opening a gap for it moves too many bytes)
 	int64_t hash_offset = -1;
+	int64_t offset = new_file_offset(length, &hash_offset, fs);
+	if (offset == OVER_BUDGET) {
+		UNLOCK_FS(fs);
+		return 4;
+	}
+	
+	// Find available index in dir_table
 	int32_t index = new_file_index(fs);
-	uint64_t offset = new_file_offset(length, &hash_offset, fs);
 
-	// Create new file_t struct and insert into both sorted lists
-	file_t* f = file_init(filename, offset, length, index);
-	arr_sorted_insert(f, fs->o_list);
+	// Create new file_t struct and insert into sorted lists
+	file_t* f = file_init_dir(filename, offset, length, index, fs);
+	if (length > 0) {
+		arr_sorted_insert(f, fs->o_list);
+	}
 	arr_sorted_insert(f, fs->n_list);
 
 	// Write file metadata to dir_table and update index array
@@ -273,24 +1071,21 @@ int create_file(char * filename, size_t length, void * helper) {
 
 	// Only perform file_data updates for non-zero size files
 	if (length > 0) {
-		// Write null bytes to file_data and update filesystem variables
-		write_null_byte(fs->file, offset, length);
+		// Zero fill the unwritten file and update filesystem variables
+		f->written = 0;
 		fs->used += length;
+		fs->padding += align_len(length, fs) - length;
 
+		// Hash blocks modified by repack before the file
 		if (hash_offset >= 0) {
-			// Hash blocks modified by repack until end of file
-			compute_hash_block_range(hash_offset, fs->used - hash_offset, fs);
-		} else {
-			// Only hash blocks containing the file
-			compute_hash_block_range(offset, length, fs);
+			compute_hash_block_range(hash_offset, offset - hash_offset, fs);
 		}
+		zero_range(offset, offset + length, fs);
 	}
 	
-	msync(fs->file, fs->file_data_len, MS_ASYNC);
-	msync(fs->dir, fs->dir_table_len, MS_ASYNC);
-	msync(fs->hash, fs->hash_data_len, MS_ASYNC);
-	
-	UNLOCK(&fs->lock);
+	uint64_t ticket = commit_op(fs);
+	UNLOCK_FS(fs);
+	commit_wait(ticket, fs);
 	return 0;
 }
 
@@ -300,78 +1095,91 @@ int create_file(char * filename, size_t length, void * helper) {
  * file: file_t of file being resized
  * length: new file size
  * copy: number of bytes to copy if repacking required, reduces copying during
- * 		 write_file calls which overwrite data
+ * 		 write_file calls which overwrite data (unwritten bytes after
+ * 		 file->written are not copied, so callers must zero fill them if the
+ * 		 file moved)
  *
- * returns: offset of first byte repacked if repack occurred, else -1
+ * returns: offset of first byte moved or copied if the file or other files
+ * 			were moved (at most the new offset of the file if it moved),
+ * 			else -1
+ * 			OVER_BUDGET if compaction would exceed opts.repack_budget (the
+ * 			file is not modified)
+ * 			NO_SPACE if the file cannot move with a journal, as both its
+ * 			current and new extents do not fit (the file is not modified)
  */
 int64_t resize_file_helper(file_t* file, size_t length, size_t copy, filesys_t* fs) {
 	int64_t hash_offset = -1;
 	int64_t old_length = file->length;
+	if (copy > file->written) {
+		copy = file->written;
+	}
 
 	// Find suitable space in file_data if length increased
 	if (length > old_length) {
-		int64_t old_offset = file->offset;
-		file_t* next_non_zero_file = NULL;
-
 		// Expansion of zero size files
-		if (old_offset >= MAX_FILE_DATA_LEN) {
-			// Remove the file from the sorted offset list
-			arr_remove(file->o_index, fs->o_list);
-
-			// Find first non-zero size file
-			next_non_zero_file = find_next_nonzero_file(0, fs->o_list);
-
-			// Repack if first non-zero size file offset is not large enough
-			if (next_non_zero_file != NULL &&
-					next_non_zero_file->offset < length) {
-				hash_offset = repack_helper(fs);
-				update_file_offset(fs->used, file);
-
-			// Otherwise, update file offset to 0
-			} else {
-				update_file_offset(0, file);
+		if (old_length == 0) {
+			// Find space for the file, compacting files if required
+			// (the file is inserted into the offset list below)
+			int64_t offset = relocate_file(file, length, 0, &hash_offset, fs);
+			if (offset == OVER_BUDGET) {
+				return OVER_BUDGET;
 			}
-
+			
+			update_file_offset(offset, file);
 			update_dir_offset(file, fs);
 
-			// Re-insert file into sorted offset list
-			arr_sorted_insert(file, fs->o_list);
-			
 		// Expansion of non-zero size files
 		} else {
-			// Find next non-zero size file
-			next_non_zero_file =
-					find_next_nonzero_file(file->o_index + 1, fs->o_list);
-
-			int repack_required = 0;
-			if (next_non_zero_file != NULL) {
-				// Repack if insufficient space between files
-				repack_required =
-						next_non_zero_file->offset - file->offset < length;
-			} else {
-				// Repack if insufficient space from end of file_data
-				repack_required =
-						fs->file_data_len - file->offset < length;
+			// Find start of next file, or end of file_data if last file
+			int32_t next_index = file->o_index + 1;
+			uint64_t next_offset = fs->file_data_len;
+			if (next_index < fs->o_list->size) {
+				next_offset = fs->o_list->offset[next_index];
 			}
 
-			if (repack_required) {
-				// Copy required data into a buffer
-				uint8_t* temp = salloc(sizeof(*temp) * copy);
-				memcpy(temp, fs->file + file->offset, copy);
+			// Move file to a gap if insufficient space before next file
+			if (next_offset - file->offset < align_len(length, fs)) {
+				// Remove file from sorted offset list, so its current space
+				// (including space reserved after it) can be used when
+				// opening a gap. With a journal, only its reserved space is
+				// released (see relocate_file).
+				int32_t listed = fs->journal_fd >= 0;
+				fs->reserved -= file->reserve;
+				file->reserve = 0;
+				if (listed) {
+					arr_update(file->o_index, fs->o_list);
+				} else {
+					arr_remove(file->o_index, fs->o_list);
+				}
 				
-				// Remove file from sorted offset list
-				arr_remove(file->o_index, fs->o_list);
-
-				// Repack and write buffer contents to the end of file_data
-				hash_offset = repack_helper(fs);
-				memcpy(fs->file + fs->used - old_length, temp, copy);
-				free(temp);
+				// Move the file and the data required to free space
+				int64_t offset = relocate_file(file, length, copy,
+						&hash_offset, fs);
+				if (offset == OVER_BUDGET || offset == NO_SPACE) {
+					if (!listed) {
+						arr_sorted_insert(file, fs->o_list);
+					}
+					return offset;
+				}
 				
-				update_file_offset(fs->used - old_length, file);
+				if (listed) {
+					arr_remove(file->o_index, fs->o_list);
+				}
+				update_file_offset(offset, file);
 				update_dir_offset(file, fs);
+				++fs->metrics.relocations;
+				fs->journal_freed = 1;
 
 				// Re-insert file into sorted offset list
 				arr_sorted_insert(file, fs->o_list);
+
+			// Otherwise grow in place, using space reserved after the file
+			} else if (file->reserve > 0) {
+				uint64_t extent = align_len(old_length, fs) + file->reserve;
+				uint64_t aligned = align_len(length, fs);
+				uint32_t reserve = aligned < extent ? extent - aligned : 0;
+				fs->reserved -= file->reserve - reserve;
+				file->reserve = reserve;
 			}
 		}
 	}
@@ -380,8 +1188,33 @@ int64_t resize_file_helper(file_t* file, size_t length, size_t copy, filesys_t*
 	if (length != old_length) {
 		update_file_length(length, file);
 		update_dir_length(file, fs);
+		++fs->metrics.resizes;
+		if (file->written > length) {
+			file->written = length;
+		}
 
 		fs->used += length - old_length;
+		fs->padding += (align_len(length, fs) - length) -
+				(align_len(old_length, fs) - old_length);
+		fs->journal_freed |= length < old_length;
+
+		// Zero size files are only stored in the offset list while non-zero
+		if (old_length == 0) {
+			arr_sorted_insert(file, fs->o_list);
+		} else if (length == 0) {
+			int32_t index = file->o_index;
+			uint64_t end = file->offset + fs->o_list->length[index];
+			arr_remove(index, fs->o_list);
+			fs->reserved -= file->reserve;
+			file->reserve = 0;
+			punch_freed(file->offset, end, index, fs);
+		} else {
+			arr_update(file->o_index, fs->o_list);
+			if (length < old_length) {
+				punch_freed(file->offset + length, file->offset + old_length,
+						file->o_index + 1, fs);
+			}
+		}
 	}
 
 	return hash_offset;
@@ -389,51 +1222,61 @@ int64_t resize_file_helper(file_t* file, size_t length, size_t copy, filesys_t*
 
 int resize_file(char * filename, size_t length, void * helper) {
     filesys_t* fs = (filesys_t*)helper;
-	LOCK(&fs->lock);
+	LOCK_FS(fs);
 	
 	// Return 1 if file does not exist
-	file_t temp;
+	FILE_KEY(temp);
 	update_file_name(filename, &temp);
 	file_t* f = arr_get_by_key(&temp, fs->n_list);
 	if (f == NULL) {
-		UNLOCK(&fs->lock);
+		UNLOCK_FS(fs);
 		return 1;
 	}
 	
 	// Return 2 if insufficient space in file_data
-	if (fs->used + length - f->length > fs->file_data_len) {
-		UNLOCK(&fs->lock);
+	if (fs->used + fs->padding + align_len(length, fs) -
+			align_len(f->length, fs) > fs->file_data_len) {
+		UNLOCK_FS(fs);
 		return 2;
 	}
 	
 	// Return 0 if new length is same as old length
 	if (length == f->length) {
-		UNLOCK(&fs->lock);
+		UNLOCK_FS(fs);
 		return 0;
 	}
 	
+	// Track activity for placement
+	++f->writes;
+	f->grows += length > f->length;
+	
+	// Return 4 if compaction exceeds the budget, or 2 if the file cannot
+	// move with a journal
 	int64_t old_length = f->length;
 	int64_t hash_offset = resize_file_helper(f, length, old_length, fs);
+	if (hash_offset == OVER_BUDGET || hash_offset == NO_SPACE) {
+		UNLOCK_FS(fs);
+		return hash_offset == OVER_BUDGET ? 4 : 2;
+	}
+	compact_wake(fs);
 
 	if (length > old_length) {
-		write_null_byte(fs->file, f->offset + old_length, length - old_length);
-
+		// Only written bytes are copied when the file moves, and the bytes
+		// after them at the new offset may hold data of deleted files
+		uint64_t kept = hash_offset >= 0 ? f->written : old_length;
+		
+		// Hash blocks modified by repack until the end of the data kept, then
+		// zero fill the rest of the file
 		if (hash_offset >= 0) {
-			// Hash blocks modified by repack until end of file
 			compute_hash_block_range(hash_offset,
-					f->offset + length - hash_offset, fs);
-		} else {
-			// Only hash blocks containing the file
-			compute_hash_block_range(f->offset + old_length,
-					length - old_length, fs);
+					f->offset + kept - hash_offset, fs);
 		}
+		zero_range(f->offset + kept, f->offset + length, fs);
 	}
 
-	msync(fs->file, fs->file_data_len, MS_ASYNC);
-	msync(fs->dir, fs->dir_table_len, MS_ASYNC);
-	msync(fs->hash, fs->hash_data_len, MS_ASYNC);
-
-	UNLOCK(&fs->lock);
+	uint64_t ticket = commit_op(fs);
+	UNLOCK_FS(fs);
+	commit_wait(ticket, fs);
 	return 0;
 }
 
@@ -445,17 +1288,297 @@ int resize_file(char * filename, size_t length, void * helper) {
  */
 void repack_move(file_t* file, uint32_t new_offset, filesys_t* fs) {
 	if (file->length > 0) {
-		memmove(fs->file + new_offset, fs->file + file->offset, file->length);
+		fs->storage->move(new_offset, file->offset, file->length, fs);
+		dirty_add(&fs->dirty_file, new_offset, file->length);
 	}
 
 	update_file_offset(new_offset, file);
 	update_dir_offset(file, fs);
+
+	// Keep dense offset entry consistent if file is in the offset list
+	if (file->o_index >= 0) {
+		arr_update(file->o_index, fs->o_list);
+	}
+}
+
+// Range of hash tree nodes on one level hashed by a thread
+typedef struct hash_task_t {
+	filesys_t* fs;			// Filesystem being hashed
+	int32_t start;			// First node index of range
+	int32_t end;			// Node index after the last node of range
+	uint8_t* changed;		// Per node flags of changed hashes, or NULL
+} hash_task_t;
+
+/*
+ * Worker thread which hashes a range of nodes on one level of the hash tree
+ * When changed flags are given, internal nodes are only hashed if a child
+ * changed, and a node is only flagged (and written) if its hash changed
+ */
+static void* hash_worker(void* arg) {
+	hash_task_t* task = arg;
+	filesys_t* fs = task->fs;
+	uint8_t* changed = task->changed;
+	uint8_t hash_cat[2 * HASH_LEN];
+	uint8_t out[HASH_LEN];
+	for (int32_t i = task->start; i < task->end; ++i) {
+		if (changed == NULL) {
+			hash_node(i, hash_cat, fs->hash + i * HASH_LEN, fs);
+			continue;
+		}
+		
+		if (i < fs->leaf_offset &&
+			!changed[lc_index(i)] && !changed[rc_index(i)]) {
+			continue;
+		}
+		hash_node(i, hash_cat, out, fs);
+		if (memcmp(out, fs->hash + i * HASH_LEN, HASH_LEN)) {
+			memcpy(fs->hash + i * HASH_LEN, out, HASH_LEN);
+			changed[i] = 1;
+		}
+	}
+	return NULL;
+}
+
+/*
+ * Hashes a range of nodes on one level of the hash tree, and the parents of
+ * the range on each level up to the root
+ * Levels with enough nodes are split across up to n_processors threads.
+ *
+ * first: first node index of range
+ * last: last node index of range
+ * changed: per node flags of changed hashes, or NULL to hash every node
+ */
+static void hash_levels(int32_t first, int32_t last, uint8_t* changed,
+		filesys_t* fs) {
+	hash_task_t* tasks = salloc(sizeof(*tasks) * (fs->n_processors + 1));
+	
+	while (first >= 0) {
+		int32_t n_threads = fs->n_processors;
+		if (n_threads > (last - first + 1) / HASH_MIN_NODES) {
+			n_threads = (last - first + 1) / HASH_MIN_NODES;
+		}
+		
+		if (n_threads <= 1) {
+			hash_task_t task = {fs, first, last + 1, changed};
+			hash_worker(&task);
+		} else {
+			for (int32_t i = 0; i < n_threads; ++i) {
+				tasks[i] = (hash_task_t){fs,
+						first + (int64_t)(last - first + 1) * i / n_threads,
+						first +
+						(int64_t)(last - first + 1) * (i + 1) / n_threads,
+						changed};
+			}
+			run_tasks(tasks, sizeof(*tasks), n_threads, hash_worker);
+		}
+		dirty_add(&fs->dirty_hash, first * HASH_LEN,
+				(last - first + 1) * HASH_LEN);
+		
+		// Move to parents of the nodes hashed
+		if (first == 0) {
+			break;
+		}
+		first = p_index(first);
+		last = p_index(last);
+	}
+	
+	free(tasks);
+}
+
+// Range of destination bytes copied by a thread during repack
+typedef struct repack_task_t {
+	filesys_t* fs;			// Filesystem being repacked
+	uint64_t* targets;		// Final offset of each file in offset order
+	int32_t file;			// Index of file containing first byte of range
+	uint64_t start;			// First destination byte of range
+	uint64_t end;			// Destination byte after the last byte of range
+	uint8_t* changed;		// Per node flags of changed hashes
+} repack_task_t;
+
+/*
+ * Worker thread which copies a range of repacked file_data to its final
+ * position, where the range does not overlap any source data still to be
+ * moved
+ * Blocks completed by the range are hashed while still in cache.
+ */
+static void* repack_worker(void* arg) {
+	repack_task_t* task = arg;
+	filesys_t* fs = task->fs;
+	uint64_t* offsets = fs->o_list->offset;
+	uint32_t* lengths = fs->o_list->length;
+	uint64_t pos = task->start;
+	
+	for (int32_t i = task->file; pos < task->end; ++i) {
+		uint64_t end = task->targets[i] + lengths[i];
+		if (end > task->end) {
+			end = task->end;
+		}
+		fs->storage->move(pos, offsets[i] + pos - task->targets[i], end - pos,
+				fs);
+		pos = end;
+	}
+	
+	// Bytes before the range are already final, so every block ending in the
+	// range is complete
+	hash_task_t hash_task = {fs, fs->leaf_offset + task->start / BLOCK_LEN,
+			fs->leaf_offset + task->end / BLOCK_LEN, task->changed};
+	hash_worker(&hash_task);
+	
+	return NULL;
+}
+
+/*
+ * Copies a range of repacked file_data to its final position using up to
+ * n_processors threads, hashing every block ending in the range
+ *
+ * targets: offset of each file in offset order after repack
+ * file: index of file containing the first byte of the range
+ * start: first destination byte of range
+ * end: destination byte after the last byte of range
+ * changed: per node flags of changed hashes
+ */
+static void repack_range(uint64_t* targets, int32_t file, uint64_t start,
+		uint64_t end, uint8_t* changed, filesys_t* fs) {
+	int32_t n_threads = fs->n_processors;
+	if (n_threads > (end - start) / REPACK_MIN_LEN) {
+		n_threads = (end - start) / REPACK_MIN_LEN;
+	}
+	if (n_threads < 1) {
+		n_threads = 1;
+	}
+	
+	// Split range evenly at block boundaries, so no block is hashed by two
+	// threads, finding the file containing each split point
+	repack_task_t* tasks = salloc(sizeof(*tasks) * n_threads);
+	uint64_t* splits = salloc(sizeof(*splits) * (n_threads + 1));
+	splits[0] = start;
+	splits[n_threads] = end;
+	for (int32_t i = 1; i < n_threads; ++i) {
+		splits[i] = start + (end - start) * i / n_threads;
+		splits[i] -= splits[i] % BLOCK_LEN;
+		if (splits[i] < splits[i - 1]) {
+			splits[i] = splits[i - 1];
+		}
+	}
+	for (int32_t i = 0; i < n_threads; ++i) {
+		while (targets[file] + fs->o_list->length[file] <= splits[i]) {
+			++file;
+		}
+		tasks[i] = (repack_task_t){fs, targets, file, splits[i], splits[i + 1],
+				changed};
+	}
+	free(splits);
+	run_tasks(tasks, sizeof(*tasks), n_threads, repack_worker);
+	free(tasks);
+}
+
+/*
+ * Removes large gaps between files from the file_data backing file with
+ * FALLOC_FL_COLLAPSE_RANGE, which shifts the data after each gap without
+ * copying it, then restores the length of file_data with ftruncate
+ * Only the part of each gap aligned to the page and filesystem block size is
+ * removed, so files after a gap are left at most one unit after their final
+ * offset. Gaps are removed from the last, so the offsets of earlier gaps are
+ * unaffected. Stops at the first failure (such as filesystems which do not
+ * support collapsing), leaving the remaining gaps to be copied. If the length
+ * cannot be restored, the gap is inserted again with FALLOC_FL_INSERT_RANGE,
+ * which shifts the data back, and is also copied.
+ *
+ * returns: offset of first byte moved, or -1 if no gap was removed
+ */
+static int64_t repack_collapse(filesys_t* fs) {
+	struct stat stats;
+	if (fstat(fs->file_fd, &stats)) {
+		return -1;
+	}
+	int64_t unit = sysconf(_SC_PAGESIZE);
+	if (stats.st_blksize > unit) {
+		unit = stats.st_blksize;
+	}
+	
+	// Removing gaps must preserve the alignment of file offsets
+	if (fs->opts.align > 1 && unit % fs->opts.align) {
+		return -1;
+	}
+	
+	int32_t size = fs->o_list->size;
+	uint64_t* offsets = fs->o_list->offset;
+	uint32_t* lengths = fs->o_list->length;
+	uint64_t* shifts = scalloc(sizeof(*shifts) * size);
+	int64_t first = -1;
+	for (int32_t i = size - 1; i >= 0; --i) {
+		uint64_t gap_start = i > 0 ? offsets[i - 1] + lengths[i - 1] : 0;
+		uint64_t start = (gap_start + unit - 1) / unit * unit;
+		uint64_t end = offsets[i] / unit * unit;
+		if (end <= start || end - start < REPACK_COLLAPSE_MIN) {
+			continue;
+		}
+		
+		if (fallocate(fs->file_fd, FALLOC_FL_COLLAPSE_RANGE, start,
+				end - start)) {
+			break;
+		}
+		if (ftruncate(fs->file_fd, fs->file_data_len)) {
+			int32_t restored = !fallocate(fs->file_fd, FALLOC_FL_INSERT_RANGE,
+					start, end - start);
+			assert(restored && "failed to restore file_data length");
+			UNUSED(restored);
+			break;
+		}
+		shifts[i] = end - start;
+		first = start;
+	}
+	
+	if (first < 0) {
+		free(shifts);
+		return -1;
+	}
+	fs->storage->invalidate(first, fs->file_data_len - first, fs);
+	
+	// Each file moves by the total length removed before it
+	uint64_t shift = 0;
+	for (int32_t i = 0; i < size; ++i) {
+		shift += shifts[i];
+		if (shift > 0) {
+			update_file_offset(offsets[i] - shift, fs->o_list->list[i]);
+			update_dir_offset(fs->o_list->list[i], fs);
+			arr_update(i, fs->o_list);
+		}
+	}
+	
+	free(shifts);
+	return first;
 }
 
 /*
  * Helper for repacking files, independent of the filesystem lock state
  * The order of files is maintained during repack
  *
+ * The final offset of each file is computed first (the total length of the
+ * files before it, where lengths in the offset array include space reserved
+ * for appends and padding to opts.align). Data is then moved in phases:
+ * every destination byte before the first source byte which has not been
+ * moved can be written without overwriting data still to be moved, so each
+ * phase copies these bytes in parallel. Phases grow with the free space
+ * passed, so phases smaller than REPACK_MIN_LEN instead move the rest of one
+ * file with memmove. Files already at their final offset are skipped. File
+ * offsets are updated once all data is moved.
+ *
+ * When opts.collapse_repack is set, large aligned gaps are first removed
+ * without copying (see repack_collapse), so data is only copied to close the
+ * unaligned edges of gaps.
+ *
+ * With a journal, gaps are not collapsed (which cannot be journalled), and
+ * files are instead moved in batches by journal_move_files once their data
+ * is journalled.
+ *
+ * Destination bytes are final once written, so each block is hashed as soon
+ * as its last byte is written, while it is still in cache. Leaves whose hash
+ * is unchanged (such as blocks which held the same bytes before) are not
+ * flagged, and parent levels are hashed once at the end, skipping nodes with
+ * no changed children. Assuming the hash tree was up to date, it is up to
+ * date when this returns.
+ *
  * returns: offset of first byte modified if repack occurred, else -1
  */
 int64_t repack_helper(filesys_t* fs) {
@@ -467,122 +1590,331 @@ int64_t repack_helper(filesys_t* fs) {
 		return -1;
 	}
 	
-	// Variable for tracking blocks to hash
-	int64_t hash_offset = -1;
-
-
-	// Ensure first file at offset 0
-	uint64_t start_curr_file = o_list[0]->offset;
-	uint64_t end_prev_file = 0;
-	int is_zero_size = o_list[0]->length == 0;
-	if (start_curr_file > 0) {
-		repack_move(o_list[0], 0, fs);
-
-		if (!is_zero_size) {
-			hash_offset = 0;
+	// Remove large aligned gaps, which moves all data after the first gap
+	// removed (including unused space)
+	int64_t collapsed = fs->opts.collapse_repack && fs->journal_fd < 0 ?
+			repack_collapse(fs) : -1;
+	
+	// Compute final layout using the dense offset and length arrays
+	uint64_t* offsets = fs->o_list->offset;
+	uint32_t* lengths = fs->o_list->length;
+	uint64_t* targets = salloc(sizeof(*targets) * size);
+	uint64_t total = 0;
+	int32_t first = -1;
+	for (int32_t i = 0; i < size; ++i) {
+		targets[i] = total;
+		total += lengths[i];
+		if (offsets[i] != targets[i]) {
+			first = first < 0 ? i : first;
+			fs->metrics.repack_bytes += o_list[i]->length;
 		}
 	}
 	
-	// Iterate over sorted offset array and move data when necessary
-	for (int32_t i = 1; i < size; ++i) {
-		start_curr_file = o_list[i]->offset;
-		end_prev_file = o_list[i - 1]->offset + o_list[i - 1]->length;
-		is_zero_size = o_list[i]->length == 0;
-
-		// Break if newly created zero size files encountered
-		if (start_curr_file >= MAX_FILE_DATA_LEN) {
-			break;
+	// Return if files are already packed
+	if (first < 0 && collapsed < 0) {
+		free(targets);
+		return -1;
+	}
+	
+	int64_t hash_offset = first < 0 ? collapsed : (int64_t)targets[first];
+	if (collapsed >= 0 && collapsed < hash_offset) {
+		hash_offset = collapsed;
+	}
+	
+	if (fs->journal_fd >= 0) {
+		journal_move_files(o_list + first, targets + first, size - first, fs);
+		free(targets);
+		return hash_offset;
+	}
+	
+	// Blocks are rehashed up to the end of the files (or of file_data if gaps
+	// were removed), and only changed hashes are propagated, so every hash
+	// in the range must be current
+	int32_t last = ((collapsed >= 0 ? fs->file_data_len : total) - 1) /
+			BLOCK_LEN;
+	hash_expand(hash_offset / BLOCK_LEN, last, 1, fs);
+	
+	// Move data in phases, where file i has had moved bytes moved so far, and
+	// blocks before block hashed are hashed
+	uint8_t* changed = scalloc(fs->hash_data_len / HASH_LEN);
+	int32_t i = first < 0 ? size : first;
+	uint64_t moved = 0;
+	uint64_t dest = first < 0 ? total : targets[first];
+	int32_t hashed = hash_offset / BLOCK_LEN;
+	while (i < size) {
+		// Skip files already at their final offset
+		if (moved == 0 && offsets[i] == targets[i]) {
+			dest += lengths[i];
+			++i;
+			continue;
 		}
-
-		if (start_curr_file > end_prev_file) {
-			repack_move(o_list[i], end_prev_file, fs);
+		
+		uint64_t src = offsets[i] + moved;
+		uint64_t end = src < total ? src : total;
+		
+		if (end - dest < REPACK_MIN_LEN) {
+			// Move the rest of the file in order, hashing completed blocks
+			fs->storage->move(dest, src, lengths[i] - moved, fs);
+			dest += lengths[i] - moved;
+			moved = 0;
+			++i;
+			
+			hash_task_t hash_task = {fs, fs->leaf_offset + hashed,
+					fs->leaf_offset + dest / BLOCK_LEN, changed};
+			hash_worker(&hash_task);
+			hashed = dest / BLOCK_LEN;
+		} else {
+			// Hash blocks completed before this phase
+			if (hashed < dest / BLOCK_LEN) {
+				hash_task_t hash_task = {fs, fs->leaf_offset + hashed,
+						fs->leaf_offset + dest / BLOCK_LEN, changed};
+				hash_worker(&hash_task);
+			}
 			
-			if (hash_offset < 0 && !is_zero_size) {
-				hash_offset = o_list[i]->offset;
+			// Copy every byte before the first byte still to be moved
+			repack_range(targets, i, dest, end, changed, fs);
+			dest = end;
+			hashed = dest / BLOCK_LEN;
+			while (i < size && targets[i] + lengths[i] <= dest) {
+				++i;
 			}
+			moved = i < size ? dest - targets[i] : 0;
 		}
 	}
 	
+	// Hash remaining blocks (up to the end of file_data if gaps were removed),
+	// then parents of changed leaves
+	if (hashed <= last) {
+		hash_task_t hash_task = {fs, fs->leaf_offset + hashed,
+				fs->leaf_offset + last + 1, changed};
+		hash_worker(&hash_task);
+	}
+	dirty_add(&fs->dirty_file, hash_offset,
+			(last + 1) * BLOCK_LEN - hash_offset);
+	dirty_add(&fs->dirty_hash,
+			(fs->leaf_offset + hash_offset / BLOCK_LEN) * HASH_LEN,
+			(last - hash_offset / BLOCK_LEN + 1) * HASH_LEN);
+	if (fs->leaf_offset > 0) {
+		hash_levels(p_index(fs->leaf_offset + hash_offset / BLOCK_LEN),
+				p_index(fs->leaf_offset + last), changed, fs);
+	}
+	free(changed);
+	
+	// Update offsets of moved files
+	for (int32_t i = first < 0 ? size : first; i < size; ++i) {
+		update_file_offset(targets[i], o_list[i]);
+		update_dir_offset(o_list[i], fs);
+		arr_update(i, fs->o_list);
+	}
+	
+	free(targets);
 	return hash_offset;
 }
 
-void repack(void * helper) {
-    filesys_t* fs = (filesys_t*)helper;
-	LOCK(&fs->lock);
+// Orders files by increasing activity since the last repack
+static int cmp_file_heat(const void* a, const void* b) {
+	file_t* fa = *(file_t**)a;
+	file_t* fb = *(file_t**)b;
+	if (fa->grows != fb->grows) {
+		return (fa->grows > fb->grows) - (fa->grows < fb->grows);
+	}
+	return (fa->writes > fb->writes) - (fa->writes < fb->writes);
+}
+
+/*
+ * Helper for repacking files with hot files placed after all other files,
+ * independent of the filesystem lock state
+ * Hot files (see file_hot) are first moved to the free space after the last
+ * file, up to HOT_MOVE_LEN bytes and as many as fit, with the most active
+ * last. Their data and hashes are synchronised before dir_table refers to
+ * them (as in compact_move), so each hot file is held at its old or new
+ * offset on disk if the filesystem stops before repack completes. The files
+ * are then repacked in order with repack_helper, leaving the hot files after
+ * the others, so files which are likely to grow are followed by free space
+ * and growing them does not move other files. Activity counts are halved
+ * afterwards, so placement follows recent activity.
+ */
+void repack_hot(filesys_t* fs) {
+	int32_t size = fs->o_list->size;
+	uint64_t start = size > 0 ?
+			fs->o_list->offset[size - 1] + fs->o_list->length[size - 1] : 0;
+	start = align_len(start, fs);
+	file_t** hot = salloc(sizeof(*hot) * (size + 1));
+	int32_t n_hot = 0;
+	uint64_t hot_len = 0;
+	for (int32_t i = 0; i < size; ++i) {
+		file_t* f = fs->o_list->list[i];
+		uint64_t len = align_len(f->length, fs);
+		if (file_hot(f) && hot_len + len <= HOT_MOVE_LEN &&
+			start + hot_len + len <= (uint64_t)fs->file_data_len) {
+			hot[n_hot++] = f;
+			hot_len += len;
+		}
+	}
 	
-	int64_t hash_offset = repack_helper(fs);
+	// Move hot files to the free space after the last file
+	uint64_t end = start;
+	qsort(hot, n_hot, sizeof(*hot), cmp_file_heat);
+	for (int32_t i = 0; i < n_hot; ++i) {
+		fs->storage->move(end, hot[i]->offset, hot[i]->length, fs);
+		fs->metrics.repack_bytes += hot[i]->length;
+		end += align_len(hot[i]->length, fs);
+	}
+	dirty_add(&fs->dirty_file, start, end - start);
+	compute_hash_block_range(start, end - start, fs);
+	storage_sync(&fs->dirty_file, MS_SYNC, fs);
+	dirty_sync(&fs->dirty_hash, fs->hash, MS_SYNC);
+	
+	end = start;
+	for (int32_t i = 0; i < n_hot; ++i) {
+		arr_remove(hot[i]->o_index, fs->o_list);
+		update_file_offset(end, hot[i]);
+		arr_sorted_insert(hot[i], fs->o_list);
+		update_dir_offset(hot[i], fs);
+		end += align_len(hot[i]->length, fs);
+	}
+	dirty_sync(&fs->dirty_dir, fs->dir, MS_SYNC);
 	
-	// Hash blocks modified during repack
-	if (hash_offset >= 0) {
-		compute_hash_block_range(hash_offset, fs->used - hash_offset, fs);
+	repack_helper(fs);
+	
+	for (int32_t i = 0; i < fs->n_list->size; ++i) {
+		fs->n_list->list[i]->writes /= 2;
+		fs->n_list->list[i]->grows /= 2;
+	}
+	
+	free(hot);
+}
+
+void repack(void * helper) {
+    filesys_t* fs = (filesys_t*)helper;
+	LOCK_FS(fs);
+	struct timespec start;
+	struct timespec end;
+	clock_gettime(CLOCK_MONOTONIC, &start);
+	
+	// Space reserved for appends is reclaimed by repacking, and blocks
+	// modified during repack are hashed by repack_helper (hot files are not
+	// moved to the end with a journal, as their moves are not journalled)
+	release_reserves(fs);
+	if (fs->opts.hot_placement && fs->journal_fd < 0) {
+		repack_hot(fs);
+	} else {
+		repack_helper(fs);
 	}
 	
-	msync(fs->file, fs->file_data_len, MS_ASYNC);
-	msync(fs->dir, fs->dir_table_len, MS_ASYNC);
-	msync(fs->hash, fs->hash_data_len, MS_ASYNC);
+	clock_gettime(CLOCK_MONOTONIC, &end);
+	++fs->metrics.repacks;
+	fs->metrics.repack_ns += (end.tv_sec - start.tv_sec) * 1000000000L +
+			end.tv_nsec - start.tv_nsec;
 	
-	UNLOCK(&fs->lock);
+	uint64_t ticket = commit_op(fs);
+	UNLOCK_FS(fs);
+	commit_wait(ticket, fs);
 }
 
 int delete_file(char * filename, void * helper) {
     filesys_t* fs = (filesys_t*)helper;	
-	LOCK(&fs->lock);
+	LOCK_FS(fs);
 		
 	// Return 1 if file does not exist
-	file_t temp;
+	FILE_KEY(temp);
 	update_file_name(filename, &temp);
 	file_t* f = arr_get_by_key(&temp, fs->n_list);
 	if (f == NULL) {
-		UNLOCK(&fs->lock);
+		UNLOCK_FS(fs);
 		return 1;
 	}
 	
 	fs->used -= f->length;
+	fs->padding -= align_len(f->length, fs) - f->length;
+	fs->reserved -= f->reserve;
 	fs->index[f->index] = 0;
 	--fs->index_count;
 
-	// Remove from arrays using indices
-	arr_remove(f->o_index, fs->o_list);
-	arr_remove(f->n_index, fs->n_list);
-	
 	// Write null byte in dir_table name field
 	write_null_byte(fs->dir, f->index * META_LEN, 1);
+	dirty_add(&fs->dirty_dir, f->index * META_LEN, 1);
+
+	// Remove from arrays using indices, releasing the file's pages
+	if (f->o_index >= 0) {
+		int32_t index = f->o_index;
+		uint64_t end = f->offset + fs->o_list->length[index];
+		arr_remove(index, fs->o_list);
+		fs->journal_freed = 1;
+		punch_freed(f->offset, end, index, fs);
+	}
+	arr_remove(f->n_index, fs->n_list);
 	
 	free_file(f);
+	compact_wake(fs);
+	
+	uint64_t ticket = commit_op(fs);
+	UNLOCK_FS(fs);
+	commit_wait(ticket, fs);
+	return 0;
+}
+
+/*
+ * Releases the space reserved after a file for appends, called once a file is
+ * no longer being written (space is otherwise only reclaimed by repack or
+ * when it is required by another file)
+ *
+ * returns: 0 on success, 1 if file does not exist
+ */
+int trim_file(char * filename, void * helper) {
+    filesys_t* fs = (filesys_t*)helper;
+	LOCK_FS(fs);
+	
+	// Return 1 if file does not exist
+	FILE_KEY(temp);
+	update_file_name(filename, &temp);
+	file_t* f = arr_get_by_key(&temp, fs->n_list);
+	if (f == NULL) {
+		UNLOCK_FS(fs);
+		return 1;
+	}
 	
-	msync(fs->dir, fs->dir_table_len, MS_ASYNC);
+	if (f->reserve > 0) {
+		fs->reserved -= f->reserve;
+		f->reserve = 0;
+		arr_update(f->o_index, fs->o_list);
+		compact_wake(fs);
+	}
 	
-	UNLOCK(&fs->lock);
+	UNLOCK_FS(fs);
 	return 0;
 }
 
 int rename_file(char * oldname, char * newname, void * helper) {
     filesys_t* fs = (filesys_t*)helper;
-	LOCK(&fs->lock);
+	LOCK_FS(fs);
 	
-	file_t temp;
+	FILE_KEY(temp);
 	update_file_name(oldname, &temp);
 	file_t* f = arr_get_by_key(&temp, fs->n_list);
 
 	// Return 0 if names are the same and oldname file exists
-	if (f != NULL && strcmp(oldname, newname) == 0) {
-		UNLOCK(&fs->lock);
+	update_file_name(newname, &temp);
+	if (f != NULL && name_cmp(f->name, temp.name) == 0) {
+		UNLOCK_FS(fs);
 		return 0;
 	}
 
 	// Return 1 if oldname file does not exist or newname file already exists
-	update_file_name(newname, &temp);
 	if (f == NULL || arr_get_by_key(&temp, fs->n_list) != NULL) {
-		UNLOCK(&fs->lock);
+		UNLOCK_FS(fs);
 		return 1;
 	}
 	
+	// Re-insert into the name list to maintain ordering and name prefixes
+	arr_remove(f->n_index, fs->n_list);
 	update_file_name(newname, f);
+	arr_sorted_insert(f, fs->n_list);
 	update_dir_name(f, fs);
 	
-	msync(fs->dir, fs->dir_table_len, MS_ASYNC);
-	
-	UNLOCK(&fs->lock);
+	uint64_t ticket = commit_op(fs);
+	UNLOCK_FS(fs);
+	commit_wait(ticket, fs);
 	return 0;
 }
 
@@ -591,112 +1923,147 @@ int read_file(char * filename, size_t offset, size_t count, void * buf, void * h
 
 	// Filesystem mutex locked in read_file to ensure integrity of buffer
 	// during parallel reads to the same buffer
-	LOCK(&fs->lock);
+	LOCK_FS(fs);
 	
 	// Return 1 if file does not exist
-	file_t temp;
+	FILE_KEY(temp);
 	update_file_name(filename, &temp);
 	file_t* f = arr_get_by_key(&temp, fs->n_list);
 	if (f == NULL) {
-		UNLOCK(&fs->lock);
+		UNLOCK_FS(fs);
 		return 1;
 	}
 	
 	// Return 2 if invalid offset and count for given file
 	if (offset + count > f->length) {
-		UNLOCK(&fs->lock);
+		UNLOCK_FS(fs);
 		return 2;
 	}
 	
+	// Unwritten bytes are zero, so are not read from file_data or verified
+	size_t stored = offset < f->written ? f->written - offset : 0;
+	if (stored > count) {
+		stored = count;
+	}
+	
+	// Request every block verified and read before hashing the first
+	if (stored > 0) {
+		uint64_t first = (f->offset + offset) / BLOCK_LEN * BLOCK_LEN;
+		fs->storage->prefetch(first, ((f->offset + offset + stored - 1) /
+				BLOCK_LEN + 1) * BLOCK_LEN - first, fs);
+	}
+
 	// Return 3 if invalid hashes
-	if (verify_hash_range(f->offset + offset, count, fs) != 0) {
-		UNLOCK(&fs->lock);
+	if (verify_hash_range(f->offset + offset, stored, fs) != 0) {
+		UNLOCK_FS(fs);
 		return 3;
 	}
 	
 	// Return 0 if no bytes to read
 	if (count == 0) {
-		UNLOCK(&fs->lock);
+		UNLOCK_FS(fs);
 		return 0;
 	}
 	
-	memcpy(buf, fs->file + f->offset + offset, count);
+	fs->storage->read(f->offset + offset, stored, buf, fs);
+	memset((uint8_t*)buf + stored, 0, count - stored);
 	
-	UNLOCK(&fs->lock);
+	UNLOCK_FS(fs);
 	return 0;
 }
 
 int write_file(char * filename, size_t offset, size_t count, void * buf, void * helper) {
     filesys_t* fs = (filesys_t*)helper;
-	LOCK(&fs->lock);
+	LOCK_FS(fs);
 	
 	// Return 1 if file does not exist
-	file_t temp;
+	FILE_KEY(temp);
 	update_file_name(filename, &temp);
 	file_t* f = arr_get_by_key(&temp, fs->n_list);
 	if (f == NULL) {
-		UNLOCK(&fs->lock);
+		UNLOCK_FS(fs);
 		return 1;
 	}
 	
 	// Return 2 if offset is invalid
 	if (offset > f->length) {
-		UNLOCK(&fs->lock);
+		UNLOCK_FS(fs);
 		return 2;
 	}
 	
 	// Return 3 if insufficient space in file_data
-	if (fs->used + offset + count - f->length > fs->file_data_len) {
-		UNLOCK(&fs->lock);
+	if (fs->used + fs->padding + align_len(offset + count, fs) -
+			align_len(f->length, fs) > fs->file_data_len) {
+		UNLOCK_FS(fs);
 		return 3;
 	}
 	
 	// Return 0 if no bytes to write
 	if (count == 0) {
-		UNLOCK(&fs->lock);
+		UNLOCK_FS(fs);
 		return 0;
 	}
 	
+	// Track activity for placement
+	++f->writes;
+	f->grows += offset + count > f->length;
+	
 	// Resize if write exceeds bounds of file
-	int32_t hash_offset = -1;
+	// Return 4 if compaction exceeds the budget, or 3 if the file cannot
+	// move with a journal
+	int64_t hash_offset = -1;
+	uint64_t kept = offset;
 	if (offset + count > f->length) {
 		hash_offset = resize_file_helper(f, offset + count, offset, fs);
+		if (hash_offset == OVER_BUDGET || hash_offset == NO_SPACE) {
+			UNLOCK_FS(fs);
+			return hash_offset == OVER_BUDGET ? 4 : 3;
+		}
+		
+		// Only written bytes before the offset are copied when the file moves
+		if (hash_offset >= 0 && f->written < offset) {
+			kept = f->written;
+		}
 	}
 	
-	memcpy(fs->file + f->offset + offset, buf, count);
+	fs->storage->write(f->offset + offset, count, buf, fs);
+	dirty_add(&fs->dirty_file, f->offset + offset, count);
+	zero_range(f->offset + kept, f->offset + offset, fs);
+	if (offset + count > f->written) {
+		f->written = offset + count;
+	}
 	
 	if (hash_offset >= 0) {
-		// Hash from first repacked byte to end of used file_data
-		compute_hash_block_range(hash_offset, fs->used - hash_offset, fs);
-	} else {
-		// Only hash the bytes modified
-		compute_hash_block_range(f->offset + offset, count, fs);
+		// Hash from first moved byte to the end of the data kept
+		compute_hash_block_range(hash_offset,
+				f->offset + kept - hash_offset, fs);
 	}
 	
-	msync(fs->file, fs->file_data_len, MS_ASYNC);
-	msync(fs->dir, fs->dir_table_len, MS_ASYNC);
-	msync(fs->hash, fs->hash_data_len, MS_ASYNC);
+	// Hash the bytes modified
+	compute_hash_block_range(f->offset + offset, count, fs);
 	
-	UNLOCK(&fs->lock);
+	uint64_t ticket = commit_op(fs);
+	UNLOCK_FS(fs);
+	commit_wait(ticket, fs);
 	return 0;
 }
 
 ssize_t file_size(char * filename, void * helper) {
     filesys_t* fs = (filesys_t*)helper;
-	LOCK(&fs->lock);
+	LOCK_FS(fs);
 	
 	// Return -1 if file does not exist
-	file_t temp;
+	FILE_KEY(temp);
 	update_file_name(filename, &temp);
 	file_t* f = arr_get_by_key(&temp, fs->n_list);
 	if (f == NULL) {
-		UNLOCK(&fs->lock);
+		UNLOCK_FS(fs);
 		return -1;
 	}
 	
 	// Return length of file
 	ssize_t length = f->length;
-	UNLOCK(&fs->lock);
+	UNLOCK_FS(fs);
 	return length;
 }
 
@@ -755,14 +2122,44 @@ void hash_node(int32_t n_index, uint8_t* hash_cat, uint8_t* out, filesys_t* fs)
 		
 	// Otherwise, calculate hash of file_data block for leaf node
 	} else {
-		fletcher(fs->file + (n_index - fs->leaf_offset) * BLOCK_LEN,
-				BLOCK_LEN, out);
+		fs->storage->hash((uint64_t)(n_index - fs->leaf_offset) * BLOCK_LEN,
+				BLOCK_LEN, out, fs);
+	}
+}
+
+/*
+ * Marks the files overlapping a range of file_data as written, as hashes are
+ * only recomputed from file_data by compute_hash_tree and compute_hash_block
+ * after the range is modified outside of write_file
+ *
+ * offset: offset of first byte of range
+ * length: number of bytes in range
+ */
+static void mark_written(int64_t offset, int64_t length, filesys_t* fs) {
+	// Find the first file ending after offset (extents are in offset order)
+	arr_t* o_list = fs->o_list;
+	int32_t lo = 0;
+	int32_t hi = o_list->size;
+	while (lo < hi) {
+		int32_t mid = lo + (hi - lo) / 2;
+		if (o_list->offset[mid] + o_list->length[mid] <= (uint64_t)offset) {
+			lo = mid + 1;
+		} else {
+			hi = mid;
+		}
+	}
+	
+	for (int32_t i = lo; i < o_list->size &&
+			o_list->offset[i] < (uint64_t)(offset + length); ++i) {
+		o_list->list[i]->written = o_list->list[i]->length;
 	}
 }
 
 void compute_hash_tree(void * helper) {
 	filesys_t* fs = (filesys_t*)helper;
-	LOCK(&fs->lock);
+	LOCK_FS(fs);
+	mark_written(0, fs->file_data_len, fs);
+	fs->storage->invalidate(0, fs->file_data_len, fs);
 	
 	// Variables for bottom-to-top level traversal of hash tree
 	uint8_t* hash_addr = fs->hash;
@@ -785,9 +2182,10 @@ void compute_hash_tree(void * helper) {
 		}
 	}
 
-	msync(fs->hash, fs->hash_data_len, MS_ASYNC);
-
-	UNLOCK(&fs->lock);
+	dirty_add(&fs->dirty_hash, 0, fs->hash_data_len);
+	uint64_t ticket = commit_op(fs);
+	UNLOCK_FS(fs);
+	commit_wait(ticket, fs);
 }
 
 /*
@@ -799,10 +2197,12 @@ void compute_hash_tree(void * helper) {
 void compute_hash_block_helper(size_t block_offset, filesys_t* fs) {
 	// Calculate the index of the leaf node for the block
 	int32_t n_index = fs->leaf_offset + block_offset;
+	hash_expand(block_offset, block_offset, 0, fs);
 	
 	// Update the leaf node hash
-	fletcher(fs->file + block_offset * BLOCK_LEN, BLOCK_LEN,
-			fs->hash + n_index * HASH_LEN);
+	fs->storage->hash(block_offset * BLOCK_LEN, BLOCK_LEN,
+			fs->hash + n_index * HASH_LEN, fs);
+	dirty_add(&fs->dirty_hash, n_index * HASH_LEN, HASH_LEN);
 	
 	// Update parent node hashes all the way to the root node
 	uint8_t hash_cat[2 * HASH_LEN];
@@ -812,11 +2212,16 @@ void compute_hash_block_helper(size_t block_offset, filesys_t* fs) {
 				HASH_LEN);
 		
 		fletcher(hash_cat, 2 * HASH_LEN, fs->hash + n_index * HASH_LEN);
+		dirty_add(&fs->dirty_hash, n_index * HASH_LEN, HASH_LEN);
 	}
 }
 
 /*
  * Update hashes for file_data blocks in the range specified
+ * Nodes are hashed one level at a time, from the leaves to the root, so each
+ * modified node is hashed once (assumes a complete hash tree, as in
+ * compute_hash_tree). Levels with enough nodes are split across up to
+ * n_processors threads.
  *
  * offset: file_data offset of first byte modified
  * length: number of adjacent bytes modified
@@ -829,29 +2234,30 @@ void compute_hash_block_range(int64_t offset, int64_t length, filesys_t* fs) {
 
 	assert(fs != NULL && "invalid args");
 	
-	// Determine first and last block modified
-	int64_t first_block = offset / BLOCK_LEN;
-	int64_t last_block = (offset + length - 1) / BLOCK_LEN;
-	
-	// Update hash tree for each block modified
-	for (int64_t i = first_block; i <= last_block; ++i) {
-		compute_hash_block_helper(i, fs);
-	}
+	// Hash leaf nodes of first to last block modified, then their parents
+	// (once no zero subtree root partly overlaps the blocks)
+	hash_expand(offset / BLOCK_LEN, (offset + length - 1) / BLOCK_LEN, 0, fs);
+	hash_levels(fs->leaf_offset + offset / BLOCK_LEN,
+			fs->leaf_offset + (offset + length - 1) / BLOCK_LEN, NULL, fs);
 }
 
 void compute_hash_block(size_t block_offset, void * helper) {
 	filesys_t* fs = (filesys_t*)helper;
-	LOCK(&fs->lock);
+	LOCK_FS(fs);
+	mark_written(block_offset * BLOCK_LEN, BLOCK_LEN, fs);
+	fs->storage->invalidate(block_offset * BLOCK_LEN, BLOCK_LEN, fs);
 	
 	compute_hash_block_helper(block_offset, fs);
 	
-	msync(fs->hash, fs->hash_data_len, MS_ASYNC);
-	
-	UNLOCK(&fs->lock);
+	uint64_t ticket = commit_op(fs);
+	UNLOCK_FS(fs);
+	commit_wait(ticket, fs);
 }
 
 /*
  * Compare hashes for blocks in the range specified
+ * A block below the root of a zero subtree must be zero, and is verified from
+ * the root (the hashes stored below it are not used).
  *
  * offset: offset in file_data to start verification
  * length: number of bytes to verify
@@ -878,7 +2284,23 @@ int32_t verify_hash_range(int64_t offset, int64_t length, filesys_t* fs) {
 		// Get leaf node index for block
 		n_index = fs->leaf_offset + i;
 		
-		// Compare hashes from leaf to root
+		// Find the highest zero subtree root above the block
+		int32_t zero_root = -1;
+		for (int32_t n = n_index, h = 0; n >= 0; n = p_index(n), ++h) {
+			if (node_zero(n, h, fs)) {
+				zero_root = n;
+			}
+		}
+		if (zero_root >= 0) {
+			fs->storage->hash((uint64_t)i * BLOCK_LEN, BLOCK_LEN, curr_hash,
+					fs);
+			if (memcmp(curr_hash, fs->zero_hashes, HASH_LEN) != 0) {
+				return 1;
+			}
+			n_index = p_index(zero_root);
+		}
+		
+		// Compare hashes from leaf (or zero subtree root) to root
 		while (n_index >= 0) {
 			hash_node(n_index, hash_cat, curr_hash, fs);
 
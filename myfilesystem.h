@@ -10,9 +10,17 @@
  * Helper Methods
  */
 
+int32_t scan_dir(file_t** files, filesys_t* fs);
+
+void build_arrays(filesys_t* fs);
+
 int32_t new_file_index(filesys_t* fs);
 
-uint64_t new_file_offset(size_t length, int64_t* hash_offset, filesys_t* fs);
+int64_t repack_window(size_t length, int64_t* hash_offset, filesys_t* fs);
+
+int64_t new_file_offset(size_t length, int64_t* hash_offset, filesys_t* fs);
+
+void release_reserves(filesys_t* fs);
 
 int64_t resize_file_helper(file_t* file, size_t length, size_t copy, filesys_t* fs);
 
@@ -20,6 +28,8 @@ void repack_move(file_t* file, uint32_t new_offset, filesys_t* fs);
 
 int64_t repack_helper(filesys_t* fs);
 
+void repack_hot(filesys_t* fs);
+
 void hash_node(int32_t n_index, uint8_t* hash_cat, uint8_t* out, filesys_t* fs);
 
 void compute_hash_block_helper(size_t block_offset, filesys_t* fs);
@@ -34,6 +44,9 @@ int32_t verify_hash_range(int64_t offset, int64_t length, filesys_t* fs);
 
 void * init_fs(char * f1, char * f2, char * f3, int n_processors);
 
+void * init_fs_opts(char * f1, char * f2, char * f3, int n_processors,
+		fs_opts_t * opts);
+
 void close_fs(void * helper);
 
 int create_file(char * filename, size_t length, void * helper);
@@ -44,6 +57,8 @@ void repack(void * helper);
 
 int delete_file(char * filename, void * helper);
 
+int trim_file(char * filename, void * helper);
+
 int rename_file(char * oldname, char * newname, void * helper);
 
 int read_file(char * filename, size_t offset, size_t count, void * buf, void * helper);
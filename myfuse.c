@@ -8,6 +8,7 @@
 #include <unistd.h>
 #include <string.h>
 #include <stdio.h>
+#include <stdlib.h>
 #include <fuse.h>
 #include <errno.h>
 #include <assert.h>
@@ -15,13 +16,38 @@
 #include "structs.h"
 #include "helper.h"
 #include "myfilesystem.h"
+#include "metrics.h"
+#include "commit.h"
 
 // Macro for casting filesystem struct
 #define FILESYSTEM ((filesys_t*)(fuse_get_context()->private_data))
 
+// Read only virtual file containing allocator metrics (see metrics.c), which
+// hides any stored file with the same name
+#define STATS_PATH "/.stats"
+#define is_stats(path) (strcmp((path), STATS_PATH) == 0)
+
 char * file_data_file_name = NULL;
 char * directory_table_file_name = NULL;
 char * hash_data_file_name = NULL;
+fs_opts_t fs_options = {0};
+
+/*
+ * Formats the current allocator metrics of the filesystem
+ *
+ * len: address of variable storing length of text
+ *
+ * returns: dynamically allocated text
+ */
+static char* stats_text(size_t* len) {
+	fs_metrics_t metrics;
+	get_metrics(&metrics, FILESYSTEM);
+	
+	*len = format_metrics(NULL, 0, &metrics);
+	char* text = salloc(*len + 1);
+	format_metrics(text, *len + 1, &metrics);
+	return text;
+}
 
 int myfuse_getattr(const char * path, struct stat * result) {
 	assert(FILESYSTEM != NULL && "filesystem does not exist");
@@ -38,6 +64,12 @@ int myfuse_getattr(const char * path, struct stat * result) {
 
         // Mode is a directory
         result->st_mode = S_IFDIR;
+	} else if (is_stats(path)) {
+		// Size of metrics text when formatted now
+		size_t len;
+		free(stats_text(&len));
+		result->st_size = (off_t)len;
+		result->st_mode = S_IFREG;
 	} else {
         // Set size as the number of bytes used by the file
         char* name = salloc(strlen(path));
@@ -72,6 +104,7 @@ int myfuse_readdir(const char * path, void * buf,
 	    file_t** n_list = FILESYSTEM->n_list->list;
 	    int32_t size = FILESYSTEM->n_list->size;
 
+		filler(buf, STATS_PATH + 1, NULL, 0);
 		for (int i = 0; i < size; ++i) {
             filler(buf, n_list[i]->name, NULL, 0);
 		}
@@ -96,6 +129,11 @@ int myfuse_unlink(const char * path) {
 		return -EISDIR;
 	}
 
+	// Metrics file is read only
+	if (is_stats(path)) {
+		return -EACCES;
+	}
+
 	char* name = salloc(strlen(path));
 	memcpy(name, path + 1, strlen(path));
 
@@ -123,6 +161,11 @@ int myfuse_rename(const char * oldpath, const char * newpath) {
     	return -EISDIR;
     }
     
+    // Metrics file is read only
+    if (is_stats(oldpath) || is_stats(newpath)) {
+    	return -EACCES;
+    }
+    
     char* old = salloc(strlen(oldpath));
 	char* new = salloc(strlen(newpath));
 	memcpy(old, oldpath + 1, strlen(oldpath));
@@ -153,6 +196,11 @@ int myfuse_truncate(const char * path, off_t length) {
 		return -EISDIR;
 	}
 	
+	// Metrics file is read only
+	if (is_stats(path)) {
+		return -EACCES;
+	}
+	
 	char* name = salloc(strlen(path));
 	memcpy(name, path + 1, strlen(path));
 	
@@ -173,8 +221,6 @@ int myfuse_truncate(const char * path, off_t length) {
 }
 
 int myfuse_open(const char * path, struct fuse_file_info * fi) {
-	UNUSED(fi);
-
 	assert(FILESYSTEM != NULL && "filesystem does not exist");
 
 	// Check for valid path
@@ -187,6 +233,12 @@ int myfuse_open(const char * path, struct fuse_file_info * fi) {
 		return -EISDIR;
 	}
 
+	// Metrics file is formatted on each read, so its length is not cached
+	if (is_stats(path)) {
+		fi->direct_io = 1;
+		return 0;
+	}
+
 	// For successful open, file should exist in filesystem
 	// Check if file exists using file_size
 	char* name = salloc(strlen(path));
@@ -218,6 +270,19 @@ int myfuse_read(const char * path,
 		return -EISDIR;
 	}
 	
+	// Copy the requested range of the metrics text
+	if (is_stats(path)) {
+		size_t len;
+		char* text = stats_text(&len);
+		size_t read_length = 0;
+		if ((size_t)offset < len) {
+			read_length = length < len - offset ? length : len - offset;
+			memcpy(buf, text + offset, read_length);
+		}
+		free(text);
+		return read_length;
+	}
+	
 	// Get current length of file
 	char* name = salloc(strlen(path));
 	memcpy(name, path + 1, strlen(path));
@@ -271,6 +336,11 @@ int myfuse_write(const char * path,
 		return -EISDIR;
 	}
 
+	// Metrics file is read only
+	if (is_stats(path)) {
+		return -EACCES;
+	}
+
 	// Get current length of file
 	char* name = salloc(strlen(path));
 	memcpy(name, path + 1, strlen(path));
@@ -309,11 +379,47 @@ int myfuse_write(const char * path,
 }
 
 int myfuse_release(const char * path, struct fuse_file_info * fi) {
-	UNUSED(path);
 	UNUSED(fi);
 
-	// Does not alter filesystem
+	assert(FILESYSTEM != NULL && "filesystem does not exist");
+
+	// Release space reserved for appends once the file is closed
 	// No checks requires as release is only called after create or open
+	char* name = salloc(strlen(path));
+	memcpy(name, path + 1, strlen(path));
+	
+	trim_file(name, FILESYSTEM);
+	free(name);
+	
+	return 0;
+}
+
+int myfuse_fsync(const char * path, int datasync,
+		struct fuse_file_info * fi) {
+	UNUSED(path);
+	UNUSED(datasync);
+	UNUSED(fi);
+
+	assert(FILESYSTEM != NULL && "filesystem does not exist");
+
+	// Writes every completed operation, which includes those on this file
+	sync_fs(FILESYSTEM);
+	
+	return 0;
+}
+
+int myfuse_flush(const char * path, struct fuse_file_info * fi) {
+	UNUSED(path);
+	UNUSED(fi);
+
+	assert(FILESYSTEM != NULL && "filesystem does not exist");
+
+	// Closing a file only writes it to disk with DURABILITY_SYNC, as
+	// periodic durability leaves it to the flush thread (or fsync)
+	if (FILESYSTEM->opts.durability == DURABILITY_SYNC) {
+		sync_fs(FILESYSTEM);
+	}
+	
 	return 0;
 }
 
@@ -327,8 +433,8 @@ void * myfuse_init(struct fuse_conn_info * info) {
 	    return NULL;
 	}
 
-	return init_fs(file_data_file_name, directory_table_file_name,
-			hash_data_file_name, 1);
+	return init_fs_opts(file_data_file_name, directory_table_file_name,
+			hash_data_file_name, 1, &fs_options);
 }
 
 void myfuse_destroy(void * fs) {
@@ -355,6 +461,11 @@ int myfuse_create(const char * path, mode_t mode, struct fuse_file_info * fi) {
 		return -EISDIR;
 	}
 	
+	// Metrics file always exists
+	if (is_stats(path)) {
+		return -EEXIST;
+	}
+	
 	char* name = salloc(strlen(path));
 	memcpy(name, path + 1, strlen(path));
 	
@@ -384,6 +495,8 @@ struct fuse_operations operations = {
     .read = myfuse_read,
     .write = myfuse_write,
     .release = myfuse_release,
+    .fsync = myfuse_fsync,
+    .flush = myfuse_flush,
 	.init = myfuse_init,
 	.destroy = myfuse_destroy,
     .create = myfuse_create
@@ -398,6 +511,51 @@ int main(int argc, char * argv[]) {
 			argc -= 4;
 		}
 	}
+	
+	// Optional filesystem options (in any order) before the filenames
+	int32_t storage_given = 0;
+	int32_t cache_given = 0;
+	while (argc >= 3) {
+		char* option = argv[argc-2];
+		char* value = argv[argc-1];
+		if (strcmp(option, "--journal") == 0) {
+			fs_options.journal_path = value;
+		} else if (strcmp(option, "--cache") == 0) {
+			// Block cache budget in bytes
+			fs_options.cache_bytes = strtoull(value, NULL, 10);
+			cache_given = 1;
+		} else if (strcmp(option, "--storage") == 0) {
+			storage_given = 1;
+			if (strcmp(value, "pread") == 0) {
+				fs_options.storage = STORAGE_PREAD;
+			} else if (strcmp(value, "uring") == 0) {
+				fs_options.storage = STORAGE_URING;
+			} else if (strcmp(value, "mmap") == 0) {
+				fs_options.storage = STORAGE_MMAP;
+			} else {
+				fprintf(stderr, "unknown storage backend: %s\n", value);
+				return 1;
+			}
+		} else if (strcmp(option, "--durability") == 0) {
+			if (strcmp(value, "periodic") == 0) {
+				fs_options.durability = DURABILITY_PERIODIC;
+			} else if (strcmp(value, "sync") == 0) {
+				fs_options.durability = DURABILITY_SYNC;
+			} else if (strcmp(value, "none") != 0) {
+				fprintf(stderr, "unknown durability level: %s\n", value);
+				return 1;
+			}
+		} else {
+			break;
+		}
+		argc -= 2;
+	}
+
+	// A cache budget selects the pread backend unless a backend was given
+	// (options are parsed from the end, so this waits until all are seen)
+	if (cache_given && !storage_given) {
+		fs_options.storage = STORAGE_PREAD;
+	}
 
 	// file_data_file_name, directory_table_file_name and
 	// hash_data_file_name should be assigned
@@ -6,12 +6,18 @@
 #include <fcntl.h>
 #include <unistd.h>
 #include <sys/mman.h>
+#include <sys/resource.h>
+#include <signal.h>
 #include <assert.h>
 
 #include "structs.h"
 #include "helper.h"
 #include "arr.h"
 #include "myfilesystem.h"
+#include "compact.h"
+#include "metrics.h"
+#include "commit.h"
+#include "cache.h"
 
 // Macro for running test functions
 #define TEST(x) test(x, #x)
@@ -25,6 +31,8 @@
 static char* f1 = "file_data.bin";
 static char* f2 = "directory_table.bin";
 static char* f3 = "hash_data.bin";
+static char* f4 = "index_sidecar.bin";
+static char* f5 = "journal.bin";
 static int file_fd;
 static int dir_fd;
 static int hash_fd;
@@ -49,6 +57,66 @@ static int hash_fd;
  * Helper Functions
  */
 
+// Compares file_t pointers by offset for sorting
+int cmp_file_offset(const void* a, const void* b) {
+	file_t* fa = *(file_t**)a;
+	file_t* fb = *(file_t**)b;
+	return (fa->offset > fb->offset) - (fa->offset < fb->offset);
+}
+
+// Writes a repeated byte to the whole of a file
+void fill_file(char* name, uint8_t byte, filesys_t* fs) {
+	uint8_t buf[F1_LEN];
+	memset(buf, byte, sizeof(buf));
+	assert(!write_file(name, 0, file_size(name, fs), buf, fs) &&
+	       "write failed");
+}
+
+// Checks every byte of a file has the value specified (read_file also
+// verifies the hashes of blocks containing the file)
+void check_file(char* name, uint8_t byte, filesys_t* fs) {
+	uint8_t buf[F1_LEN];
+	ssize_t length = file_size(name, fs);
+	assert(!read_file(name, 0, length, buf, fs) && "read failed");
+	for (ssize_t i = 0; i < length; ++i) {
+		assert(buf[i] == byte && "file data corrupted");
+	}
+}
+
+// Checks the hash tree matches a recomputation from file_data, except for
+// hashes below the root of a zero subtree, which are not used (the root of
+// a zero subtree stores the zero hash of its height)
+int32_t hash_tree_valid(filesys_t* fs) {
+	int32_t nodes = fs->hash_data_len / HASH_LEN;
+	int32_t height = 0;
+	while ((1 << height) < fs->leaf_offset + 1) {
+		++height;
+	}
+	
+	uint8_t* hashes = salloc(fs->hash_data_len);
+	uint8_t* unused = scalloc(nodes);
+	memcpy(hashes, fs->hash, fs->hash_data_len);
+	for (int32_t i = 1, depth = 0; i < nodes; ++i) {
+		depth += (i + 1) == (1 << (depth + 1));
+		int32_t p = p_index(i);
+		unused[i] = unused[p] || memcmp(hashes + p * HASH_LEN,
+				fs->zero_hashes + (height - depth + 1) * HASH_LEN,
+				HASH_LEN) == 0;
+	}
+	
+	compute_hash_tree(fs);
+	int32_t valid = 1;
+	for (int32_t i = 0; i < nodes; ++i) {
+		if (!unused[i] && memcmp(hashes + i * HASH_LEN,
+				fs->hash + i * HASH_LEN, HASH_LEN)) {
+			valid = 0;
+		}
+	}
+	free(unused);
+	free(hashes);
+	return valid;
+}
+
 /*
  * Runs filesystem tests, prints return values and updates
  * the global error_count
@@ -109,6 +177,44 @@ int test_helper_error_handling() {
 	return 0;
 }
 
+// Tests vectorised name comparison against strncmp for zero padded names
+int test_name_cmp() {
+	char* names[6] = {
+		"a", "b", "abcdefghijklmnopq", "abcdefghijklmnopr",
+		"\xff_high_bit", "abcdefghijklmnopqrstuvwxyzabcdefghijklmnopqrstuvwxyz0"
+		"12345678901"
+	};
+
+	FILE_KEY(a);
+	FILE_KEY(b);
+	for (int i = 0; i < 6; ++i) {
+		for (int j = 0; j < 6; ++j) {
+			update_file_name(names[i], &a);
+			update_file_name(names[j], &b);
+
+			int expected = strncmp(a.name, b.name, NAME_LEN - 1);
+			int actual = name_cmp(a.name, b.name);
+			assert(((expected > 0) - (expected < 0)) ==
+			       ((actual > 0) - (actual < 0)) &&
+			       "name comparison does not match strncmp");
+		}
+	}
+
+	// Names differing after the 63rd character are equal
+	char long_a[NAME_LEN + 2];
+	char long_b[NAME_LEN + 2];
+	memset(long_a, 'x', NAME_LEN + 1);
+	memset(long_b, 'x', NAME_LEN + 1);
+	long_a[NAME_LEN + 1] = '\0';
+	long_b[NAME_LEN + 1] = '\0';
+	long_b[NAME_LEN] = 'y';
+	update_file_name(long_a, &a);
+	update_file_name(long_b, &b);
+	assert(name_cmp(a.name, b.name) == 0 && "truncated names should match");
+
+	return 0;
+}
+
 // Tests initialising and freeing arrays for memory leaks
 int test_array_empty() {
 	filesys_t* fs = salloc(sizeof(*fs));
@@ -133,12 +239,15 @@ int test_array_insert() {
 	f[3] = file_init("test1.txt", 15, 10, 1);
 
 	// Expected order in offset and name arrays
-	file_t* o_expect[4] = {f[2], f[1], f[3], f[0]};
+	// Zero size files are only stored in the name array
+	file_t* o_expect[3] = {f[2], f[1], f[3]};
 	file_t* n_expect[4] = {f[3], f[2], f[1], f[0]};
 
 	// Insert elements into arrays
 	for (int i = 0; i < 4; ++i) {
-		arr_sorted_insert(f[i], fs->o_list);
+		if (f[i]->length > 0) {
+			arr_sorted_insert(f[i], fs->o_list);
+		}
 		arr_sorted_insert(f[i], fs->n_list);
 	}
 
@@ -148,9 +257,13 @@ int test_array_insert() {
 	       "duplicate insertion should fail");
 
 	// Compare offset and name lists with expected
-	for (int i = 0; i < 4; ++i) {
+	assert(fs->o_list->size == 3 && fs->n_list->size == 4 &&
+	       f[0]->o_index == -1 && "incorrect array sizes");
+	for (int i = 0; i < 3; ++i) {
 		assert(fs->o_list->list[i] == o_expect[i] &&
 		       "offset list insertion order incorrect");
+	}
+	for (int i = 0; i < 4; ++i) {
 		assert(fs->n_list->list[i] == n_expect[i] &&
 			   "name list insertion order incorrect");
 	}
@@ -177,15 +290,21 @@ int test_array_get() {
 	f[6] = file_init("f1.txt", 15, 10, 1);
 
 	file_t key[5];
+	char key_names[5][NAME_LEN];
+	for (int i = 0; i < 5; ++i) {
+		key[i].name = key_names[i];
+	}
 	update_file_offset(5, &key[0]);
 	update_file_offset(20, &key[1]);
-	update_file_offset(MAX_FILE_DATA_LEN, &key[2]);
+	update_file_offset(F1_LEN, &key[2]);
 	update_file_name("zero1.txt", &key[3]);
 	update_file_name("nothing", &key[4]);
 
 	// Insert elements into arrays
 	for (int i = 0; i < 7; ++i) {
-		arr_sorted_insert(f[i], fs->o_list);
+		if (f[i]->length > 0) {
+			arr_sorted_insert(f[i], fs->o_list);
+		}
 		arr_sorted_insert(f[i], fs->n_list);
 	}
 
@@ -200,19 +319,21 @@ int test_array_get() {
 		   arr_get_by_key(&key[4], fs->n_list) == NULL &&
 		   "file should not be found");
 
-	// Test offset key value comparison for zero size files
-	file_t file_a;
-	file_t* file_b;
-	update_file_offset(MAX_FILE_DATA_LEN, &file_a);
-	file_b = file_init("offset.txt", new_file_offset(0, NULL, fs), 0, 7);
+	// Test offset and name key comparison
+	FILE_KEY(file_a);
+	file_t* file_b = file_init("offset.txt", 50, 10, 7);
+	update_file_offset(40, &file_a);
+	update_file_name("name.txt", &file_a);
 
-	assert(cmp_key(&file_a, file_b, fs->o_list) == -1 &&
-		   "newly created zero size file should redirect to lower indices");
+	assert(cmp_key(&file_a, file_b, fs->o_list) < 0 &&
+	       cmp_key(&file_a, file_b, fs->n_list) < 0 &&
+	       "key should be positioned before file");
 
 	update_file_offset(50, &file_a);
-	update_file_offset(50, file_b);
-	assert(cmp_key(&file_a, file_b, fs->o_list) == 1 &&
-		   "resized zero size file should redirect to higher indices");
+	update_file_name("offset.txt", &file_a);
+	assert(cmp_key(&file_a, file_b, fs->o_list) == 0 &&
+	       cmp_key(&file_a, file_b, fs->n_list) == 0 &&
+	       "keys should be equal");
 
 	free(file_b);
 	close_fs(fs);
@@ -231,18 +352,24 @@ int test_array_remove() {
 	f[4] = file_init("test1.txt", 15, 10, 1);
 
 	file_t key[5];
+	char key_names[5][NAME_LEN];
+	for (int i = 0; i < 5; ++i) {
+		key[i].name = key_names[i];
+	}
 	update_file_offset(5, &key[0]);
 	update_file_offset(20, &key[1]);
-	update_file_offset(MAX_FILE_DATA_LEN, &key[2]);
+	update_file_offset(F1_LEN, &key[2]);
 	update_file_name("zero1.txt", &key[3]);
 	update_file_name("nothing", &key[4]);
 
-	file_t* o_expect[3] = {f[3], f[4], f[1]};
+	file_t* o_expect[2] = {f[3], f[4]};
 	file_t* n_expect[3] = {f[4], f[3], f[1]};
 
 	// Insert elements into arrays
 	for (int i = 0; i < 5; ++i) {
-		arr_sorted_insert(f[i], fs->o_list);
+		if (f[i]->length > 0) {
+			arr_sorted_insert(f[i], fs->o_list);
+		}
 		arr_sorted_insert(f[i], fs->n_list);
 	}
 
@@ -251,9 +378,10 @@ int test_array_remove() {
 	file_t* zero_f = arr_remove_by_key(&key[3], fs->n_list);
 	assert(norm_f == f[0] && zero_f == f[2] && "removed incorrect files");
 
-	// Remove corresponding entry in opposing list
+	// Remove corresponding entry in opposing list (zero size files are
+	// not stored in the offset list)
 	assert(arr_remove(norm_f->n_index, fs->n_list) == norm_f &&
-		   arr_remove(zero_f->o_index, fs->o_list) == zero_f &&
+		   zero_f->o_index == -1 &&
 		   "failed to remove opposing list entry");
 
 	// Attempt to remove files with invalid keys
@@ -263,9 +391,11 @@ int test_array_remove() {
 		   "invalid keys should return NULL");
 
 	// Compare offset and name lists with expected
-	for (int i = 0; i < 3; ++i) {
+	for (int i = 0; i < 2; ++i) {
 		assert(fs->o_list->list[i] == o_expect[i] &&
 			   "incorrect offset order after removal");
+	}
+	for (int i = 0; i < 3; ++i) {
 		assert(fs->n_list->list[i] == n_expect[i] &&
 			   "incorrect name order after removal");
 	}
@@ -276,6 +406,299 @@ int test_array_remove() {
 	return 0;
 }
 
+// Tests sorting file_t pointers with different numbers of threads, including
+// uneven runs and duplicate keys
+int test_sort_files() {
+	int32_t count = 5 * SORT_MIN_RUN + 7;
+	file_t** files = salloc(sizeof(*files) * count);
+	for (int32_t i = 0; i < count; ++i) {
+		files[i] = file_init("", (i * 7919) % (count / 2), 1, i);
+	}
+
+	int32_t n_threads[4] = {1, 2, 3, 8};
+	for (int t = 0; t < 4; ++t) {
+		// Shuffle list before sorting
+		unsigned int seed = t;
+		for (int32_t i = count - 1; i > 0; --i) {
+			int32_t j = rand_r(&seed) % (i + 1);
+			file_t* temp = files[i];
+			files[i] = files[j];
+			files[j] = temp;
+		}
+
+		sort_files(files, count, cmp_file_offset, n_threads[t]);
+		for (int32_t i = 1; i < count; ++i) {
+			assert(files[i - 1]->offset <= files[i]->offset &&
+			       "list not sorted");
+		}
+	}
+
+	for (int32_t i = 0; i < count; ++i) {
+		free_file(files[i]);
+	}
+	free(files);
+	return 0;
+}
+
+// Tests the mask of used dir_table entries against checking each entry
+int test_dir_used_mask() {
+	uint8_t* dir = scalloc(32 * META_LEN);
+	unsigned int seed = 1;
+	for (int i = 0; i < 32; ++i) {
+		// Bytes after the first byte of the name should be ignored
+		dir[i * META_LEN] = (rand_r(&seed) % 2) ? 'a' + i % 26 : '\0';
+		dir[i * META_LEN + 1] = 'x';
+	}
+
+	for (int count = 0; count <= 32; ++count) {
+		uint32_t expected = 0;
+		for (int i = 0; i < count; ++i) {
+			expected |= (uint32_t)(dir[i * META_LEN] != '\0') << i;
+		}
+		assert(dir_used_mask(dir, count) == expected && "incorrect mask");
+	}
+
+	free(dir);
+	return 0;
+}
+
+// Tests dirty ranges are kept sorted, joined when overlapping or adjacent,
+// and joined with the closest range once the list is full
+int test_dirty_ranges() {
+	dirty_t dirty;
+	memset(&dirty, 0, sizeof(dirty));
+
+	// Disjoint, adjacent and overlapping ranges
+	dirty_add(&dirty, 100, 10);
+	dirty_add(&dirty, 0, 10);
+	dirty_add(&dirty, 10, 5);
+	dirty_add(&dirty, 105, 20);
+	dirty_add(&dirty, 50, 0);
+	assert(dirty.count == 2 && dirty.start[0] == 0 && dirty.end[0] == 15 &&
+	       dirty.start[1] == 100 && dirty.end[1] == 125 &&
+	       "incorrect ranges");
+
+	// Range spanning both ranges
+	dirty_add(&dirty, 12, 90);
+	assert(dirty.count == 1 && dirty.start[0] == 0 && dirty.end[0] == 125 &&
+	       "ranges not joined");
+
+	// Filling the list joins the closest ranges (the gap of 5 after 900)
+	memset(&dirty, 0, sizeof(dirty));
+	for (int64_t i = 0; i < DIRTY_RANGES; ++i) {
+		dirty_add(&dirty, i == 10 ? 915 : i * 100, 10);
+	}
+	assert(dirty.count == DIRTY_RANGES - 1 && "list not limited");
+	for (int32_t i = 0; i < dirty.count; ++i) {
+		int64_t j = i < 10 ? i : i + 1;
+		assert(dirty.start[i] == j * 100 &&
+		       dirty.end[i] == (i == 9 ? 925 : j * 100 + 10) &&
+		       "incorrect joined ranges");
+	}
+	return 0;
+}
+
+// Tests the block cache of the pread and io_uring backends against a copy of
+// file_data, replacing the least recently used block when full and reading
+// the missing blocks of a range together
+int test_block_cache() {
+	for (int uring = 0; uring < 2; ++uring) {
+		filesys_t fs;
+		memset(&fs, 0, sizeof(fs));
+		fs.file_data_len = 4 * CACHE_BLOCK_LEN + 100;
+		fs.opts.cache_bytes = 2 * CACHE_BLOCK_LEN;
+		fs.opts.storage = uring ? STORAGE_URING : STORAGE_PREAD;
+		fs.file_fd = open("cache_data.bin", O_RDWR | O_CREAT | O_TRUNC,
+				S_IRUSR | S_IWUSR);
+		assert(fs.file_fd >= 0 && !ftruncate(fs.file_fd, fs.file_data_len) &&
+		       "failed to create file");
+		fs.storage = &pread_storage;
+		fs.storage->open(&fs);
+		assert(fs.cache->n_slots == 2 && "incorrect number of slots");
+		assert((uring || fs.cache->ring == NULL) && "unexpected ring");
+
+		uint8_t* copy = scalloc(fs.file_data_len);
+		uint8_t* buf = salloc(fs.file_data_len);
+		unsigned int seed = 1;
+		for (int i = 0; i < 200; ++i) {
+			uint64_t offset = rand_r(&seed) % fs.file_data_len;
+			uint64_t length = rand_r(&seed) % (fs.file_data_len - offset + 1);
+			uint64_t other = rand_r(&seed) % (fs.file_data_len - length + 1);
+			switch (rand_r(&seed) % 5) {
+			case 0:
+				for (uint64_t j = 0; j < length; ++j) {
+					buf[j] = rand_r(&seed);
+				}
+				fs.storage->write(offset, length, buf, &fs);
+				memcpy(copy + offset, buf, length);
+				break;
+			case 1:
+				fs.storage->move(other, offset, length, &fs);
+				memmove(copy + other, copy + offset, length);
+				break;
+			case 2:
+				fs.storage->zero(offset, length, &fs);
+				memset(copy + offset, 0, length);
+				break;
+			case 3:
+				fs.storage->prefetch(offset, length, &fs);
+				break;
+			default:
+				fs.storage->invalidate(offset, length, &fs);
+			}
+			fs.storage->read(offset, length, buf, &fs);
+			assert(memcmp(buf, copy + offset, length) == 0 &&
+			       "incorrect data");
+		}
+
+		// The least recently used block is replaced
+		fs.storage->invalidate(0, fs.file_data_len, &fs);
+		uint64_t misses = fs.cache->misses;
+		fs.storage->read(0, 1, buf, &fs);
+		fs.storage->read(CACHE_BLOCK_LEN, 1, buf, &fs);
+		fs.storage->read(0, 1, buf, &fs);
+		fs.storage->read(2 * CACHE_BLOCK_LEN, 1, buf, &fs);
+		fs.storage->read(0, 1, buf, &fs);
+		assert(fs.cache->misses == misses + 3 && "block 0 replaced");
+		fs.storage->read(CACHE_BLOCK_LEN, 1, buf, &fs);
+		assert(fs.cache->misses == misses + 4 && "block 1 not replaced");
+
+		// Prefetched blocks are read together, and are held for the read
+		fs.storage->invalidate(0, fs.file_data_len, &fs);
+		uint64_t batches = fs.cache->batches;
+		fs.storage->prefetch(CACHE_BLOCK_LEN, 2 * CACHE_BLOCK_LEN, &fs);
+		assert(fs.cache->misses == misses + 6 &&
+		       fs.cache->batches == batches + (fs.cache->ring != NULL) &&
+		       "blocks not read together");
+		fs.storage->read(CACHE_BLOCK_LEN, 2 * CACHE_BLOCK_LEN, buf, &fs);
+		assert(fs.cache->misses == misses + 6 &&
+		       memcmp(buf, copy + CACHE_BLOCK_LEN, 2 * CACHE_BLOCK_LEN) == 0 &&
+		       "prefetched blocks not held");
+
+		// File contents match the copy
+		assert(pread(fs.file_fd, buf, fs.file_data_len, 0) ==
+		       fs.file_data_len && memcmp(buf, copy, fs.file_data_len) == 0 &&
+		       "incorrect file");
+
+		fs.storage->close(&fs);
+		close(fs.file_fd);
+		unlink("cache_data.bin");
+		free(copy);
+		free(buf);
+	}
+	return 0;
+}
+
+// Tests scanning dir_table with multiple threads returns every used entry
+// in order of dir_table index
+int test_scan_dir() {
+	filesys_t fs;
+	memset(&fs, 0, sizeof(fs));
+	fs.index_len = 3 * SCAN_MIN_ENTRIES + 5;
+	fs.dir = scalloc((size_t)fs.index_len * META_LEN);
+
+	// Use every third entry, including the last entry
+	int32_t expected = 0;
+	for (int32_t i = fs.index_len - 1; i >= 0; i -= 3) {
+		snprintf((char*)fs.dir + i * META_LEN, NAME_LEN, "file%d", i);
+		memcpy(fs.dir + i * META_LEN + NAME_LEN, &i, sizeof(uint32_t));
+		++expected;
+	}
+
+	file_t** files = salloc(sizeof(*files) * fs.index_len);
+	for (int n = 1; n <= 4; ++n) {
+		fs.n_processors = n;
+		int32_t count = scan_dir(files, &fs);
+		assert(count == expected && "incorrect number of files");
+		for (int32_t i = 0; i < count; ++i) {
+			assert(files[i]->index == (fs.index_len - 1) % 3 + 3 * i &&
+			       files[i]->offset == (uint64_t)files[i]->index &&
+			       strcmp(files[i]->name, (char*)fs.dir +
+			       files[i]->index * META_LEN) == 0 && "incorrect file");
+			free_file(files[i]);
+		}
+	}
+
+	free(files);
+	free(fs.dir);
+	return 0;
+}
+
+// Tests dense offset and length arrays remain consistent with the offset list
+// after insertion, removal and in place updates
+int test_array_dense_keys() {
+	gen_blank_files();
+	filesys_t* fs = init_fs(f1, f2, f3, 1);
+
+	file_t* f[4];
+	f[0] = file_init("test4.txt", 40, 10, 0);
+	f[1] = file_init("test3.txt", 70, 3, 3);
+	f[2] = file_init("test2.txt", 0, 5, 2);
+	f[3] = file_init("test1.txt", 15, 20, 1);
+
+	for (int i = 0; i < 4; ++i) {
+		arr_sorted_insert(f[i], fs->o_list);
+		arr_sorted_insert(f[i], fs->n_list);
+	}
+
+	// Remove a file from the middle of the offset list
+	arr_remove(f[3]->o_index, fs->o_list);
+
+	// Modify a file in place and refresh its dense entry
+	update_file_offset(5, f[0]);
+	update_file_length(30, f[0]);
+	arr_update(f[0]->o_index, fs->o_list);
+
+	// Compare dense arrays with file_t fields
+	assert(fs->o_list->size == 3 && "incorrect offset list size");
+	for (int i = 0; i < fs->o_list->size; ++i) {
+		file_t* curr = fs->o_list->list[i];
+		assert(fs->o_list->offset[i] == curr->offset &&
+		       fs->o_list->length[i] == curr->length &&
+		       "dense keys do not match offset list");
+	}
+
+	assert(fs->o_list->list[1] == f[0] && fs->o_list->offset[1] == 5 &&
+	       "incorrect file updated");
+
+	close_fs(fs);
+	return 0;
+}
+
+// Tests name lookups where files share prefixes longer than the inline
+// prefix stored in the name array, and renaming to a different position
+int test_array_name_prefix() {
+	gen_blank_files();
+	filesys_t* fs = init_fs(f1, f2, f3, 1);
+
+	assert(!create_file("prefix_shared_b.txt", 0, fs) &&
+	       !create_file("prefix_shared_a.txt", 0, fs) &&
+	       !create_file("prefix", 0, fs) &&
+	       !create_file("prefix_", 0, fs) &&
+	       !create_file("a", 0, fs) && "create failed");
+
+	// Files sharing the inline prefix should be ordered by full name
+	char* expected[5] = {"a", "prefix", "prefix_",
+	                     "prefix_shared_a.txt", "prefix_shared_b.txt"};
+	for (int i = 0; i < 5; ++i) {
+		assert(strcmp(fs->n_list->list[i]->name, expected[i]) == 0 &&
+		       "incorrect name order");
+		assert(file_size(expected[i], fs) == 0 && "lookup failed");
+	}
+	assert(file_size("prefix_shared", fs) == -1 &&
+	       file_size("prefix_shared_c.txt", fs) == -1 &&
+	       "file should not be found");
+
+	// Rename should move the file to its new position in the name array
+	assert(!rename_file("a", "z", fs) && "rename failed");
+	assert(strcmp(fs->n_list->list[4]->name, "z") == 0 &&
+	       file_size("z", fs) == 0 && file_size("a", fs) == -1 &&
+	       "renamed file not found");
+
+	close_fs(fs);
+	return 0;
+}
+
 // Tests initialising and closing filesystem for memory leaks
 int test_no_operation() {
 	gen_blank_files();
@@ -305,20 +728,216 @@ int test_init_close_error_handling() {
 			NAME_LEN + OFFSET_LEN);
 
 	// Retrieve file from internal filesystem structure
-	file_t key;
+	FILE_KEY(key);
 	update_file_name(name, &key);
 	file_t* internal_file = arr_get_by_key(&key, fs->n_list);
 
 	// Casting used to compare only the first 4 bytes of uint64_t offset
+	// Zero size files are not stored in the offset array
 	assert((uint32_t)(dir_table_file.offset) == 0 &&
 	       dir_table_file.length == 0 &&
-		   internal_file->offset == MAX_FILE_DATA_LEN &&
-		   internal_file->length == 0 && "failed to read zero size file");
+		   internal_file->length == 0 && internal_file->o_index == -1 &&
+		   fs->o_list->size == 0 && "failed to read zero size file");
+
+	close_fs(fs);
+	return 0;
+}
+
+// Tests building sorted arrays from an unsorted dir_table, where a name
+// appears in more than one entry
+int test_init_bulk_build() {
+	gen_blank_files();
+
+	char* names[5] = {"c.txt", "a.txt", "e.txt", "a.txt", "b.txt"};
+	uint32_t offsets[5] = {300, 100, 0, 500, 0};
+	uint32_t lengths[5] = {50, 20, 0, 30, 10};
+	for (int i = 0; i < 5; ++i) {
+		pwrite(dir_fd, names[i], strlen(names[i]), i * META_LEN);
+		pwrite(dir_fd, &offsets[i], sizeof(uint32_t), i * META_LEN + NAME_LEN);
+		pwrite(dir_fd, &lengths[i], sizeof(uint32_t),
+				i * META_LEN + NAME_LEN + OFFSET_LEN);
+	}
+	fsync(dir_fd);
+
+	filesys_t* fs = init_fs(f1, f2, f3, 4);
+
+	// Duplicate name at a higher dir_table index is discarded
+	char* expected_names[4] = {"a.txt", "b.txt", "c.txt", "e.txt"};
+	assert(fs->n_list->size == 4 && fs->index_count == 4 &&
+	       fs->index[3] == 0 && fs->used == 80 && "incorrect file count");
+	for (int i = 0; i < 4; ++i) {
+		file_t* f = fs->n_list->list[i];
+		assert(strcmp(f->name, expected_names[i]) == 0 && f->n_index == i &&
+		       fs->index[f->index] == 1 && "incorrect name order");
+	}
+	assert(file_size("a.txt", fs) == 20 && "incorrect duplicate kept");
+
+	// Zero size files are not stored in the offset array
+	uint64_t expected_offsets[3] = {0, 100, 300};
+	assert(fs->o_list->size == 3 && "incorrect offset array size");
+	for (int i = 0; i < 3; ++i) {
+		assert(fs->o_list->list[i]->offset == expected_offsets[i] &&
+		       fs->o_list->offset[i] == expected_offsets[i] &&
+		       fs->o_list->list[i]->o_index == i &&
+		       "incorrect offset order");
+	}
 
 	close_fs(fs);
 	return 0;
 }
 
+// Tests adopting the index sidecar written by close_fs, and falling back to
+// scanning dir_table when the sidecar is corrupted
+int test_init_sidecar() {
+	gen_blank_files();
+	unlink(f4);
+
+	fs_opts_t opts = {0};
+	opts.index_path = f4;
+	filesys_t* fs = init_fs_opts(f1, f2, f3, 1, &opts);
+	assert(!create_file("c.txt", 20, fs) && !create_file("a.txt", 0, fs) &&
+	       !create_file("b.txt", 10, fs) && "create failed");
+
+	// Ensure sidecar is written in a later timestamp tick than dir_table
+	usleep(20000);
+	close_fs(fs);
+	assert(access(f4, F_OK) == 0 && "sidecar not written");
+
+	// Add an entry to dir_table without changing its modification time, so
+	// the entry is only visible if dir_table is scanned
+	struct stat dir_stat;
+	fstat(dir_fd, &dir_stat);
+	pwrite(dir_fd, "hidden.txt", 10, 3 * META_LEN);
+	fsync(dir_fd);
+	struct timespec times[2] = {dir_stat.st_atim, dir_stat.st_mtim};
+	futimens(dir_fd, times);
+
+	fs = init_fs_opts(f1, f2, f3, 1, &opts);
+	assert(access(f4, F_OK) != 0 && "sidecar not removed after init");
+	assert(file_size("hidden.txt", fs) == -1 && "sidecar not adopted");
+	assert(fs->n_list->size == 3 && fs->o_list->size == 2 &&
+	       fs->index_count == 3 && fs->used == 30 && fs->index[3] == 0 &&
+	       "incorrect arrays adopted");
+	char* expected[3] = {"a.txt", "b.txt", "c.txt"};
+	for (int i = 0; i < 3; ++i) {
+		assert(strcmp(fs->n_list->list[i]->name, expected[i]) == 0 &&
+		       fs->n_list->list[i]->n_index == i && "incorrect name order");
+	}
+	assert(fs->o_list->list[0]->offset == 0 &&
+	       fs->o_list->list[1]->offset == 20 &&
+	       fs->o_list->length[1] == 10 && "incorrect offset order");
+	close_fs(fs);
+
+	// Corrupt the sidecar data (slot array)
+	int fd = open(f4, O_RDWR);
+	assert(fd >= 0 && "sidecar not written");
+	uint8_t slot = 1;
+	pwrite(fd, &slot, sizeof(slot), sizeof(sidecar_hdr_t) + 4);
+	close(fd);
+
+	fs = init_fs_opts(f1, f2, f3, 1, &opts);
+	assert(file_size("hidden.txt", fs) == 0 && fs->n_list->size == 4 &&
+	       "dir_table not scanned");
+	close_fs(fs);
+
+	unlink(f4);
+	return 0;
+}
+
+// Tests filesystem with file names referencing dir_table directly
+int test_init_mapped_names() {
+	gen_blank_files();
+
+	// Existing entries, the first with stale bytes after the null terminator
+	char entry[NAME_LEN] = "abc\0stale";
+	char padded[NAME_LEN] = "xyz";
+	uint32_t offset = BLOCK_LEN;
+	uint32_t length = 5;
+	pwrite(dir_fd, entry, NAME_LEN, 0);
+	pwrite(dir_fd, &length, sizeof(uint32_t), NAME_LEN + OFFSET_LEN);
+	pwrite(dir_fd, padded, NAME_LEN, META_LEN);
+	pwrite(dir_fd, &offset, sizeof(uint32_t), META_LEN + NAME_LEN);
+	pwrite(dir_fd, &length, sizeof(uint32_t), META_LEN + NAME_LEN + OFFSET_LEN);
+	fsync(dir_fd);
+
+	fs_opts_t opts = {0};
+	opts.mapped_names = 1;
+	filesys_t* fs = init_fs_opts(f1, f2, f3, 1, &opts);
+
+	// Padded name should reference dir_table, the other should be a padded
+	// copy, leaving the entry unmodified
+	file_t* f = fs->n_list->list[0];
+	assert(f->name != (char*)fs->dir && file_size("abc", fs) == 5 &&
+	       memcmp(fs->dir, entry, NAME_LEN) == 0 && "unpadded name mapped");
+	for (int i = 4; i < NAME_LEN; ++i) {
+		assert(f->name[i] == '\0' && "name not zero padded");
+	}
+	assert(fs->n_list->list[1]->name == (char*)fs->dir + META_LEN &&
+	       file_size("xyz", fs) == 5 && "padded name not mapped");
+
+	assert(!create_file("new.txt", 10, fs) &&
+	       !rename_file("new.txt", "renamed.txt", fs) &&
+	       !create_file("deleted.txt", 0, fs) &&
+	       !delete_file("deleted.txt", fs) && "operations failed");
+	assert(strcmp((char*)fs->dir + 2 * META_LEN, "renamed.txt") == 0 &&
+	       "rename not written to dir_table");
+
+	close_fs(fs);
+
+	// Re-initialise without the option and check names
+	fs = init_fs(f1, f2, f3, 1);
+	assert(file_size("abc", fs) == 5 && file_size("xyz", fs) == 5 &&
+	       file_size("renamed.txt", fs) == 10 &&
+	       file_size("new.txt", fs) == -1 && file_size("deleted.txt", fs) == -1 &&
+	       "incorrect files after re-initialising");
+
+	close_fs(fs);
+	return 0;
+}
+
+// Tests the pread and io_uring backends leave file_data, dir_table and
+// hash_data identical to the mmap backend after the same operations,
+// including relocation and repacking
+int test_init_pread_storage() {
+	uint8_t images[3][F1_LEN + F2_LEN + F3_LEN];
+	char* write_buff = "content_to_write";
+	char buff[16];
+	STORAGE backends[3] = {STORAGE_MMAP, STORAGE_PREAD, STORAGE_URING};
+	for (int storage = 0; storage < 3; ++storage) {
+		gen_blank_files();
+		fs_opts_t opts = {0};
+		opts.storage = backends[storage];
+		filesys_t* fs = init_fs_opts(f1, f2, f3, 1, &opts);
+
+		assert(!create_file("a.txt", 100, fs) &&
+		       !create_file("b.txt", 300, fs) &&
+		       !create_file("c.txt", 50, fs) && "create failed");
+		fill_file("b.txt", 'b', fs);
+		assert(!write_file("a.txt", 90, 16, write_buff, fs) &&
+		       !write_file("c.txt", 0, 16, write_buff, fs) &&
+		       !resize_file("a.txt", 400, fs) &&
+		       !delete_file("b.txt", fs) && "operations failed");
+		repack(fs);
+		assert(!write_file("c.txt", 50, 16, write_buff, fs) &&
+		       !rename_file("c.txt", "d.txt", fs) && "operations failed");
+
+		assert(!read_file("a.txt", 90, 16, buff, fs) &&
+		       memcmp(buff, write_buff, 16) == 0 &&
+		       !read_file("d.txt", 50, 16, buff, fs) &&
+		       memcmp(buff, write_buff, 16) == 0 && "incorrect data");
+		close_fs(fs);
+
+		pread(file_fd, images[storage], F1_LEN, 0);
+		pread(dir_fd, images[storage] + F1_LEN, F2_LEN, 0);
+		pread(hash_fd, images[storage] + F1_LEN + F2_LEN, F3_LEN, 0);
+	}
+	assert(memcmp(images[0], images[1], sizeof(images[0])) == 0 &&
+	       memcmp(images[0], images[2], sizeof(images[0])) == 0 &&
+	       "backends differ");
+
+	return 0;
+}
+
 // Tests create_file with repacking
 int test_create_file_success() {
 	gen_blank_files();
@@ -355,6 +974,189 @@ int test_create_file_success() {
 	return 0;
 }
 
+// Tests create_file only moves the files required to open a gap, and
+// create_file, resize_file and write_file return 4 (rather than the codes
+// for insufficient space) when the bytes moved would exceed the repack budget
+int test_create_file_repack_window() {
+	gen_blank_files();
+	fs_opts_t opts = {0};
+	opts.repack_budget = 50;
+	filesys_t* fs = init_fs_opts(f1, f2, f3, 1, &opts);
+
+	// Layout: a (0-300), b (300-310), gap, d (400-500), gap, f (600-1000)
+	assert(!create_file("a.txt", 300, fs) && !create_file("b.txt", 10, fs) &&
+	       !create_file("c.txt", 90, fs) && !create_file("d.txt", 100, fs) &&
+	       !create_file("e.txt", 100, fs) && !create_file("f.txt", 400, fs) &&
+	       !delete_file("c.txt", fs) && !delete_file("e.txt", fs) &&
+	       "create failed");
+	uint8_t buf[150];
+	memset(buf, 'd', sizeof(buf));
+	assert(!write_file("d.txt", 0, 100, buf, fs) && "write failed");
+
+	// Opening a 150 byte gap requires moving d.txt (100 bytes)
+	assert(create_file("g.txt", 150, fs) == 4 &&
+	       resize_file("b.txt", 160, fs) == 4 &&
+	       write_file("b.txt", 10, 150, buf, fs) == 4 &&
+	       "budget not enforced");
+	assert(file_size("g.txt", fs) == -1 && file_size("b.txt", fs) == 10 &&
+	       fs->used == 810 && "failed operation modified files");
+
+	// Without a budget only d.txt is moved
+	fs->opts.repack_budget = 0;
+	assert(!create_file("g.txt", 150, fs) && "create with repack failed");
+
+	char* names[5] = {"a.txt", "b.txt", "d.txt", "g.txt", "f.txt"};
+	uint64_t offsets[5] = {0, 300, 310, 410, 600};
+	for (int i = 0; i < 5; ++i) {
+		FILE_KEY(key);
+		update_file_name(names[i], &key);
+		file_t* f = arr_get_by_key(&key, fs->n_list);
+		assert(f->offset == offsets[i] && f->o_index == i &&
+		       verify_hash_range(f->offset, f->length, fs) == 0 &&
+		       "incorrect file offset or hash");
+	}
+
+	uint8_t read_buf[100];
+	assert(!read_file("d.txt", 0, sizeof(read_buf), read_buf, fs) &&
+	       memcmp(buf, read_buf, sizeof(read_buf)) == 0 &&
+	       "moved data corrupted");
+
+	close_fs(fs);
+	return 0;
+}
+
+// Tests files start at multiples of BLOCK_LEN with the align option, and the
+// bytes lost to alignment are counted against free space
+int test_create_file_aligned() {
+	gen_blank_files();
+	fs_opts_t opts = {0};
+	opts.align = BLOCK_LEN;
+	filesys_t* fs = init_fs_opts(f1, f2, f3, 1, &opts);
+
+	// Layout: a (0-10), b (256-556), c (768-868)
+	assert(!create_file("a.txt", 10, fs) && !create_file("b.txt", 300, fs) &&
+	       !create_file("c.txt", 100, fs) && "create failed");
+	assert(fs->used == 410 && fs->padding == 614 &&
+	       create_file("d.txt", 1, fs) == 2 && "incorrect alignment padding");
+
+	// Removing b.txt frees 512 bytes, so d.txt fits with two blocks
+	fill_file("c.txt", 'c', fs);
+	assert(!delete_file("b.txt", fs) && fs->padding == 402 &&
+	       !create_file("d.txt", 257, fs) &&
+	       resize_file("d.txt", 513, fs) == 2 && "incorrect free space");
+	fill_file("d.txt", 'd', fs);
+	assert(!delete_file("a.txt", fs) && "delete failed");
+
+	repack(fs);
+
+	// Every file starts on a block boundary, so no block holds two files
+	for (int32_t i = 0; i < fs->o_list->size; ++i) {
+		assert(fs->o_list->list[i]->offset % BLOCK_LEN == 0 &&
+		       "file offset not aligned");
+	}
+	assert(fs->o_list->list[0]->offset == 0 &&
+	       fs->o_list->list[1]->offset == 512 && "files not packed");
+	check_file("c.txt", 'c', fs);
+	check_file("d.txt", 'd', fs);
+	close_fs(fs);
+
+	// The option is disabled for files written without alignment
+	fs = init_fs(f1, f2, f3, 1);
+	assert(!create_file("e.txt", 10, fs) && "create failed");
+	close_fs(fs);
+	fs = init_fs_opts(f1, f2, f3, 1, &opts);
+	fs_metrics_t m;
+	get_metrics(&m, fs);
+	char text[1024];
+	format_metrics(text, sizeof(text), &m);
+	assert(fs->opts.align == 0 && fs->padding == 0 && m.align_disabled == 1 &&
+	       strstr(text, "align_disabled 1\n") != NULL &&
+	       "unaligned files accepted");
+
+	close_fs(fs);
+	return 0;
+}
+
+// Tests new files and growth are unwritten ranges which read as zero, are
+// left unallocated in file_data and only write the hashes covering them, and
+// are verified as zero once loaded from dir_table
+int test_create_file_unwritten() {
+	char* names[3] = {"sparse_file_data.bin", "sparse_directory_table.bin",
+	                  "sparse_hash_data.bin"};
+	int64_t lengths[3] = {4096 * BLOCK_LEN, 32 * META_LEN,
+	                      (2 * 4096 - 1) * HASH_LEN};
+	for (int i = 0; i < 3; ++i) {
+		int fd = open(names[i], O_RDWR | O_CREAT | O_TRUNC, S_IRUSR | S_IWUSR);
+		assert(fd >= 0 && !ftruncate(fd, lengths[i]) && "failed to create");
+		close(fd);
+	}
+	fs_opts_t opts = {0};
+	filesys_t* fs = init_fs_opts(names[0], names[1], names[2], 1, &opts);
+	compute_hash_tree(fs);
+
+	// Stale bytes in free space are not visible in a new file
+	memset(fs->file, 'x', lengths[0]);
+	compute_hash_tree(fs);
+	struct stat before;
+	assert(!fstat(fs->file_fd, &before) && "stat failed");
+
+	// Only the partial pages at the edges of the file are written
+	int64_t file_len = 262144;
+	assert(!create_file("a", 100, fs) && !create_file("b", file_len, fs) &&
+	       "create failed");
+	struct stat after;
+	assert(!fstat(fs->file_fd, &after) &&
+	       after.st_blocks * 512 <= before.st_blocks * 512 - file_len + 8192 &&
+	       "new file allocated");
+
+	// The leaves of the file's blocks are left as they were (below roots of
+	// zero subtrees), apart from nodes at the edges of the file
+	uint8_t stale[HASH_LEN];
+	uint8_t* leaves = fs->hash + fs->leaf_offset * HASH_LEN;
+	memcpy(stale, leaves + 2 * HASH_LEN, HASH_LEN);
+	int32_t written = 0;
+	for (int64_t i = 1; i < (100 + file_len) / BLOCK_LEN; ++i) {
+		written += memcmp(leaves + i * HASH_LEN, stale, HASH_LEN) != 0;
+	}
+	assert(written <= 24 && "leaves of new file written");
+
+	uint8_t* buf = salloc(file_len + 1000);
+	assert(!read_file("b", 0, file_len, buf, fs) && "read failed");
+	for (int64_t i = 0; i < file_len; ++i) {
+		assert(buf[i] == 0 && "unwritten byte not zero");
+	}
+
+	// Written data is kept when the file grows and moves, and the unwritten
+	// bytes before it remain zero
+	assert(!write_file("b", 1000, 5, "hello", fs) &&
+	       !create_file("c", 100, fs) &&
+	       !resize_file("b", file_len + 1000, fs) && "write failed");
+	assert(strcmp(fs->o_list->list[2]->name, "b") == 0 && "file not moved");
+	assert(!read_file("b", 0, file_len + 1000, buf, fs) && "read failed");
+	for (int64_t i = 0; i < file_len + 1000; ++i) {
+		assert(buf[i] == (i >= 1000 && i < 1005 ? "hello"[i - 1000] : 0) &&
+		       "incorrect data after move");
+	}
+
+	// Files loaded from dir_table are fully written, so their zero blocks are
+	// verified against the roots of zero subtrees
+	close_fs(fs);
+	fs = init_fs_opts(names[0], names[1], names[2], 1, &opts);
+	assert(!read_file("b", 0, file_len + 1000, buf, fs) && buf[1000] == 'h' &&
+	       "zero blocks not verified");
+
+	// The hash tree matches a recomputation from file_data
+	assert(hash_tree_valid(fs) &&
+	       "incorrect hash tree for unwritten ranges");
+
+	free(buf);
+	close_fs(fs);
+	for (int i = 0; i < 3; ++i) {
+		unlink(names[i]);
+	}
+	return 0;
+}
+
 // Attempts to create a duplicate file with the same name, and tests
 // reading in existing files within init_fs
 int test_create_file_exists() {
@@ -431,11 +1233,14 @@ int test_resize_file_success() {
 	// Resize to same size
 	assert(!resize_file("test1.txt", 50, fs) && "resize to same size failed");
 
-	// Resize with repack
+	// Resize without space after the file (test1.txt moves to the end of
+	// file_data with 100 bytes reserved after it for appends, and test2.txt
+	// moves after the reserved space, as the gap at offset 0 is too small for
+	// test2.txt and its reserved space)
 	assert(!resize_file("test1.txt", 100, fs) &&
 		   !resize_file("test2.txt", 100, fs) && "resize repack failed");
 
-	// Resize to zero size file with offset != 0
+	// Resize to zero size file
 	assert(!resize_file("test2.txt", 0, fs) &&
 	       "resize to zero size non-zero offset failed");
 
@@ -464,7 +1269,7 @@ int test_resize_file_success() {
 	// Compare dir_table values with expected
 	// Casting used to compare only the first 4 bytes of uint64_t offset
 	assert((uint32_t)f[0].offset == 0 && f[0].length == 0 &&
-		   (uint32_t)f[1].offset == 100 && f[1].length == 0 &&
+		   (uint32_t)f[1].offset == 300 && f[1].length == 0 &&
 		   (uint32_t)f[2].offset == 0 && f[2].length == F1_LEN &&
 		   "incorrect dir_table values");
 
@@ -481,6 +1286,83 @@ int test_resize_file_success() {
 	return 0;
 }
 
+// Tests growing a file without space after it moves only that file to a
+// free extent
+int test_resize_file_relocate() {
+	gen_blank_files();
+	filesys_t* fs = init_fs(f1, f2, f3, 1);
+
+	// Layout: a (0-100), b (100-200), gap (200-300), d (300-900),
+	// gap (900-1024)
+	assert(!create_file("a.txt", 100, fs) && !create_file("b.txt", 100, fs) &&
+	       !create_file("c.txt", 100, fs) && !create_file("d.txt", 600, fs) &&
+	       !delete_file("c.txt", fs) && "create failed");
+	fill_file("a.txt", 'a', fs);
+	fill_file("b.txt", 'b', fs);
+	fill_file("d.txt", 'd', fs);
+
+	// a.txt only fits in the gap at the end of file_data
+	assert(!resize_file("a.txt", 120, fs) && "resize failed");
+
+	file_t** o_list = fs->o_list->list;
+	assert(fs->o_list->size == 3 &&
+	       strcmp(o_list[0]->name, "b.txt") == 0 && o_list[0]->offset == 100 &&
+	       strcmp(o_list[1]->name, "d.txt") == 0 && o_list[1]->offset == 300 &&
+	       strcmp(o_list[2]->name, "a.txt") == 0 && o_list[2]->offset == 900 &&
+	       "other files moved");
+
+	uint8_t buf[120];
+	assert(!read_file("a.txt", 0, 120, buf, fs) && "read failed");
+	for (int i = 0; i < 120; ++i) {
+		assert(buf[i] == (i < 100 ? 'a' : 0) && "file data corrupted");
+	}
+	check_file("b.txt", 'b', fs);
+	check_file("d.txt", 'd', fs);
+
+	close_fs(fs);
+	return 0;
+}
+
+// Tests an unwritten file moved by resize_file does not expose the data of a
+// deleted file at its new offset, before or after its watermark advances
+int test_resize_file_unwritten_relocate() {
+	gen_blank_files();
+	filesys_t* fs = init_fs(f1, f2, f3, 1);
+
+	// Layout: a (0-100), b (100-200), freed c (200-500) holding 0xAA
+	assert(!create_file("a.txt", 100, fs) && !create_file("b.txt", 100, fs) &&
+	       !create_file("c.txt", 300, fs) && "create failed");
+	fill_file("c.txt", 0xAA, fs);
+	assert(!delete_file("c.txt", fs) && "delete failed");
+
+	// a.txt (never written) moves to the freed space
+	assert(!resize_file("a.txt", 150, fs) &&
+	       !write_file("a.txt", 149, 1, "z", fs) && "resize failed");
+	assert(fs->o_list->list[1]->offset >= 200 && "file not moved");
+
+	uint8_t buf[150];
+	assert(!read_file("a.txt", 0, 150, buf, fs) && "read failed");
+	for (int i = 0; i < 150; ++i) {
+		assert(buf[i] == (i == 149 ? 'z' : 0) && "deleted data exposed");
+	}
+
+	// The hash tree matches a recomputation from file_data
+	assert(hash_tree_valid(fs) &&
+	       "incorrect hash tree after move");
+
+	// Unwritten bytes are zero after remounting, which treats every byte as
+	// written
+	close_fs(fs);
+	fs = init_fs(f1, f2, f3, 1);
+	assert(!read_file("a.txt", 0, 150, buf, fs) && "read failed");
+	for (int i = 0; i < 150; ++i) {
+		assert(buf[i] == (i == 149 ? 'z' : 0) && "deleted data exposed");
+	}
+
+	close_fs(fs);
+	return 0;
+}
+
 // Attempts to resize files that do not exist
 int test_resize_file_does_not_exist() {
 	gen_blank_files();
@@ -529,21 +1411,944 @@ int test_repack_success() {
 
 	repack(fs);
 
-	// Check internal file offset
+	// Check internal file offset (zero size files are not in offset list)
 	file_t** o_list = fs->o_list->list;
-	assert(fs->o_list->size == 3 && "incorrect number of files");
+	assert(fs->o_list->size == 2 && fs->n_list->size == 3 &&
+	       "incorrect number of files");
 
 	assert(
 		strcmp(o_list[0]->name, "test2.txt") == 0 && o_list[0]->offset == 0 &&
 		strcmp(o_list[1]->name, "test4.txt") == 0 && o_list[1]->offset == 10 &&
-		strcmp(o_list[2]->name, "zero1.txt") == 0 &&
-		o_list[2]->offset == MAX_FILE_DATA_LEN && "incorrect file offsets"
+		"incorrect file offsets"
 	);
 
 	close_fs(fs);
 	return 0;
 }
 
+// Tests repacking with large gaps, where data is copied by multiple threads,
+// and small gaps, where files are moved in order
+int test_repack_parallel() {
+	// Larger filesystem with 4096 blocks
+	char* names[3] = {"repack_file_data.bin", "repack_directory_table.bin",
+	                  "repack_hash_data.bin"};
+	int64_t lengths[3] = {4096 * BLOCK_LEN, 32 * META_LEN,
+	                      (2 * 4096 - 1) * HASH_LEN};
+	for (int i = 0; i < 3; ++i) {
+		int fd = open(names[i], O_RDWR | O_CREAT | O_TRUNC, S_IRUSR | S_IWUSR);
+		assert(fd >= 0 && !ftruncate(fd, lengths[i]) && "failed to create");
+		close(fd);
+	}
+	filesys_t* fs = init_fs(names[0], names[1], names[2], 4);
+
+	// 16 files of 65536 bytes, with gaps of 131072, 65536 and 536 bytes
+	int64_t file_len = lengths[0] / 16;
+	uint8_t* buf = salloc(file_len);
+	char name[NAME_LEN];
+	for (int i = 0; i < 16; ++i) {
+		snprintf(name, NAME_LEN, "file%02d", i);
+		assert(!create_file(name, file_len, fs) && "create failed");
+		memset(buf, 'A' + i, file_len);
+		assert(!write_file(name, 0, file_len, buf, fs) && "write failed");
+	}
+	assert(!delete_file("file01", fs) && !delete_file("file02", fs) &&
+	       !delete_file("file05", fs) && !resize_file("file07", 65000, fs) &&
+	       "failed to create gaps");
+
+	repack(fs);
+
+	// Check files are contiguous and data is intact
+	uint64_t expected_offset = 0;
+	for (int32_t i = 0; i < fs->o_list->size; ++i) {
+		file_t* f = fs->o_list->list[i];
+		assert(f->offset == expected_offset && "file not packed");
+		expected_offset += f->length;
+
+		int byte = 'A' + atoi(f->name + 4);
+		assert(!read_file(f->name, 0, f->length, buf, fs) && "read failed");
+		for (uint32_t j = 0; j < f->length; ++j) {
+			assert(buf[j] == byte && "file data corrupted");
+		}
+	}
+
+	// Compare hash tree with a complete recomputation
+	assert(hash_tree_valid(fs) &&
+	       "incorrect hash tree after repack");
+
+	free(buf);
+	close_fs(fs);
+	for (int i = 0; i < 3; ++i) {
+		unlink(names[i]);
+	}
+	return 0;
+}
+
+// Tests repacking with gaps removed from file_data without copying, where
+// unaligned gaps are still copied (falls back to copying if unsupported)
+int test_repack_collapse() {
+	char* names[3] = {"collapse_file_data.bin", "collapse_directory_table.bin",
+	                  "collapse_hash_data.bin"};
+	int64_t lengths[3] = {4096 * BLOCK_LEN, 32 * META_LEN,
+	                      (2 * 4096 - 1) * HASH_LEN};
+	for (int i = 0; i < 3; ++i) {
+		int fd = open(names[i], O_RDWR | O_CREAT | O_TRUNC, S_IRUSR | S_IWUSR);
+		assert(fd >= 0 && !ftruncate(fd, lengths[i]) && "failed to create");
+		close(fd);
+	}
+	fs_opts_t opts = {0};
+	opts.collapse_repack = 1;
+	filesys_t* fs = init_fs_opts(names[0], names[1], names[2], 1, &opts);
+
+	// 16 files of 65536 bytes, with aligned gaps of 131072 and 65536 bytes,
+	// and unaligned gaps of 536 and 5536 bytes
+	int64_t file_len = lengths[0] / 16;
+	uint8_t* buf = salloc(file_len);
+	char name[NAME_LEN];
+	for (int i = 0; i < 16; ++i) {
+		snprintf(name, NAME_LEN, "file%02d", i);
+		assert(!create_file(name, file_len, fs) && "create failed");
+		memset(buf, 'A' + i, file_len);
+		assert(!write_file(name, 0, file_len, buf, fs) && "write failed");
+	}
+	assert(!delete_file("file01", fs) && !delete_file("file02", fs) &&
+	       !delete_file("file05", fs) && !resize_file("file07", 65000, fs) &&
+	       !resize_file("file09", 60000, fs) && "failed to create gaps");
+
+	repack(fs);
+
+	// Check files are contiguous, data is intact and length is unchanged
+	uint64_t expected_offset = 0;
+	for (int32_t i = 0; i < fs->o_list->size; ++i) {
+		file_t* f = fs->o_list->list[i];
+		assert(f->offset == expected_offset && "file not packed");
+		expected_offset += f->length;
+
+		int byte = 'A' + atoi(f->name + 4);
+		assert(!read_file(f->name, 0, f->length, buf, fs) && "read failed");
+		for (uint32_t j = 0; j < f->length; ++j) {
+			assert(buf[j] == byte && "file data corrupted");
+		}
+	}
+	struct stat stats;
+	assert(!stat(names[0], &stats) && stats.st_size == lengths[0] &&
+	       "file_data length changed");
+
+	// Compare hash tree with a complete recomputation
+	assert(hash_tree_valid(fs) &&
+	       "incorrect hash tree after repack");
+
+	free(buf);
+	close_fs(fs);
+	for (int i = 0; i < 3; ++i) {
+		unlink(names[i]);
+	}
+	return 0;
+}
+
+// Tests repacking falls back to copying a collapsed gap when the length of
+// file_data cannot be restored (writes past the gap are prevented with a file
+// size limit)
+int test_repack_collapse_restore() {
+	char* names[3] = {"collapse_file_data.bin", "collapse_directory_table.bin",
+	                  "collapse_hash_data.bin"};
+	int64_t lengths[3] = {1024 * BLOCK_LEN, 32 * META_LEN,
+	                      (2 * 1024 - 1) * HASH_LEN};
+	for (int i = 0; i < 3; ++i) {
+		int fd = open(names[i], O_RDWR | O_CREAT | O_TRUNC, S_IRUSR | S_IWUSR);
+		assert(fd >= 0 && !ftruncate(fd, lengths[i]) && "failed to create");
+		close(fd);
+	}
+	fs_opts_t opts = {0};
+	opts.collapse_repack = 1;
+	filesys_t* fs = init_fs_opts(names[0], names[1], names[2], 1, &opts);
+
+	// Files of 65536 bytes, with an aligned gap of 65536 bytes
+	int64_t file_len = lengths[0] / 4;
+	uint8_t* buf = salloc(file_len);
+	char name[NAME_LEN];
+	for (int i = 0; i < 4; ++i) {
+		snprintf(name, NAME_LEN, "file%02d", i);
+		assert(!create_file(name, file_len, fs) && "create failed");
+		memset(buf, 'A' + i, file_len);
+		assert(!write_file(name, 0, file_len, buf, fs) && "write failed");
+	}
+	assert(!delete_file("file01", fs) && "failed to create gap");
+
+	struct rlimit limit;
+	assert(!getrlimit(RLIMIT_FSIZE, &limit) && "failed to get limit");
+	struct rlimit restricted = {lengths[0] - file_len, limit.rlim_max};
+	signal(SIGXFSZ, SIG_IGN);
+	assert(!setrlimit(RLIMIT_FSIZE, &restricted) && "failed to set limit");
+	repack(fs);
+	assert(!setrlimit(RLIMIT_FSIZE, &limit) && "failed to restore limit");
+	signal(SIGXFSZ, SIG_DFL);
+
+	// Check files are contiguous, data is intact and length is unchanged
+	for (int32_t i = 0; i < fs->o_list->size; ++i) {
+		file_t* f = fs->o_list->list[i];
+		assert(f->offset == (uint64_t)i * file_len && "file not packed");
+
+		int byte = 'A' + atoi(f->name + 4);
+		assert(!read_file(f->name, 0, f->length, buf, fs) && "read failed");
+		for (uint32_t j = 0; j < f->length; ++j) {
+			assert(buf[j] == byte && "file data corrupted");
+		}
+	}
+	struct stat stats;
+	assert(!stat(names[0], &stats) && stats.st_size == lengths[0] &&
+	       "file_data length changed");
+	assert(hash_tree_valid(fs) && "incorrect hash tree after repack");
+
+	free(buf);
+	close_fs(fs);
+	for (int i = 0; i < 3; ++i) {
+		unlink(names[i]);
+	}
+	return 0;
+}
+
+// Tests repack places frequently written and growing files after other files
+// with the hot_placement option
+int test_repack_hot_placement() {
+	gen_blank_files();
+	fs_opts_t opts = {0};
+	opts.hot_placement = 1;
+	filesys_t* fs = init_fs_opts(f1, f2, f3, 1, &opts);
+
+	// Layout: gap (0-100), b (100-200), c (200-300), d (300-400)
+	assert(!create_file("a.txt", 100, fs) && !create_file("b.txt", 100, fs) &&
+	       !create_file("c.txt", 100, fs) && !create_file("d.txt", 100, fs) &&
+	       !delete_file("a.txt", fs) && "create failed");
+	for (int i = 0; i < HOT_WRITES; ++i) {
+		fill_file("b.txt", 'b', fs);
+	}
+	fill_file("c.txt", 'c', fs);
+	fill_file("d.txt", 'd', fs);
+
+	repack(fs);
+
+	char* names[3] = {"c.txt", "d.txt", "b.txt"};
+	for (int i = 0; i < 3; ++i) {
+		file_t* f = fs->o_list->list[i];
+		assert(strcmp(f->name, names[i]) == 0 && f->offset == i * 100 &&
+		       "incorrect placement");
+		check_file(names[i], names[i][0], fs);
+	}
+
+	// Activity is halved by repack
+	assert(fs->o_list->list[2]->writes == HOT_WRITES / 2 &&
+	       !file_hot(fs->o_list->list[2]) && "activity not decayed");
+	assert(hash_tree_valid(fs) && "incorrect hash tree after repack");
+
+	close_fs(fs);
+	return 0;
+}
+
+// Tests hot files are left in order when they do not fit in the free space
+// after the last file, through which they are moved
+int test_repack_hot_no_space() {
+	gen_blank_files();
+	fs_opts_t opts = {0};
+	opts.hot_placement = 1;
+	filesys_t* fs = init_fs_opts(f1, f2, f3, 1, &opts);
+
+	// Layout: gap (0-100), b (100-400), c (400-700), d (700-1000)
+	assert(!create_file("a.txt", 100, fs) && !create_file("b.txt", 300, fs) &&
+	       !create_file("c.txt", 300, fs) && !create_file("d.txt", 300, fs) &&
+	       !delete_file("a.txt", fs) && "create failed");
+	for (int i = 0; i < HOT_WRITES; ++i) {
+		fill_file("b.txt", 'b', fs);
+	}
+	fill_file("c.txt", 'c', fs);
+	fill_file("d.txt", 'd', fs);
+
+	repack(fs);
+
+	char* names[3] = {"b.txt", "c.txt", "d.txt"};
+	for (int i = 0; i < 3; ++i) {
+		file_t* f = fs->o_list->list[i];
+		assert(strcmp(f->name, names[i]) == 0 && f->offset == i * 300 &&
+		       "incorrect placement");
+		check_file(names[i], names[i][0], fs);
+	}
+	assert(hash_tree_valid(fs) && "incorrect hash tree after repack");
+
+	close_fs(fs);
+	return 0;
+}
+
+// Tests repack leaves the hashes of blocks holding the same bytes as before
+// unchanged, and the hash tree matches a complete recomputation
+int test_repack_unchanged_blocks() {
+	gen_blank_files();
+	filesys_t* fs = init_fs(f1, f2, f3, 1);
+
+	// Layout: a (block 0), gap holding deleted copy of c (block 1), c (block 2)
+	assert(!create_file("a.txt", BLOCK_LEN, fs) &&
+	       !create_file("b.txt", BLOCK_LEN, fs) &&
+	       !create_file("c.txt", BLOCK_LEN, fs) && "create failed");
+	fill_file("a.txt", 'x', fs);
+	fill_file("b.txt", 'x', fs);
+	fill_file("c.txt", 'x', fs);
+	assert(!delete_file("b.txt", fs) && "delete failed");
+
+	uint8_t leaves[3 * HASH_LEN];
+	memcpy(leaves, fs->hash + fs->leaf_offset * HASH_LEN, sizeof(leaves));
+
+	repack(fs);
+
+	assert(strcmp(fs->o_list->list[1]->name, "c.txt") == 0 &&
+	       fs->o_list->list[1]->offset == BLOCK_LEN && "file not packed");
+	check_file("c.txt", 'x', fs);
+	assert(memcmp(leaves, fs->hash + fs->leaf_offset * HASH_LEN,
+	              sizeof(leaves)) == 0 && "unchanged blocks rehashed");
+
+	// Compare hash tree with a complete recomputation
+	assert(hash_tree_valid(fs) &&
+	       "incorrect hash tree after repack");
+
+	close_fs(fs);
+	return 0;
+}
+
+// Tests repack rehashes blocks moved below the root of a zero subtree whose
+// unused leaves hold the hashes of the bytes moved there
+int test_repack_zero_subtree() {
+	gen_blank_files();
+	filesys_t* fs = init_fs(f1, f2, f3, 1);
+
+	assert(!create_file("a.txt", BLOCK_LEN, fs) &&
+	       !create_file("b.txt", BLOCK_LEN, fs) &&
+	       !create_file("c.txt", 2 * BLOCK_LEN, fs) && "create failed");
+	fill_file("a.txt", 'x', fs);
+	fill_file("b.txt", 'x', fs);
+	fill_file("c.txt", 'x', fs);
+
+	// The first two blocks become a zero subtree, leaving their leaves
+	assert(!delete_file("a.txt", fs) && !delete_file("b.txt", fs) &&
+	       !create_file("d.txt", 2 * BLOCK_LEN, fs) &&
+	       !delete_file("d.txt", fs) && "create or delete failed");
+
+	repack(fs);
+	assert(fs->o_list->list[0]->offset == 0 && "file not packed");
+	check_file("c.txt", 'x', fs);
+	assert(hash_tree_valid(fs) && "incorrect hash tree after repack");
+
+	close_fs(fs);
+	return 0;
+}
+
+// Tests compaction steps fill gaps with the file after each gap, or the
+// last file which fits in the gap
+int test_compact_step() {
+	gen_blank_files();
+	filesys_t* fs = init_fs(f1, f2, f3, 1);
+
+	// Layout: a (0-100), gap (100-400), c (400-450), d (450-550),
+	// e (550-600)
+	assert(!create_file("a.txt", 100, fs) && !create_file("b.txt", 300, fs) &&
+	       !create_file("c.txt", 50, fs) && !create_file("d.txt", 100, fs) &&
+	       !create_file("e.txt", 50, fs) && !delete_file("b.txt", fs) &&
+	       "create failed");
+	fill_file("c.txt", 'c', fs);
+	fill_file("d.txt", 'd', fs);
+	fill_file("e.txt", 'e', fs);
+	assert(largest_free_extent(fs) == 424 && "incorrect largest extent");
+
+	// Files larger than the step are not moved
+	assert(compact_step(40, fs) == 0 && "file larger than step moved");
+
+	// Each file after the gap moves to the start of the gap
+	assert(compact_step(F1_LEN, fs) == 50 && compact_step(F1_LEN, fs) == 100 &&
+	       compact_step(F1_LEN, fs) == 50 && compact_step(F1_LEN, fs) == 0 &&
+	       "incorrect compaction steps");
+	assert(largest_free_extent(fs) == 724 && "free space not contiguous");
+
+	char* names[4] = {"a.txt", "c.txt", "d.txt", "e.txt"};
+	uint64_t offsets[4] = {0, 100, 150, 250};
+	for (int i = 0; i < 4; ++i) {
+		file_t* f = fs->o_list->list[i];
+		assert(strcmp(f->name, names[i]) == 0 && f->offset == offsets[i] &&
+		       fs->o_list->offset[i] == offsets[i] &&
+		       verify_hash_range(f->offset, f->length, fs) == 0 &&
+		       "incorrect file after compaction");
+	}
+	check_file("c.txt", 'c', fs);
+	check_file("d.txt", 'd', fs);
+	check_file("e.txt", 'e', fs);
+
+	// Layout: a (0-100), gap (100-160), f (160-660), g (660-710)
+	// f does not fit in the gap, so g is moved instead
+	assert(!delete_file("c.txt", fs) && !delete_file("d.txt", fs) &&
+	       !delete_file("e.txt", fs) && !create_file("x.txt", 60, fs) &&
+	       !create_file("f.txt", 500, fs) && !create_file("g.txt", 50, fs) &&
+	       !delete_file("x.txt", fs) && "create failed");
+	fill_file("g.txt", 'g', fs);
+	assert(compact_step(F1_LEN, fs) == 50 && compact_step(F1_LEN, fs) == 0 &&
+	       "incorrect compaction steps");
+	assert(fs->o_list->list[1]->offset == 100 &&
+	       strcmp(fs->o_list->list[1]->name, "g.txt") == 0 &&
+	       "last file not moved into gap");
+	check_file("g.txt", 'g', fs);
+
+	// dir_table refers to the new offset
+	close_fs(fs);
+	fs = init_fs(f1, f2, f3, 1);
+	check_file("g.txt", 'g', fs);
+
+	close_fs(fs);
+	return 0;
+}
+
+// Tests the background compaction thread removes gaps while the filesystem
+// is in use
+int test_compact_thread() {
+	gen_blank_files();
+	fs_opts_t opts = {0};
+	opts.compactor = 1;
+	filesys_t* fs = init_fs_opts(f1, f2, f3, 1, &opts);
+
+	assert(!create_file("a.txt", 100, fs) && !create_file("b.txt", 300, fs) &&
+	       !create_file("c.txt", 50, fs) && !create_file("d.txt", 100, fs) &&
+	       "create failed");
+	fill_file("c.txt", 'c', fs);
+	fill_file("d.txt", 'd', fs);
+	assert(!delete_file("b.txt", fs) && "delete failed");
+
+	// Wait up to 5 seconds for free space to become contiguous
+	int32_t contiguous = 0;
+	for (int i = 0; i < 500 && !contiguous; ++i) {
+		LOCK_FS(fs);
+		contiguous = largest_free_extent(fs) == F1_LEN - 250;
+		UNLOCK_FS(fs);
+		if (!contiguous) {
+			usleep(10000);
+		}
+	}
+	assert(contiguous && "free space not compacted");
+	check_file("c.txt", 'c', fs);
+	check_file("d.txt", 'd', fs);
+
+	close_fs(fs);
+	return 0;
+}
+
+// Checks the incrementally maintained metrics against a scan of the offset
+// array
+void check_metrics(filesys_t* fs) {
+	fs_metrics_t m;
+	get_metrics(&m, fs);
+
+	uint64_t hist[GAP_HIST_LEN] = {0};
+	uint64_t free_bytes = 0;
+	uint64_t count = 0;
+	uint64_t end_prev_file = 0;
+	for (int32_t i = 0; i <= fs->o_list->size; ++i) {
+		uint64_t start = i < fs->o_list->size ?
+				fs->o_list->offset[i] : (uint64_t)fs->file_data_len;
+		if (start > end_prev_file) {
+			++hist[63 - __builtin_clzll(start - end_prev_file)];
+			free_bytes += start - end_prev_file;
+			++count;
+		}
+		if (i < fs->o_list->size) {
+			end_prev_file = fs->o_list->offset[i] + fs->o_list->length[i];
+		}
+	}
+
+	assert(m.free_bytes == free_bytes && m.gap_count == count &&
+	       !memcmp(m.gap_hist, hist, sizeof(hist)) &&
+	       m.largest_free == largest_free_extent(fs) &&
+	       m.padding == (uint64_t)fs->padding &&
+	       m.reserved == (uint64_t)fs->reserved &&
+	       "metrics differ from scan");
+}
+
+// Tests gap metrics follow creation, deletion, resizing and repacking, with
+// and without aligned offsets
+int test_metrics_gaps() {
+	for (int align = 0; align <= 16; align += 16) {
+		gen_blank_files();
+		fs_opts_t opts = {0};
+		opts.align = align;
+		filesys_t* fs = init_fs_opts(f1, f2, f3, 1, &opts);
+
+		fs_metrics_t m;
+		get_metrics(&m, fs);
+		assert(m.free_bytes == F1_LEN && m.gap_count == 1 &&
+		       m.gap_hist[10] == 1 && m.largest_free == F1_LEN &&
+		       "incorrect empty metrics");
+
+		// Layout: a (0-112), gap (112-320), c (320-368), gap (368-1024)
+		assert(!create_file("a.txt", 100, fs) &&
+		       !create_file("b.txt", 200, fs) &&
+		       !create_file("c.txt", 40, fs) && !delete_file("b.txt", fs) &&
+		       "create failed");
+		check_metrics(fs);
+		get_metrics(&m, fs);
+		assert(m.gap_count == 2 && "incorrect gap count");
+
+		// Pseudo-random operations on eight files
+		unsigned int seed = 1;
+		char name[NAME_LEN];
+		uint8_t buf[128];
+		memset(buf, 'x', sizeof(buf));
+		for (int i = 0; i < 400; ++i) {
+			snprintf(name, NAME_LEN, "f%d.txt", rand_r(&seed) % 8);
+			ssize_t size = file_size(name, fs);
+			switch (rand_r(&seed) % 5) {
+			case 0:
+				create_file(name, rand_r(&seed) % 100, fs);
+				break;
+			case 1:
+				resize_file(name, rand_r(&seed) % 150, fs);
+				break;
+			case 2:
+				if (size >= 0) {
+					write_file(name, size, 1 + rand_r(&seed) % 64, buf, fs);
+				}
+				break;
+			case 3:
+				delete_file(name, fs);
+				break;
+			default:
+				if (rand_r(&seed) % 8 == 0) {
+					repack(fs);
+				}
+			}
+			check_metrics(fs);
+		}
+
+		// Repacking leaves one gap and counts the repack
+		get_metrics(&m, fs);
+		uint64_t repacks = m.repacks;
+		repack(fs);
+		get_metrics(&m, fs);
+		assert(m.gap_count <= 1 && m.repacks == repacks + 1 &&
+		       m.repack_ns > 0 && "incorrect repack metrics");
+		check_metrics(fs);
+
+		// Metrics are rebuilt from dir_table
+		close_fs(fs);
+		fs = init_fs_opts(f1, f2, f3, 1, &opts);
+		check_metrics(fs);
+		close_fs(fs);
+	}
+
+	return 0;
+}
+
+// Tests counters of moved bytes and relocations
+int test_metrics_counters() {
+	gen_blank_files();
+	filesys_t* fs = init_fs(f1, f2, f3, 1);
+
+	// Growing a grows in place, growing b relocates it after c
+	assert(!create_file("a.txt", 100, fs) && !create_file("b.txt", 100, fs) &&
+	       !create_file("c.txt", 100, fs) && !resize_file("c.txt", 150, fs) &&
+	       !resize_file("b.txt", 200, fs) && "create failed");
+	fs_metrics_t m;
+	get_metrics(&m, fs);
+	assert(m.resizes == 2 && m.relocations == 1 && m.compact_bytes == 0 &&
+	       m.repack_bytes == 0 && "incorrect resize counters");
+
+	// Repack moves c and b back towards the start of file_data
+	assert(!delete_file("a.txt", fs) && "delete failed");
+	repack(fs);
+	get_metrics(&m, fs);
+	assert(m.repacks == 1 && m.repack_bytes == 350 &&
+	       "incorrect repack counters");
+
+	// Opening a gap for g moves f
+	assert(!create_file("e.txt", 100, fs) && !create_file("f.txt", 100, fs) &&
+	       !delete_file("e.txt", fs) && !create_file("g.txt", 500, fs) &&
+	       "create failed");
+	get_metrics(&m, fs);
+	assert(m.compact_bytes == 100 && m.gap_count == 1 &&
+	       m.free_bytes == F1_LEN - 950 && "incorrect compaction counters");
+	check_metrics(fs);
+
+	// Formatted text is truncated like snprintf
+	char text[32];
+	ssize_t len = format_metrics(text, sizeof(text), &m);
+	char* full = salloc(len + 1);
+	assert(format_metrics(full, len + 1, &m) == len &&
+	       strlen(full) == (size_t)len && strlen(text) == sizeof(text) - 1 &&
+	       !strncmp(full, text, sizeof(text) - 1) &&
+	       strstr(full, "repacks 1\n") != NULL && "incorrect format");
+	free(full);
+
+	close_fs(fs);
+	return 0;
+}
+
+// Writer thread for test_commit_sync, writing its own file repeatedly
+static void* commit_writer(void* arg) {
+	char** args = arg;
+	for (int i = 0; i < 50; ++i) {
+		assert(!write_file(args[0], i % 6 * 16, 16, args[1], args[2]) &&
+		       "write failed");
+	}
+	return NULL;
+}
+
+// Returns whether every committed operation has been synchronised
+static int32_t commit_synced(filesys_t* fs) {
+	LOCK(&fs->commit_lock);
+	int32_t synced = fs->synced_seq == fs->commit_seq &&
+			fs->pending_file.count == 0 && fs->pending_dir.count == 0 &&
+			fs->pending_hash.count == 0;
+	UNLOCK(&fs->commit_lock);
+	return synced;
+}
+
+// Tests operations with sync durability return once their ranges are
+// synchronised, and concurrent writers share flushes
+int test_commit_sync() {
+	gen_blank_files();
+	fs_opts_t opts = {0};
+	opts.durability = DURABILITY_SYNC;
+	filesys_t* fs = init_fs_opts(f1, f2, f3, 1, &opts);
+
+	char* names[4] = {"a.txt", "b.txt", "c.txt", "d.txt"};
+	for (int i = 0; i < 4; ++i) {
+		assert(!create_file(names[i], 100, fs) && "create failed");
+		assert(commit_synced(fs) && "create not synchronised");
+	}
+
+	char* write_buff = "content_to_write";
+	pthread_t threads[4];
+	char* args[4][3];
+	for (int i = 0; i < 4; ++i) {
+		args[i][0] = names[i];
+		args[i][1] = write_buff;
+		args[i][2] = (char*)fs;
+		assert(!pthread_create(&threads[i], NULL, commit_writer, args[i]) &&
+		       "failed to create thread");
+	}
+	for (int i = 0; i < 4; ++i) {
+		pthread_join(threads[i], NULL);
+	}
+
+	fs_metrics_t m;
+	get_metrics(&m, fs);
+	assert(commit_synced(fs) && m.commits == 204 && m.flushes > 0 &&
+	       m.flushes <= m.commits && "incorrect commit counters");
+
+	// Data written reaches file_data on disk
+	char buff[16];
+	pread(file_fd, buff, 16, fs->n_list->list[2]->offset + 80);
+	assert(memcmp(buff, write_buff, 16) == 0 && "data not written");
+
+	close_fs(fs);
+	return 0;
+}
+
+// Tests the flush thread synchronises ranges committed with periodic
+// durability, and ranges are not committed with no durability
+int test_commit_periodic() {
+	gen_blank_files();
+	fs_opts_t opts = {0};
+	opts.durability = DURABILITY_PERIODIC;
+	opts.flush_ms = 5;
+	filesys_t* fs = init_fs_opts(f1, f2, f3, 1, &opts);
+
+	char* write_buff = "content_to_write";
+	assert(!create_file("a.txt", 100, fs) && "create failed");
+	assert(!write_file("a.txt", 20, 16, write_buff, fs) && "write failed");
+
+	// Wait up to 5 seconds for the flush thread
+	int32_t synced = 0;
+	for (int i = 0; i < 500 && !synced; ++i) {
+		synced = commit_synced(fs);
+		if (!synced) {
+			usleep(10000);
+		}
+	}
+	assert(synced && fs->commit_seq == 2 && "ranges not flushed");
+	close_fs(fs);
+
+	// Operations are not committed, and sync_fs writes every mapping
+	gen_blank_files();
+	fs = init_fs(f1, f2, f3, 1);
+	assert(!create_file("a.txt", 100, fs) && "create failed");
+	assert(!write_file("a.txt", 20, 16, write_buff, fs) && "write failed");
+	sync_fs(fs);
+	assert(fs->commit_seq == 0 && "ranges committed");
+
+	char buff[16];
+	pread(file_fd, buff, 16, 20);
+	assert(memcmp(buff, write_buff, 16) == 0 && "data not written");
+
+	close_fs(fs);
+	return 0;
+}
+
+// Tests dir_table entries and hashes are restored from the journal after a
+// crash where dir_table and hash_data were not written, stopping at a
+// corrupted record, and records are not applied again after a checkpoint
+int test_journal_replay() {
+	gen_blank_files();
+	unlink(f5);
+	fs_opts_t opts = {0};
+	opts.durability = DURABILITY_SYNC;
+	opts.journal_path = f5;
+	filesys_t* fs = init_fs_opts(f1, f2, f3, 1, &opts);
+
+	char* write_buff = "content_to_write";
+	assert(!create_file("a.txt", 100, fs) && !create_file("b.txt", 50, fs) &&
+	       "create failed");
+	assert(!write_file("a.txt", 20, 16, write_buff, fs) && "write failed");
+	int64_t rename_pos = fs->journal_pos;
+	assert(!rename_file("b.txt", "c.txt", fs) && "rename failed");
+	int64_t end_pos = fs->journal_pos;
+	assert(fs->journal_seq == 4 && end_pos > rename_pos &&
+	       "records not written");
+
+	// Keep the journal as it was before close_fs checkpoints it
+	uint8_t* journal = salloc(end_pos);
+	int fd = open(f5, O_RDWR);
+	assert(pread(fd, journal, end_pos, 0) == end_pos && "read failed");
+	close_fs(fs);
+
+	// Crash where dir_table and hash_data were never written
+	pwrite_null_byte(dir_fd, 0, F2_LEN);
+	pwrite_null_byte(hash_fd, 0, F3_LEN);
+	pwrite(fd, journal, end_pos, 0);
+	fs = init_fs_opts(f1, f2, f3, 1, &opts);
+	char buff[16];
+	assert(file_size("a.txt", fs) == 100 && file_size("b.txt", fs) == -1 &&
+	       file_size("c.txt", fs) == 50 && "entries not restored");
+	assert(!read_file("a.txt", 20, 16, buff, fs) &&
+	       memcmp(buff, write_buff, 16) == 0 && "data not verified");
+	close_fs(fs);
+
+	// Records are not applied again once checkpointed
+	fs = init_fs(f1, f2, f3, 1);
+	assert(!delete_file("a.txt", fs) && "delete failed");
+	close_fs(fs);
+	fs = init_fs_opts(f1, f2, f3, 1, &opts);
+	assert(file_size("a.txt", fs) == -1 && "checkpointed record applied");
+	close_fs(fs);
+
+	// Replay stops at a record failing its checksum
+	pwrite_null_byte(dir_fd, 0, F2_LEN);
+	pwrite_null_byte(hash_fd, 0, F3_LEN);
+	journal[end_pos - 1] ^= 1;
+	pwrite(fd, journal, end_pos, 0);
+	fs = init_fs_opts(f1, f2, f3, 1, &opts);
+	assert(file_size("a.txt", fs) == 100 && file_size("b.txt", fs) == 50 &&
+	       file_size("c.txt", fs) == -1 && "corrupted record applied");
+
+	// Three records are applied, and recovery writes no record
+	assert(fs->journal_seq == 3 && "incorrect records applied");
+	close_fs(fs);
+
+	close(fd);
+	free(journal);
+	unlink(f5);
+	return 0;
+}
+
+// Tests replay writes journalled hashes instead of hashing file_data, so
+// data corrupted outside the journalled ranges fails verification
+int test_journal_replay_verify() {
+	gen_blank_files();
+	unlink(f5);
+	fs_opts_t opts = {0};
+	opts.durability = DURABILITY_SYNC;
+	opts.journal_path = f5;
+	filesys_t* fs = init_fs_opts(f1, f2, f3, 1, &opts);
+
+	assert(!create_file("a.txt", 100, fs) && "create failed");
+	fill_file("a.txt", 'a', fs);
+	int64_t end_pos = fs->journal_pos;
+	uint8_t* journal = salloc(end_pos);
+	int fd = open(f5, O_RDWR);
+	assert(pread(fd, journal, end_pos, 0) == end_pos && "read failed");
+	close_fs(fs);
+
+	// Crash before the checkpoint, then corrupt a byte of the file
+	pwrite_null_byte(dir_fd, 0, F2_LEN);
+	pwrite_null_byte(hash_fd, 0, F3_LEN);
+	pwrite(fd, journal, end_pos, 0);
+	pwrite(file_fd, "b", 1, 50);
+	fs = init_fs_opts(f1, f2, f3, 1, &opts);
+	char buff[100];
+	assert(file_size("a.txt", fs) == 100 && "entry not restored");
+	assert(read_file("a.txt", 0, 100, buff, fs) == 3 &&
+	       "corrupted data verified");
+	close_fs(fs);
+
+	close(fd);
+	free(journal);
+	unlink(f5);
+	return 0;
+}
+
+// Tests files moved by repack are restored from the journal after a crash
+// where dir_table and hash_data were not written and the moves overwrote
+// the new offsets partially, when the record with the hashes of the moved
+// blocks is lost
+int test_journal_repack_crash() {
+	gen_blank_files();
+	unlink(f5);
+	fs_opts_t opts = {0};
+	opts.durability = DURABILITY_SYNC;
+	opts.journal_path = f5;
+	filesys_t* fs = init_fs_opts(f1, f2, f3, 1, &opts);
+
+	assert(!create_file("a.txt", 200, fs) && !create_file("b.txt", 200, fs) &&
+	       !create_file("c.txt", 300, fs) && "create failed");
+	fill_file("a.txt", 'a', fs);
+	fill_file("b.txt", 'b', fs);
+	fill_file("c.txt", 'c', fs);
+	assert(!delete_file("a.txt", fs) && "delete failed");
+	close_fs(fs);
+
+	// Keep the files and journal header as they were before repack
+	uint8_t dir[F2_LEN];
+	uint8_t hash[F3_LEN];
+	journal_hdr_t hdr;
+	int fd = open(f5, O_RDWR);
+	assert(pread(dir_fd, dir, F2_LEN, 0) == F2_LEN &&
+	       pread(hash_fd, hash, F3_LEN, 0) == F3_LEN &&
+	       pread(fd, &hdr, sizeof(hdr), 0) == sizeof(hdr) && "read failed");
+
+	fs = init_fs_opts(f1, f2, f3, 1, &opts);
+	repack(fs);
+	assert(fs->o_list->offset[0] == 0 && fs->o_list->offset[1] == 200 &&
+	       "files not repacked");
+	close_fs(fs);
+
+	// Find the last record written by repack
+	int64_t pos = sizeof(hdr);
+	int64_t last = -1;
+	journal_hdr_t rec;
+	for (uint64_t seq = hdr.seq + 1;
+			pread(fd, &rec, sizeof(rec), pos) == sizeof(rec) &&
+			rec.magic == JOURNAL_MAGIC && rec.seq == seq; ++seq) {
+		last = pos;
+		pos += sizeof(rec) + rec.length;
+	}
+	assert(last > (int64_t)sizeof(hdr) && "records not written");
+
+	// Crash where dir_table, hash_data and the journal header were not
+	// written, the data at the new offsets was overwritten and the last
+	// record is corrupted
+	pwrite(dir_fd, dir, F2_LEN, 0);
+	pwrite(hash_fd, hash, F3_LEN, 0);
+	pwrite(fd, &hdr, sizeof(hdr), 0);
+	pwrite_null_byte(file_fd, 0, 500);
+	uint8_t byte;
+	pread(fd, &byte, 1, last + sizeof(rec));
+	byte ^= 1;
+	pwrite(fd, &byte, 1, last + sizeof(rec));
+
+	fs = init_fs_opts(f1, f2, f3, 1, &opts);
+	assert(fs->o_list->offset[0] == 0 && fs->o_list->offset[1] == 200 &&
+	       "moves not restored");
+	check_file("b.txt", 'b', fs);
+	check_file("c.txt", 'c', fs);
+	close_fs(fs);
+
+	close(fd);
+	unlink(f5);
+	return 0;
+}
+
+// Tests space freed by moving or deleting a file with a journal is only
+// reused once the journal no longer refers to it, so the files remain intact
+// after a crash losing every later record
+int test_journal_reuse() {
+	gen_blank_files();
+	unlink(f5);
+	fs_opts_t opts = {0};
+	opts.durability = DURABILITY_PERIODIC;
+	opts.flush_ms = 60000;
+	opts.journal_path = f5;
+	filesys_t* fs = init_fs_opts(f1, f2, f3, 1, &opts);
+
+	// a.txt moves from 0 to 512, then b.txt is deleted, freeing 0 to 512
+	// (blocks are not shared with a.txt)
+	assert(!create_file("a.txt", 256, fs) && !create_file("b.txt", 256, fs) &&
+	       "create failed");
+	fill_file("a.txt", 'a', fs);
+	fill_file("b.txt", 'b', fs);
+	assert(!resize_file("a.txt", 300, fs) && !delete_file("b.txt", fs) &&
+	       "resize or delete failed");
+	assert(fs->o_list->offset[0] == 512 && "file not moved");
+	int64_t end_pos = fs->journal_pos;
+	uint8_t* journal = salloc(end_pos);
+	int fd = open(f5, O_RDWR);
+	assert(pread(fd, journal, end_pos, 0) == end_pos && "read failed");
+
+	// The freed space is reused
+	assert(!create_file("c.txt", 512, fs) && "create failed");
+	assert(fs->o_list->offset[0] == 0 && "space not reused");
+	fill_file("c.txt", 'c', fs);
+	close_fs(fs);
+
+	// Crash where dir_table and hash_data were never written and records
+	// after the delete were lost
+	pwrite_null_byte(dir_fd, 0, F2_LEN);
+	pwrite_null_byte(hash_fd, 0, F3_LEN);
+	pwrite_null_byte(fd, end_pos, JOURNAL_LEN - end_pos);
+	pwrite(fd, journal, end_pos, 0);
+	fs = init_fs_opts(f1, f2, f3, 1, &opts);
+	uint8_t buf[300];
+	assert(file_size("a.txt", fs) == 300 && file_size("b.txt", fs) == -1 &&
+	       file_size("c.txt", fs) == -1 && "entries not restored");
+	assert(!read_file("a.txt", 0, 300, buf, fs) && buf[255] == 'a' &&
+	       buf[256] == 0 && "moved file corrupted");
+	close_fs(fs);
+
+	close(fd);
+	free(journal);
+	unlink(f5);
+	return 0;
+}
+
+// Tests files growing with a journal are only moved while their current
+// extent remains in use, returning 2 otherwise
+int test_journal_relocate() {
+	gen_blank_files();
+	unlink(f5);
+	fs_opts_t opts = {0};
+	opts.durability = DURABILITY_SYNC;
+	opts.journal_path = f5;
+	filesys_t* fs = init_fs_opts(f1, f2, f3, 1, &opts);
+
+	assert(!create_file("a.txt", 300, fs) && !create_file("b.txt", 100, fs) &&
+	       !create_file("c.txt", 200, fs) && !create_file("d.txt", 50, fs) &&
+	       "create failed");
+	fill_file("a.txt", 'a', fs);
+	fill_file("c.txt", 'c', fs);
+	fill_file("d.txt", 'd', fs);
+	assert(!delete_file("b.txt", fs) && "delete failed");
+
+	// No free extent fits 450 bytes, so c.txt and d.txt are compacted into
+	// the gap before them (not over a.txt) and a.txt is copied after them
+	assert(!resize_file("a.txt", 450, fs) && "resize failed");
+	assert(fs->o_list->offset[0] == 300 && fs->o_list->offset[1] == 500 &&
+	       fs->o_list->offset[2] == 550 && "files not moved");
+	check_file("c.txt", 'c', fs);
+	check_file("d.txt", 'd', fs);
+	uint8_t buf[450];
+	assert(!read_file("a.txt", 0, 450, buf, fs) && buf[0] == 'a' &&
+	       buf[299] == 'a' && buf[300] == 0 && "data not kept");
+
+	// Both extents of a.txt do not fit, so it cannot move
+	assert(resize_file("a.txt", 500, fs) == 2 &&
+	       file_size("a.txt", fs) == 450 && "resize succeeded");
+	assert(!read_file("a.txt", 0, 450, buf, fs) && buf[0] == 'a' &&
+	       "data not kept");
+	close_fs(fs);
+
+	unlink(f5);
+	return 0;
+}
+
 // Tests the deletion of existing file
 int test_delete_file_success() {
 	gen_blank_files();
@@ -576,6 +2381,72 @@ int test_delete_file_does_not_exist() {
 	return 0;
 }
 
+// Tests pages freed by delete_file and resize_file are released from
+// file_data with the punch_holes option, and their blocks are hashed as zero
+int test_delete_file_punch() {
+	char* names[3] = {"punch_file_data.bin", "punch_directory_table.bin",
+	                  "punch_hash_data.bin"};
+	int64_t lengths[3] = {1024 * BLOCK_LEN, 32 * META_LEN,
+	                      (2 * 1024 - 1) * HASH_LEN};
+	for (int i = 0; i < 3; ++i) {
+		int fd = open(names[i], O_RDWR | O_CREAT | O_TRUNC, S_IRUSR | S_IWUSR);
+		assert(fd >= 0 && !ftruncate(fd, lengths[i]) && "failed to create");
+		close(fd);
+	}
+	fs_opts_t opts = {0};
+	opts.punch_holes = 1;
+	filesys_t* fs = init_fs_opts(names[0], names[1], names[2], 1, &opts);
+	compute_hash_tree(fs);
+
+	// Files of 65536 bytes and 100 bytes, then an unaligned file
+	int64_t file_len = 65536;
+	uint8_t* buf = salloc(file_len);
+	char name[NAME_LEN];
+	for (int i = 0; i < 4; ++i) {
+		snprintf(name, NAME_LEN, "file%02d", i);
+		int64_t len = i == 1 ? 100 : file_len;
+		assert(!create_file(name, len, fs) && "create failed");
+		memset(buf, 'A' + i, len);
+		assert(!write_file(name, 0, len, buf, fs) && "write failed");
+	}
+	struct stat before;
+	assert(!fstat(fs->file_fd, &before) && "stat failed");
+
+	// Every page of file00 is released, and the pages file02 shares with
+	// file01 and file03 are kept
+	assert(!delete_file("file00", fs) && !resize_file("file02", 5000, fs) &&
+	       "failed to free space");
+	fs_metrics_t m;
+	get_metrics(&m, fs);
+	assert(m.punched_bytes == 65536 + 57344 && "incorrect bytes punched");
+
+	struct stat after;
+	assert(!fstat(fs->file_fd, &after) && after.st_size == lengths[0] &&
+	       after.st_blocks < before.st_blocks && "space not released");
+	for (int64_t i = 0; i < 65536; ++i) {
+		assert(fs->file[i] == 0 && "punched range not zero");
+	}
+
+	// Remaining data is intact and the hash tree matches a recomputation
+	for (int i = 1; i < 4; ++i) {
+		snprintf(name, NAME_LEN, "file%02d", i);
+		ssize_t len = file_size(name, fs);
+		assert(!read_file(name, 0, len, buf, fs) && "read failed");
+		for (ssize_t j = 0; j < len; ++j) {
+			assert(buf[j] == 'A' + i && "file data corrupted");
+		}
+	}
+	assert(hash_tree_valid(fs) &&
+	       "incorrect hash tree after punching");
+
+	free(buf);
+	close_fs(fs);
+	for (int i = 0; i < 3; ++i) {
+		unlink(names[i]);
+	}
+	return 0;
+}
+
 // Tests the renaming of existing files
 int test_rename_file_success() {
 	gen_blank_files();
@@ -745,6 +2616,50 @@ int test_write_file_success() {
 	return 0;
 }
 
+// Tests hashing a block records only the nodes on its path to the root, and
+// operations synchronise every range they record
+int test_write_file_dirty() {
+	gen_blank_files();
+	filesys_t* fs = init_fs(f1, f2, f3, 1);
+
+	assert(!create_file("a.txt", 3 * BLOCK_LEN, fs) &&
+	       !create_file("b.txt", 100, fs) && "create failed");
+	assert(fs->dirty_file.count == 0 && fs->dirty_dir.count == 0 &&
+	       fs->dirty_hash.count == 0 && "ranges not synchronised");
+
+	// One node per level, where siblings of the path are not recorded (the
+	// path is not below the root of a zero subtree once a.txt is written)
+	fill_file("a.txt", 'x', fs);
+	compute_hash_block_range(BLOCK_LEN + 1, 1, fs);
+	int64_t bytes = 0;
+	for (int32_t i = 0; i < fs->dirty_hash.count; ++i) {
+		bytes += fs->dirty_hash.end[i] - fs->dirty_hash.start[i];
+	}
+	int32_t levels = 0;
+	for (int32_t n = fs->leaf_offset + 1; n >= 0; n = p_index(n)) {
+		int32_t found = 0;
+		for (int32_t i = 0; i < fs->dirty_hash.count; ++i) {
+			found |= n * HASH_LEN >= fs->dirty_hash.start[i] &&
+					(n + 1) * HASH_LEN <= fs->dirty_hash.end[i];
+		}
+		assert(found && "node on path not recorded");
+		++levels;
+	}
+	assert(bytes == levels * HASH_LEN && "nodes off path recorded");
+	assert(fs->dirty_file.count == 0 && fs->dirty_dir.count == 0 &&
+	       "unmodified mappings recorded");
+	commit_op(fs);
+
+	// Writes within a file record the bytes written and are synchronised
+	char* write_buff = "content_to_write";
+	assert(!write_file("b.txt", 10, 16, write_buff, fs) && "write failed");
+	assert(fs->dirty_file.count == 0 && fs->dirty_dir.count == 0 &&
+	       fs->dirty_hash.count == 0 && "ranges not synchronised");
+
+	close_fs(fs);
+	return 0;
+}
+
 // Attempts to write to a file which does not exist
 int test_write_file_does_not_exist() {
 	gen_blank_files();
@@ -791,6 +2706,78 @@ int test_write_file_no_space() {
 	return 0;
 }
 
+// Tests appending to a file reserves space after it, so the file is moved
+// O(log n) times, and reserved space is released by trim_file
+int test_write_file_append() {
+	char* names[3] = {"append_file_data.bin", "append_directory_table.bin",
+	                  "append_hash_data.bin"};
+	int64_t lengths[3] = {4096 * BLOCK_LEN, 256 * META_LEN,
+	                      (2 * 4096 - 1) * HASH_LEN};
+	for (int i = 0; i < 3; ++i) {
+		int fd = open(names[i], O_RDWR | O_CREAT | O_TRUNC, S_IRUSR | S_IWUSR);
+		assert(fd >= 0 && !ftruncate(fd, lengths[i]) && "failed to create");
+		close(fd);
+	}
+	filesys_t* fs = init_fs(names[0], names[1], names[2], 1);
+
+	// Append 64 chunks to each of two files in turn, so each append would
+	// move the file without reserved space
+	uint8_t buf[4096];
+	char* streams[2] = {"stream0", "stream1"};
+	file_t* f[2];
+	int32_t moves = 0;
+	FILE_KEY(temp);
+	for (int s = 0; s < 2; ++s) {
+		assert(!create_file(streams[s], 0, fs) && "create failed");
+		update_file_name(streams[s], &temp);
+		f[s] = arr_get_by_key(&temp, fs->n_list);
+	}
+	for (int i = 0; i < 64; ++i) {
+		for (int s = 0; s < 2; ++s) {
+			uint64_t offset = f[s]->offset;
+			memset(buf, 2 * i + s, sizeof(buf));
+			assert(!write_file(streams[s], i * sizeof(buf), sizeof(buf), buf,
+			       fs) && "write failed");
+			moves += i > 0 && f[s]->offset != offset;
+		}
+	}
+	assert(moves <= 16 && "too many moves while appending");
+
+	for (int i = 0; i < 64; ++i) {
+		for (int s = 0; s < 2; ++s) {
+			assert(!read_file(streams[s], i * sizeof(buf), sizeof(buf), buf,
+			       fs) && buf[0] == 2 * i + s &&
+			       buf[sizeof(buf) - 1] == 2 * i + s && "data corrupted");
+		}
+	}
+
+	// Release reserved space
+	assert(fs->reserved == f[0]->reserve + f[1]->reserve &&
+	       !trim_file(streams[0], fs) && !trim_file(streams[1], fs) &&
+	       fs->reserved == 0 &&
+	       fs->o_list->length[f[0]->o_index] == f[0]->length &&
+	       fs->o_list->length[f[1]->o_index] == f[1]->length &&
+	       "trim failed");
+	assert(trim_file("missing", fs) == 1 && "trim of missing file succeeded");
+
+	close_fs(fs);
+	for (int i = 0; i < 3; ++i) {
+		unlink(names[i]);
+	}
+
+	// Reserved space is released when space is required by another file
+	gen_blank_files();
+	fs = init_fs(f1, f2, f3, 1);
+	assert(!create_file("a.txt", 0, fs) &&
+	       !write_file("a.txt", 0, 100, buf, fs) && fs->reserved == 100 &&
+	       !create_file("b.txt", F1_LEN - 300, fs) && fs->reserved == 100 &&
+	       !create_file("c.txt", 200, fs) && fs->reserved == 0 &&
+	       "reserved space not released");
+
+	close_fs(fs);
+	return 0;
+}
+
 // Tests the retrieval of file sizes
 int test_file_size_success() {
 	gen_blank_files();
@@ -919,6 +2906,12 @@ int main(int argc, char * argv[]) {
     // Helper tests
 	printf("\nHelper Tests\n");
     TEST(test_helper_error_handling);
+    TEST(test_name_cmp);
+    TEST(test_sort_files);
+    TEST(test_dir_used_mask);
+    TEST(test_dirty_ranges);
+    TEST(test_block_cache);
+    TEST(test_scan_dir);
 
     // Array data structure tests
 	printf("\nArray Data Structure Tests\n");
@@ -926,32 +2919,68 @@ int main(int argc, char * argv[]) {
 	TEST(test_array_insert);
 	TEST(test_array_get);
 	TEST(test_array_remove);
+	TEST(test_array_dense_keys);
+	TEST(test_array_name_prefix);
 
 	// Basic filesystem tests
 	printf("\nBasic Filesystem Tests\n");
 	TEST(test_no_operation);
 	TEST(test_init_close_error_handling);
+	TEST(test_init_bulk_build);
+	TEST(test_init_sidecar);
+	TEST(test_init_mapped_names);
+	TEST(test_init_pread_storage);
 
 	// create_file tests
 	printf("\ncreate_file Tests\n");
 	TEST(test_create_file_success);
+	TEST(test_create_file_repack_window);
+	TEST(test_create_file_aligned);
+	TEST(test_create_file_unwritten);
 	TEST(test_create_file_exists);
 	TEST(test_create_file_no_space);
 
 	// resize_file tests
 	printf("\nresize_file Tests\n");
 	TEST(test_resize_file_success);
+	TEST(test_resize_file_relocate);
+	TEST(test_resize_file_unwritten_relocate);
 	TEST(test_resize_file_does_not_exist);
 	TEST(test_resize_file_no_space);
 
 	// repack tests
 	printf("\nrepack Tests\n");
 	TEST(test_repack_success);
+	TEST(test_repack_parallel);
+	TEST(test_repack_collapse);
+	TEST(test_repack_collapse_restore);
+	TEST(test_repack_unchanged_blocks);
+	TEST(test_repack_zero_subtree);
+	TEST(test_repack_hot_placement);
+	TEST(test_repack_hot_no_space);
+	TEST(test_compact_step);
+	TEST(test_compact_thread);
+
+	// metrics tests
+	printf("\nmetrics Tests\n");
+	TEST(test_metrics_gaps);
+	TEST(test_metrics_counters);
+
+	// commit tests
+	printf("\ncommit Tests\n");
+	TEST(test_commit_sync);
+	TEST(test_commit_periodic);
+	TEST(test_journal_replay);
+	TEST(test_journal_replay_verify);
+	TEST(test_journal_repack_crash);
+	TEST(test_journal_reuse);
+	TEST(test_journal_relocate);
 
 	// delete_file tests
 	printf("\ndelete_file Tests\n");
 	TEST(test_delete_file_success);
 	TEST(test_delete_file_does_not_exist);
+	TEST(test_delete_file_punch);
 
 	// rename_file tests
 	printf("\nrename_file Tests\n");
@@ -968,9 +2997,11 @@ int main(int argc, char * argv[]) {
 	// write_file tests
 	printf("\nwrite_file Tests\n");
 	TEST(test_write_file_success);
+	TEST(test_write_file_dirty);
 	TEST(test_write_file_does_not_exist);
 	TEST(test_write_file_invalid_offset);
 	TEST(test_write_file_no_space);
+	TEST(test_write_file_append);
 
 	// file_size tests
 	printf("\nfile_size Tests\n");
@@ -0,0 +1,325 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <limits.h>
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <assert.h>
+
+#include "structs.h"
+#include "helper.h"
+#include "arr.h"
+#include "myfilesystem.h"
+#include "sidecar.h"
+
+/*
+ * Index Sidecar
+ *
+ * Building the sorted arrays requires reading every dir_table entry and
+ * sorting the files twice. The sidecar stores the result of this work when
+ * the filesystem is closed, so the next initialisation can rebuild the arrays
+ * without sorting or scanning unused dir_table slots.
+ *
+ * The sidecar contains a header, the slot array (fs->index), and the
+ * dir_table indices of files in name order and offset order. Offsets and
+ * lengths are read from dir_table when files are loaded, so they are not
+ * duplicated in the sidecar.
+ *
+ * A sidecar is only valid for the dir_table it was written for. The header
+ * stores a generation tag (device, inode, length and modification time of
+ * dir_table after it was last synchronised) which is compared with dir_table
+ * during initialisation, and a checksum of the header and data. As file
+ * timestamps are only updated once per clock tick, the sidecar must also be
+ * newer than dir_table (similar to racy entries in a git index). The sidecar
+ * is removed once the filesystem is initialised, so a filesystem which is not
+ * closed (e.g. due to a crash) always falls back to scanning dir_table.
+ */
+
+/*
+ * Returns the number of bytes of sidecar data following the header
+ */
+static size_t sidecar_data_len(int32_t index_len, int32_t n_count,
+		int32_t o_count) {
+	return sizeof(uint8_t) * index_len +
+	       sizeof(int32_t) * ((size_t)n_count + o_count);
+}
+
+/*
+ * Stores the generation tag of dir_table in a sidecar header
+ */
+static void sidecar_tag(struct stat* dir_stat, sidecar_hdr_t* hdr) {
+	hdr->dir_dev = dir_stat->st_dev;
+	hdr->dir_ino = dir_stat->st_ino;
+	hdr->dir_size = dir_stat->st_size;
+	hdr->dir_mtime_sec = dir_stat->st_mtim.tv_sec;
+	hdr->dir_mtime_nsec = dir_stat->st_mtim.tv_nsec;
+}
+
+/*
+ * Calculates the checksum of a sidecar, treating the checksum field as zero
+ *
+ * buf: address of sidecar (header followed by data)
+ * length: total length of sidecar in bytes
+ * out: buffer of HASH_LEN bytes for the checksum
+ */
+static void sidecar_checksum(uint8_t* buf, size_t length, uint8_t* out) {
+	sidecar_hdr_t hdr;
+	memcpy(&hdr, buf, sizeof(hdr));
+	memset(hdr.checksum, 0, HASH_LEN);
+
+	uint8_t hashes[2 * HASH_LEN];
+	fletcher((uint8_t*)&hdr, sizeof(hdr), hashes);
+	fletcher(buf + sizeof(hdr), length - sizeof(hdr), hashes + HASH_LEN);
+	fletcher(hashes, 2 * HASH_LEN, out);
+}
+
+/*
+ * Checks that a list of dir_table indices refers to distinct used slots
+ *
+ * returns: 0 if valid, -1 otherwise
+ */
+static int32_t sidecar_check_slots(int32_t* slots, int32_t count,
+		uint8_t* seen, filesys_t* fs) {
+	memset(seen, 0, fs->index_len);
+	for (int32_t i = 0; i < count; ++i) {
+		int32_t slot = slots[i];
+		if (slot < 0 || slot >= fs->index_len || seen[slot] ||
+			fs->index[slot] != 1 || fs->dir[slot * META_LEN] == '\0') {
+			return -1;
+		}
+		seen[slot] = 1;
+	}
+	return 0;
+}
+
+/*
+ * Adopts the sorted arrays stored in a sidecar, if the sidecar is valid for
+ * the dir_table of the filesystem
+ * On failure the arrays and slot array are left empty
+ *
+ * dir_stat: stat of dir_table when the filesystem was initialised
+ * fs: filesystem with empty arrays
+ *
+ * returns: 0 if the sidecar was adopted, -1 otherwise
+ */
+int32_t sidecar_load(struct stat* dir_stat, filesys_t* fs) {
+	assert(dir_stat != NULL && fs != NULL && fs->opts.index_path != NULL &&
+	       fs->n_list->size == 0 && fs->o_list->size == 0 && "invalid args");
+
+	int fd = open(fs->opts.index_path, O_RDONLY);
+	if (fd < 0) {
+		return -1;
+	}
+
+	// A sidecar written in the same timestamp tick as the last modification
+	// of dir_table cannot detect later modifications in that tick, so it is
+	// only used if it is strictly newer than dir_table
+	struct stat stats;
+	if (fstat(fd, &stats) || stats.st_size < (off_t)sizeof(sidecar_hdr_t) ||
+		stats.st_mtim.tv_sec < dir_stat->st_mtim.tv_sec ||
+		(stats.st_mtim.tv_sec == dir_stat->st_mtim.tv_sec &&
+		 stats.st_mtim.tv_nsec <= dir_stat->st_mtim.tv_nsec)) {
+		close(fd);
+		return -1;
+	}
+
+	size_t buf_len = stats.st_size;
+	uint8_t* buf = mmap(NULL, buf_len, PROT_READ, MAP_PRIVATE, fd, 0);
+	close(fd);
+	if (buf == MAP_FAILED) {
+		return -1;
+	}
+
+	// Check header fields match the filesystem
+	sidecar_hdr_t hdr;
+	sidecar_hdr_t tag;
+	memcpy(&hdr, buf, sizeof(hdr));
+	sidecar_tag(dir_stat, &tag);
+	int32_t valid = hdr.magic == SIDECAR_MAGIC &&
+		hdr.dir_dev == tag.dir_dev && hdr.dir_ino == tag.dir_ino &&
+		hdr.dir_size == tag.dir_size &&
+		hdr.dir_mtime_sec == tag.dir_mtime_sec &&
+		hdr.dir_mtime_nsec == tag.dir_mtime_nsec &&
+		hdr.file_data_len == fs->file_data_len &&
+		hdr.index_len == fs->index_len &&
+		hdr.n_count >= 0 && hdr.n_count <= fs->index_len &&
+		hdr.o_count >= 0 && hdr.o_count <= hdr.n_count &&
+		buf_len == sizeof(hdr) +
+		sidecar_data_len(hdr.index_len, hdr.n_count, hdr.o_count);
+
+	// Check the checksum
+	if (valid) {
+		uint8_t checksum[HASH_LEN];
+		sidecar_checksum(buf, buf_len, checksum);
+		valid = memcmp(checksum, hdr.checksum, HASH_LEN) == 0;
+	}
+
+	// Check slots are used and referenced by exactly one file in each order
+	int32_t* n_slots = NULL;
+	int32_t* o_slots = NULL;
+	uint8_t* seen = NULL;
+	if (valid) {
+		memcpy(fs->index, buf + sizeof(hdr), fs->index_len);
+		n_slots = salloc(sizeof(*n_slots) * (hdr.n_count + 1));
+		o_slots = salloc(sizeof(*o_slots) * (hdr.o_count + 1));
+		memcpy(n_slots, buf + sizeof(hdr) + fs->index_len,
+				sizeof(*n_slots) * hdr.n_count);
+		memcpy(o_slots, buf + sizeof(hdr) + fs->index_len +
+				sizeof(*n_slots) * hdr.n_count, sizeof(*o_slots) * hdr.o_count);
+
+		int32_t used_slots = 0;
+		for (int32_t i = 0; i < fs->index_len; ++i) {
+			used_slots += fs->index[i] != 0;
+		}
+
+		seen = salloc(fs->index_len + 1);
+		valid = used_slots == hdr.n_count &&
+			!sidecar_check_slots(n_slots, hdr.n_count, seen, fs) &&
+			!sidecar_check_slots(o_slots, hdr.o_count, seen, fs);
+	}
+	munmap(buf, buf_len);
+
+	// Create files in name order and fill arrays
+	if (valid) {
+		file_t** files = salloc(sizeof(*files) * (hdr.n_count + 1));
+		file_t** slot_files = scalloc(sizeof(*slot_files) * fs->index_len);
+		uint64_t offset = 0;
+		uint32_t length = 0;
+		for (int32_t i = 0; i < hdr.n_count; ++i) {
+			int32_t slot = n_slots[i];
+			memcpy(&offset, fs->dir + slot * META_LEN + NAME_LEN,
+					sizeof(uint32_t));
+			memcpy(&length, fs->dir + slot * META_LEN + NAME_LEN + OFFSET_LEN,
+					sizeof(uint32_t));
+			files[i] = file_init_dir((char*)fs->dir + slot * META_LEN, offset,
+					length, slot, fs);
+			slot_files[slot] = files[i];
+		}
+		valid = !arr_load(files, hdr.n_count, fs->n_list);
+
+		// Offset order refers to the same files
+		if (valid) {
+			for (int32_t i = 0; i < hdr.o_count; ++i) {
+				files[i] = slot_files[o_slots[i]];
+			}
+			valid = !arr_load(files, hdr.o_count, fs->o_list);
+		}
+
+		// Every non-zero size file must be in the offset array
+		if (valid) {
+			int32_t nonzero = 0;
+			for (int32_t i = 0; i < hdr.n_count; ++i) {
+				fs->used += fs->n_list->list[i]->length;
+				nonzero += fs->n_list->list[i]->length > 0;
+			}
+			valid = nonzero == hdr.o_count;
+		}
+
+		// Discard partially loaded files on failure
+		if (!valid) {
+			for (int32_t i = 0; i < hdr.n_count; ++i) {
+				free_file(slot_files[n_slots[i]]);
+			}
+			fs->n_list->size = 0;
+			fs->o_list->size = 0;
+			fs->used = 0;
+		}
+
+		free(files);
+		free(slot_files);
+	}
+
+	free(n_slots);
+	free(o_slots);
+	free(seen);
+
+	if (!valid) {
+		memset(fs->index, 0, fs->index_len);
+		return -1;
+	}
+
+	fs->index_count = hdr.n_count;
+	return 0;
+}
+
+/*
+ * Removes the sidecar of a filesystem, so that changes made to dir_table
+ * before the filesystem is closed cannot be paired with an outdated sidecar
+ *
+ * fs: filesystem using a sidecar
+ */
+void sidecar_remove(filesys_t* fs) {
+	assert(fs != NULL && fs->opts.index_path != NULL && "invalid args");
+
+	unlink(fs->opts.index_path);
+}
+
+/*
+ * Writes the sorted arrays of a filesystem to its sidecar
+ * dir_table must be synchronised and unmapped before calling, so that its
+ * generation tag does not change after the sidecar is written. The sidecar
+ * is written to a temporary file which then replaces the sidecar.
+ *
+ * dir_stat: stat of dir_table after it was unmapped
+ * fs: filesystem using a sidecar
+ *
+ * returns: 0 on success, -1 on failure (no sidecar is left)
+ */
+int32_t sidecar_save(struct stat* dir_stat, filesys_t* fs) {
+	assert(dir_stat != NULL && fs != NULL && fs->opts.index_path != NULL &&
+	       "invalid args");
+
+	// Build sidecar in memory
+	sidecar_hdr_t hdr;
+	memset(&hdr, 0, sizeof(hdr));
+	hdr.magic = SIDECAR_MAGIC;
+	sidecar_tag(dir_stat, &hdr);
+	hdr.file_data_len = fs->file_data_len;
+	hdr.index_len = fs->index_len;
+	hdr.n_count = fs->n_list->size;
+	hdr.o_count = fs->o_list->size;
+
+	size_t length = sizeof(hdr) +
+		sidecar_data_len(hdr.index_len, hdr.n_count, hdr.o_count);
+	uint8_t* buf = salloc(length);
+	uint8_t* data = buf + sizeof(hdr);
+	memcpy(data, fs->index, fs->index_len);
+	data += fs->index_len;
+	for (int32_t i = 0; i < hdr.n_count; ++i) {
+		memcpy(data, &fs->n_list->list[i]->index, sizeof(int32_t));
+		data += sizeof(int32_t);
+	}
+	for (int32_t i = 0; i < hdr.o_count; ++i) {
+		memcpy(data, &fs->o_list->list[i]->index, sizeof(int32_t));
+		data += sizeof(int32_t);
+	}
+	memcpy(buf, &hdr, sizeof(hdr));
+	sidecar_checksum(buf, length, hdr.checksum);
+	memcpy(buf, &hdr, sizeof(hdr));
+
+	// Write to temporary file before replacing sidecar
+	char temp_path[PATH_MAX];
+	int32_t ret = -1;
+	if (snprintf(temp_path, PATH_MAX, "%s.tmp", fs->opts.index_path)
+		< PATH_MAX) {
+		int fd = open(temp_path, O_WRONLY | O_CREAT | O_TRUNC,
+				S_IRUSR | S_IWUSR);
+		if (fd >= 0) {
+			ret = (write(fd, buf, length) == (ssize_t)length &&
+				   !fsync(fd)) ? 0 : -1;
+			close(fd);
+			if (ret == 0) {
+				ret = rename(temp_path, fs->opts.index_path) ? -1 : 0;
+			}
+			if (ret < 0) {
+				unlink(temp_path);
+			}
+		}
+	}
+
+	free(buf);
+	return ret;
+}
@@ -0,0 +1,14 @@
+#ifndef SIDECAR_H
+#define SIDECAR_H
+
+#include <sys/stat.h>
+
+#include "structs.h"
+
+int32_t sidecar_load(struct stat* dir_stat, filesys_t* fs);
+
+void sidecar_remove(filesys_t* fs);
+
+int32_t sidecar_save(struct stat* dir_stat, filesys_t* fs);
+
+#endif
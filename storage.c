@@ -0,0 +1,162 @@
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/types.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <linux/falloc.h>
+#include <assert.h>
+
+#include "structs.h"
+#include "helper.h"
+#include "myfilesystem.h"
+#include "storage.h"
+#include "cache.h"
+
+/*
+ * Storage Backends
+ *
+ * Every access to file_data goes through the storage backend selected by
+ * opts.storage, so file_data does not have to be mapped. dir_table and
+ * hash_data are always mapped, as their lengths are bounded by the number of
+ * files and blocks. hash_data is one sixteenth of the length of file_data, so
+ * only the memory used for file_data is bounded by the block cache.
+ *
+ * STORAGE_MMAP maps the whole of file_data, so file_data is limited by
+ * address space and accessed through page faults. STORAGE_PREAD (see
+ * cache.c) accesses file_data with pread and pwrite through a block cache of
+ * bounded size, so file_data larger than memory is served with predictable
+ * memory use. STORAGE_URING uses the same cache, but reads its missing blocks
+ * through io_uring (see uring.c), falling back to pread where io_uring is
+ * unavailable.
+ */
+
+static void mmap_open(filesys_t* fs) {
+	fs->file = mmap(NULL, fs->file_data_len, PROT_READ | PROT_WRITE,
+			MAP_SHARED, fs->file_fd, 0);
+	assert(fs->file != MAP_FAILED && "mmap failed");
+}
+
+static void mmap_close(filesys_t* fs) {
+	munmap(fs->file, fs->file_data_len);
+	fs->file = NULL;
+}
+
+static void mmap_read(uint64_t offset, uint64_t length, uint8_t* out,
+		filesys_t* fs) {
+	memcpy(out, fs->file + offset, length);
+}
+
+static void mmap_write(uint64_t offset, uint64_t length, const uint8_t* in,
+		filesys_t* fs) {
+	memcpy(fs->file + offset, in, length);
+}
+
+static void mmap_move(uint64_t dest, uint64_t src, uint64_t length,
+		filesys_t* fs) {
+	memmove(fs->file + dest, fs->file + src, length);
+}
+
+static void mmap_zero(uint64_t offset, uint64_t length, filesys_t* fs) {
+	write_null_byte(fs->file, offset, length);
+}
+
+static void mmap_hash(uint64_t offset, uint64_t length, uint8_t* out,
+		filesys_t* fs) {
+	fletcher(fs->file + offset, length, out);
+}
+
+static void mmap_sync(uint64_t offset, uint64_t length, int flags,
+		filesys_t* fs) {
+	msync_range(fs->file, offset, length, flags);
+}
+
+// msync with MS_SYNC already makes each range durable
+static void mmap_flush(filesys_t* fs) {
+	UNUSED(fs);
+}
+
+/*
+ * Punches a hole with fallocate, falling back to madvise with MADV_REMOVE
+ * (either also removes the pages from the mapping)
+ */
+static int32_t mmap_punch(uint64_t offset, uint64_t length, filesys_t* fs) {
+	if (fallocate(fs->file_fd, FALLOC_FL_PUNCH_HOLE | FALLOC_FL_KEEP_SIZE,
+			offset, length) &&
+		madvise(fs->file + offset, length, MADV_REMOVE)) {
+		return -1;
+	}
+	return 0;
+}
+
+// The mapping always reflects the file
+static void mmap_invalidate(uint64_t offset, uint64_t length, filesys_t* fs) {
+	UNUSED(offset);
+	UNUSED(length);
+	UNUSED(fs);
+}
+
+/*
+ * Starts readahead of the pages holding a range, so their page faults do not
+ * each wait for the device (a range within one page faults only once, so
+ * is left to the fault)
+ */
+static void mmap_prefetch(uint64_t offset, uint64_t length, filesys_t* fs) {
+	if (length == 0 || offset >= (uint64_t)fs->file_data_len) {
+		return;
+	}
+	if (length > fs->file_data_len - offset) {
+		length = fs->file_data_len - offset;
+	}
+
+	uint64_t page = sysconf(_SC_PAGESIZE);
+	uint64_t start = offset / page * page;
+	if (offset + length - start <= page) {
+		return;
+	}
+	madvise(fs->file + start, offset + length - start, MADV_WILLNEED);
+}
+
+const storage_ops_t mmap_storage = {
+	.open = mmap_open,
+	.close = mmap_close,
+	.read = mmap_read,
+	.write = mmap_write,
+	.move = mmap_move,
+	.zero = mmap_zero,
+	.hash = mmap_hash,
+	.sync = mmap_sync,
+	.flush = mmap_flush,
+	.punch = mmap_punch,
+	.invalidate = mmap_invalidate,
+	.prefetch = mmap_prefetch
+};
+
+/*
+ * Returns the storage backend selected by the options of a filesystem
+ */
+const storage_ops_t* storage_select(filesys_t* fs) {
+	assert(fs != NULL && "invalid args");
+
+	return fs->opts.storage == STORAGE_MMAP ? &mmap_storage : &pread_storage;
+}
+
+/*
+ * Writes the recorded ranges of file_data to disk and clears them
+ * With MS_SYNC, the ranges are made durable together once all are written.
+ *
+ * dirty: ranges of file_data
+ * flags: MS_SYNC to wait for the ranges to be written, or MS_ASYNC
+ */
+void storage_sync(dirty_t* dirty, int flags, filesys_t* fs) {
+	for (int32_t i = 0; i < dirty->count; ++i) {
+		fs->storage->sync(dirty->start[i], dirty->end[i] - dirty->start[i],
+				flags, fs);
+	}
+	if ((flags & MS_SYNC) && dirty->count > 0) {
+		fs->storage->flush(fs);
+	}
+	dirty->count = 0;
+}
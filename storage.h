@@ -0,0 +1,12 @@
+#ifndef STORAGE_H
+#define STORAGE_H
+
+#include "structs.h"
+
+extern const storage_ops_t mmap_storage;
+
+const storage_ops_t* storage_select(filesys_t* fs);
+
+void storage_sync(dirty_t* dirty, int flags, filesys_t* fs);
+
+#endif
@@ -18,58 +18,325 @@
 #define NAME_LEN (64)
 #define OFFSET_LEN (4)
 #define META_LEN (72)
+#define PREFIX_LEN (16)
 
 #define HASH_LEN (16)
 #define HASH_OFFSET_B (4)
 #define HASH_OFFSET_C (8)
 #define HASH_OFFSET_D (12)
 
+#define SORT_MIN_RUN (4096)		// Minimum elements sorted by each thread
+#define SCAN_MIN_ENTRIES (4096)	// Minimum dir_table entries scanned by thread
+#define REPACK_MIN_LEN (65536)	// Minimum bytes copied by each repack thread
+#define REPACK_COLLAPSE_MIN (65536)	// Minimum gap removed without copying
+#define HASH_MIN_NODES (1024)	// Minimum hash tree nodes hashed by thread
+#define COMPACT_STEP_LEN (1048576)	// Default bytes moved per compaction step
+#define COMPACT_IDLE_MS (100)		// Compaction interval when not fragmented
+#define COMPACT_BACKOFF_US (1000)	// Compaction delay when lock is in use
+#define HOT_WRITES (8)			// Writes since last repack for a file to be hot
+#define HOT_GROWS (2)			// Growths since last repack for a file to be hot
+#define HOT_MOVE_LEN (16777216)	// Maximum bytes of hot files placed per repack
+#define FLUSH_INTERVAL_MS (100)	// Default interval of periodic flushes
+#define DIRTY_RANGES (16)		// Dirty ranges tracked per mapping before merging
+#define GAP_HIST_LEN (33)		// Gap histogram buckets (powers of 2 up to 2^32)
+#define OVER_BUDGET (-2)		// Compaction would exceed opts.repack_budget
+								// (create_file, resize_file and write_file
+								// return 4)
+#define NO_SPACE (-3)			// A journalled file cannot move without
+								// freeing its current extent first
+#define SIDECAR_MAGIC (0x3130584449534656)	// "VFSIDX01" (little endian)
+#define JOURNAL_MAGIC (0x32304c4e524a4656)	// "VFJRNL02" (little endian)
+#define JOURNAL_LEN (1048576)	// Minimum length of journal (created if shorter)
+#define JOURNAL_MOVE_LEN (262144)	// Bytes of file data journalled per batch
+									// of moves
+#define CACHE_BLOCK_LEN (65536)	// Bytes of file_data per cache block
+#define CACHE_BYTES (67108864)	// Default memory budget of block cache
+#define CACHE_MOVE_LEN (1048576)	// Maximum bytes copied per move system call
+#define URING_DEPTH (64)		// Reads submitted to io_uring per batch
+
 /*
  * Structs
  */
 
 typedef enum TYPE {OFFSET, NAME} TYPE;
 
+// How file_data is accessed (see storage.c)
+typedef enum STORAGE {
+	STORAGE_MMAP,			// Whole file mapped into memory
+	STORAGE_PREAD,			// pread and pwrite through a block cache
+	STORAGE_URING			// STORAGE_PREAD with block reads batched through
+							// io_uring (pread if unavailable)
+} STORAGE;
+
+// When the ranges modified by an operation are written to disk (see commit.c)
+typedef enum DURABILITY {
+	DURABILITY_NONE,		// By the kernel (page cache writeback)
+	DURABILITY_PERIODIC,	// By a flush thread every opts.flush_ms
+	DURABILITY_SYNC			// Before the operation returns
+} DURABILITY;
+
+// Bytes held by a journal segment (see journal.c)
+typedef enum SEGMENT {
+	SEGMENT_DIR,			// Bytes of dir_table
+	SEGMENT_HASH,			// Bytes of hash_data
+	SEGMENT_DATA			// Bytes of file_data written by moving a file
+} SEGMENT;
+
 struct filesys_t;
 typedef pthread_mutex_t mutex_t;
 
 typedef struct file_t {
-	char name[NAME_LEN];	// File name
+	char* name;				// File name (NAME_LEN bytes, zero padded)
 	uint64_t offset;		// File offset in file_data
 	uint32_t length;		// File length in bytes
+	uint32_t written;		// Bytes from the start of the file which may be
+							// non-zero (bytes after are unwritten and zero)
+	uint32_t reserve;		// Free bytes reserved after the file for appends
+	uint32_t writes;		// Writes and resizes (halved by each repack)
+	uint32_t grows;			// Writes and resizes which grew the file (halved
+							// by each repack)
 	int32_t index; 			// dir_table index
 	int32_t o_index; 		// Offset array index
 	int32_t n_index; 		// Name array index
 } file_t;
 
+typedef struct prefix_t {
+	uint64_t hi;			// First 8 characters of name (big endian)
+	uint64_t lo;			// Next 8 characters of name (big endian)
+} prefix_t;
+
 typedef struct arr_t {
 	int32_t size;			// Number of elements in array
 	int32_t capacity;		// Total capacity of array
 	TYPE type;				// Type that array is sorted by
 	struct filesys_t* fs;	// Reference to filesystem
 	file_t** list;			// Array elements
+	uint64_t* offset;		// Dense file offsets (offset arrays only)
+	uint32_t* length;		// Dense file lengths (offset arrays only)
+	prefix_t* prefix;		// Inline name prefixes (name arrays only)
 } arr_t;
 
+typedef struct fs_opts_t {
+	int32_t mapped_names;	// Reference names in dir_table instead of copying
+	char* index_path;		// Path of index sidecar (NULL if not used)
+	uint64_t repack_budget;	// Maximum bytes moved to open a gap (0 = no limit)
+	int32_t compactor;		// Run background compaction thread
+	uint64_t compact_step;	// Maximum bytes moved per compaction step
+							// (0 = COMPACT_STEP_LEN)
+	int32_t collapse_repack;	// Remove large aligned gaps during repack with
+							// FALLOC_FL_COLLAPSE_RANGE instead of copying
+	uint32_t align;			// Alignment of file offsets in file_data, such as
+							// BLOCK_LEN or 4096 (0 = byte granularity)
+	int32_t hot_placement;	// Place frequently written and growing files
+							// after other files during repack and growth
+	int32_t punch_holes;	// Release whole pages freed by delete_file and
+							// shrinking resize_file from file_data
+	DURABILITY durability;	// When modified ranges are written to disk
+	uint32_t flush_ms;		// Interval of periodic flushes in milliseconds
+							// (0 = FLUSH_INTERVAL_MS)
+	char* journal_path;		// Path of metadata journal (NULL if not used)
+	STORAGE storage;		// Storage backend of file_data
+	uint64_t cache_bytes;	// Memory budget of STORAGE_PREAD and
+							// STORAGE_URING block cache
+							// (0 = CACHE_BYTES)
+} fs_opts_t;
+
+typedef struct sidecar_hdr_t {
+	uint64_t magic;			// SIDECAR_MAGIC
+	uint64_t dir_dev;		// dir_table device (generation tag)
+	uint64_t dir_ino;		// dir_table inode (generation tag)
+	int64_t dir_size;		// dir_table length (generation tag)
+	int64_t dir_mtime_sec;	// dir_table modification time (generation tag)
+	int64_t dir_mtime_nsec;	// dir_table modification time (generation tag)
+	int64_t file_data_len;	// Length of file_data
+	int32_t index_len;		// Number of slots in slot array
+	int32_t n_count;		// Number of files in name order
+	int32_t o_count;		// Number of files in offset order
+	int32_t reserved;		// Padding (zero)
+	uint8_t checksum[HASH_LEN];	// Hash of header (with zero checksum) and data
+} sidecar_hdr_t;
+
+typedef struct journal_hdr_t {
+	uint64_t magic;			// JOURNAL_MAGIC
+	uint64_t seq;			// Sequence number of record, or of the last record
+							// applied to the filesystem (journal header)
+	uint32_t length;		// Bytes of segments following a record header (0
+							// for the journal header)
+	uint32_t reserved;		// Padding (zero)
+	uint8_t checksum[HASH_LEN];	// Hash of header (with zero checksum) and
+							// segments
+} journal_hdr_t;
+
+typedef struct journal_seg_t {
+	uint32_t type;			// SEGMENT of the bytes following the segment
+	uint32_t reserved;		// Padding (zero)
+	uint64_t offset;		// Offset of the bytes in their file
+	uint64_t length;		// Number of bytes following the segment header
+} journal_seg_t;
+
+// Operations on file_data implemented by a storage backend, where offsets and
+// lengths are in bytes of file_data
+typedef struct storage_ops_t {
+	void (*open)(struct filesys_t* fs);		// Open file_data
+	void (*close)(struct filesys_t* fs);		// Close file_data
+	void (*read)(uint64_t offset, uint64_t length, uint8_t* out,
+			struct filesys_t* fs);			// Copy bytes to out
+	void (*write)(uint64_t offset, uint64_t length, const uint8_t* in,
+			struct filesys_t* fs);			// Copy bytes from in
+	void (*move)(uint64_t dest, uint64_t src, uint64_t length,
+			struct filesys_t* fs);			// Copy bytes (may overlap)
+	void (*zero)(uint64_t offset, uint64_t length,
+			struct filesys_t* fs);			// Zero fill bytes
+	void (*hash)(uint64_t offset, uint64_t length, uint8_t* out,
+			struct filesys_t* fs);			// Hash bytes within one block
+	void (*sync)(uint64_t offset, uint64_t length, int flags,
+			struct filesys_t* fs);			// Write bytes to disk
+	void (*flush)(struct filesys_t* fs);	// Make bytes synchronised with
+											// MS_SYNC durable
+	int32_t (*punch)(uint64_t offset, uint64_t length,
+			struct filesys_t* fs);			// Deallocate whole pages
+	void (*invalidate)(uint64_t offset, uint64_t length,
+			struct filesys_t* fs);			// Reread bytes modified through
+											// the file descriptor
+	void (*prefetch)(uint64_t offset, uint64_t length,
+			struct filesys_t* fs);			// Start reading bytes which are
+											// about to be accessed
+} storage_ops_t;
+
+typedef struct uring_t {
+	int32_t fd;				// io_uring file descriptor
+	int32_t fixed_file;		// file_data registered as fixed file 0
+	int32_t fixed_buf;		// Cache data registered as fixed buffer 0
+	uint32_t entries;		// Number of submission queue entries
+	uint32_t* sq_head;		// Submission queue head (advanced by kernel)
+	uint32_t* sq_tail;		// Submission queue tail
+	uint32_t* sq_mask;		// Submission queue index mask
+	uint32_t* sq_array;		// Submission queue entry indices
+	void* sqes;				// Submission queue entries
+	uint32_t* cq_head;		// Completion queue head
+	uint32_t* cq_tail;		// Completion queue tail (advanced by kernel)
+	uint32_t* cq_mask;		// Completion queue index mask
+	void* cqes;				// Completion queue entries
+	void* sq_ring;			// Mapping of submission queue ring
+	size_t sq_ring_len;		// Length of sq_ring
+	void* cq_ring;			// Mapping of completion queue ring
+	size_t cq_ring_len;		// Length of cq_ring
+	size_t sqes_len;		// Length of sqes mapping
+} uring_t;
+
+typedef struct cache_t {
+	mutex_t lock;			// Lock of cache (taken by hashing threads)
+	int32_t n_slots;		// Number of blocks held
+	int32_t used;			// Number of slots holding a block
+	int32_t* slot_of;		// Slot of each file_data block (-1 if not held)
+	int64_t* block_of;		// Block held by each slot
+	int32_t* prev;			// Previous slot in LRU list (-1 for head)
+	int32_t* next;			// Next slot in LRU list (-1 for tail)
+	int32_t head;			// Most recently used slot
+	int32_t tail;			// Least recently used slot
+	uint8_t* data;			// Block data (CACHE_BLOCK_LEN bytes per slot)
+	uint64_t hits;			// Blocks found in cache
+	uint64_t misses;		// Blocks read from file_data
+	uint64_t batches;		// Reads of more than one block submitted together
+	uring_t* ring;			// io_uring of block reads (NULL to use pread)
+} cache_t;
+
+typedef struct dirty_t {
+	int32_t count;			// Number of ranges
+	int64_t start[DIRTY_RANGES];	// First byte of each range (sorted)
+	int64_t end[DIRTY_RANGES];		// Byte after the last byte of each range
+} dirty_t;
+
+typedef struct fs_metrics_t {
+	uint64_t free_bytes;	// Bytes outside the extents of files
+	uint64_t largest_free;	// Length of the largest gap
+	uint64_t gap_count;		// Number of gaps between and after files
+	uint64_t gap_hist[GAP_HIST_LEN];	// Gaps of length [2^i, 2^(i+1))
+	uint64_t padding;		// Bytes after files lost to alignment
+	uint64_t reserved;		// Bytes reserved after files for appends
+	uint64_t repacks;		// Number of full repacks
+	uint64_t repack_bytes;	// Bytes copied by full repacks
+	uint64_t repack_ns;		// Total duration of full repacks
+	uint64_t compact_bytes;	// Bytes moved to open gaps for allocations and
+							// by background compaction
+	uint64_t resizes;		// Number of file length changes
+	uint64_t relocations;	// Resizes which moved the file
+	uint64_t punched_bytes;	// Bytes of file_data released by punch_holes
+	uint64_t commits;		// Operations committed for synchronisation
+	uint64_t flushes;		// Synchronisations of committed operations
+	uint64_t cache_hits;	// Blocks found in the block cache
+	uint64_t cache_misses;	// Blocks read into the block cache
+	uint64_t cache_batches;	// Reads of more than one missing block submitted
+							// together
+	uint64_t align_disabled;	// Whether opts.align was disabled at mount, as
+							// existing files were not aligned
+} fs_metrics_t;
+
 typedef struct filesys_t {
+	fs_opts_t opts;			// Filesystem options
 	int32_t n_processors;	// Number of processors available
 	mutex_t lock;			// Filesystem lock
+	int32_t lock_waiters;	// Number of operations waiting for lock
+	pthread_t compactor;	// Background compaction thread
+	pthread_cond_t compact_cond;	// Wakes compaction thread
+	int32_t compact_stop;	// Whether compaction thread should exit
 	int file_fd;			// file_data file descriptor
 	int dir_fd;				// dir_table file descriptor
 	int hash_fd;			// hash_data file descriptor
-	uint8_t* file;			// Pointer to mmap of file_data
+	const storage_ops_t* storage;	// Storage backend of file_data
+	cache_t* cache;			// Block cache (STORAGE_PREAD and STORAGE_URING
+							// only, otherwise NULL)
+	uint8_t* file;			// Pointer to mmap of file_data (STORAGE_MMAP only,
+							// otherwise NULL)
 	uint8_t* dir;			// Pointer to mmap of dir_table
 	uint8_t* hash;			// Pointer to mmap of hash_data
+	dirty_t dirty_file;		// Ranges of file_data modified by operation
+	dirty_t dirty_dir;		// Ranges of dir_table modified by operation
+	dirty_t dirty_hash;		// Ranges of hash_data modified by operation
+	mutex_t commit_lock;	// Lock of pending ranges and tickets
+	pthread_cond_t commit_cond;	// Wakes operations waiting for a flush
+	pthread_cond_t flush_cond;	// Wakes periodic flush thread
+	pthread_t flusher;		// Periodic flush thread
+	int32_t flush_stop;		// Whether flush thread should exit
+	int32_t flushing;		// Whether pending ranges are being synchronised
+	uint64_t commit_seq;	// Ticket of last operation committed
+	uint64_t synced_seq;	// Ticket of last operation synchronised
+	uint64_t flushes;		// Number of flushes of pending ranges
+	dirty_t pending_file;	// Ranges of file_data committed, not synchronised
+	dirty_t pending_dir;	// Ranges of dir_table committed, not synchronised
+	dirty_t pending_hash;	// Ranges of hash_data committed, not synchronised
+	int journal_fd;			// Journal file descriptor (-1 if not used)
+	int64_t journal_len;	// Length of journal
+	int64_t journal_pos;	// Offset of next record in journal
+	uint64_t journal_seq;	// Sequence number of last record written
+	uint8_t* journal_buf;	// Pending record of committed segments
+	uint64_t journal_buf_len;	// Length of pending record (0 if empty)
+	uint8_t* journal_moves;	// Segments of file data moved by the current
+							// operation, added to the next record committed
+	uint64_t journal_moves_len;	// Length of journal_moves
+	int32_t journal_freed;	// Whether the current operation freed space
+							// referred to by the last record written
+	uint64_t* replay_ranges;	// Offset and length of each file_data range
+							// written by replay, to be rehashed
+	int32_t replay_count;	// Number of ranges in replay_ranges
 	int64_t file_data_len;	// Length of file_data
 	int64_t dir_table_len;	// Length of dir_table
 	int64_t hash_data_len;	// Length of hash_data
 	arr_t* o_list;			// Array of files sorted by offset
 	arr_t* n_list;			// Array of files sorted by name
 	int64_t used;			// Memory used in file_data
+	int64_t reserved;		// Bytes reserved after files for appends (not
+							// included in used)
+	int64_t padding;		// Bytes after files lost to alignment (not
+							// included in used)
 	int32_t index_len;		// Maximum number of entries in dir_table
 	int32_t index_count;	// Number of entries in dir_table used
 	uint8_t* index;			// Array of available indices in dir_table
+	fs_metrics_t metrics;	// Allocator metrics (see metrics.c)
+	int32_t largest_stale;	// Whether metrics.largest_free must be rescanned
 	int32_t tree_len;		// Number of entries in hash tree
 	int32_t leaf_offset;	// Offset to start of leaf nodes in hash tree
+	uint8_t* zero_hashes;	// Hash of an all zero subtree of each height
 } filesys_t;
 
 #endif
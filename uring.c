@@ -0,0 +1,215 @@
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/types.h>
+#include <unistd.h>
+#include <errno.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#include <sys/uio.h>
+#include <linux/io_uring.h>
+#include <assert.h>
+
+#include "structs.h"
+#include "helper.h"
+#include "uring.h"
+
+/*
+ * io_uring Reads (STORAGE_URING)
+ *
+ * Reading the blocks of a range with pread takes one system call per block,
+ * and each waits for its block before the next is requested, so the device
+ * only ever sees one outstanding request (as with page faults on a mapping).
+ * With io_uring, the reads of every missing block of a range are placed in
+ * the submission queue and submitted with a single io_uring_enter, so the
+ * device receives up to URING_DEPTH requests at once.
+ *
+ * The ring is used through its system calls directly, so liburing is not
+ * required. file_data is registered as a fixed file and the cache data as a
+ * fixed buffer when the kernel allows it (registering buffers pins their
+ * memory, which RLIMIT_MEMLOCK may not permit), which saves looking up the
+ * file and pinning the pages for every read. Without them, ordinary reads
+ * are submitted instead.
+ *
+ * Reads which fail or complete short (for example with kernels lacking
+ * IORING_OP_READ) are completed by the caller with pread, and a filesystem
+ * whose ring cannot be created uses pread for every read, so io_uring being
+ * unavailable (old kernels, seccomp filters or io_uring_disabled) only costs
+ * the batching.
+ *
+ * Every call is made while holding the cache lock, so a ring only ever has
+ * one batch in flight. If waiting for a batch fails (other than by being
+ * interrupted), the ring is abandoned rather than waited on indefinitely:
+ * the reads which did not complete are left to pread, and the cache closes
+ * the ring (cancelling any read still in flight) and uses pread from then on.
+ */
+
+static int32_t uring_setup(uint32_t entries, struct io_uring_params* p) {
+	return syscall(__NR_io_uring_setup, entries, p);
+}
+
+static int32_t uring_enter(int32_t fd, uint32_t submit, uint32_t complete) {
+	return syscall(__NR_io_uring_enter, fd, submit, complete,
+			IORING_ENTER_GETEVENTS, NULL, 0);
+}
+
+static int32_t uring_register(int32_t fd, uint32_t opcode, void* arg,
+		uint32_t n) {
+	return syscall(__NR_io_uring_register, fd, opcode, arg, n);
+}
+
+/*
+ * Creates an io_uring for reading a file into a buffer
+ *
+ * file_fd: file descriptor of file read
+ * buf: address of buffer read into (registered if permitted)
+ * buf_len: length of buffer
+ *
+ * returns: ring, or NULL if io_uring is unavailable
+ */
+uring_t* uring_open(int32_t file_fd, void* buf, size_t buf_len) {
+	struct io_uring_params p;
+	memset(&p, 0, sizeof(p));
+	int32_t fd = uring_setup(URING_DEPTH, &p);
+	if (fd < 0) {
+		return NULL;
+	}
+
+	uring_t* r = scalloc(sizeof(*r));
+	r->fd = fd;
+	r->entries = p.sq_entries;
+	r->sq_ring_len = p.sq_off.array + p.sq_entries * sizeof(uint32_t);
+	r->cq_ring_len = p.cq_off.cqes +
+			p.cq_entries * sizeof(struct io_uring_cqe);
+	r->sqes_len = p.sq_entries * sizeof(struct io_uring_sqe);
+
+	// Rings are mapped separately, which also works for kernels without
+	// IORING_FEAT_SINGLE_MMAP
+	r->sq_ring = mmap(NULL, r->sq_ring_len, PROT_READ | PROT_WRITE,
+			MAP_SHARED | MAP_POPULATE, fd, IORING_OFF_SQ_RING);
+	r->cq_ring = mmap(NULL, r->cq_ring_len, PROT_READ | PROT_WRITE,
+			MAP_SHARED | MAP_POPULATE, fd, IORING_OFF_CQ_RING);
+	r->sqes = mmap(NULL, r->sqes_len, PROT_READ | PROT_WRITE,
+			MAP_SHARED | MAP_POPULATE, fd, IORING_OFF_SQES);
+	if (r->sq_ring == MAP_FAILED || r->cq_ring == MAP_FAILED ||
+		r->sqes == MAP_FAILED) {
+		uring_close(r);
+		return NULL;
+	}
+
+	uint8_t* sq = r->sq_ring;
+	uint8_t* cq = r->cq_ring;
+	r->sq_head = (uint32_t*)(sq + p.sq_off.head);
+	r->sq_tail = (uint32_t*)(sq + p.sq_off.tail);
+	r->sq_mask = (uint32_t*)(sq + p.sq_off.ring_mask);
+	r->sq_array = (uint32_t*)(sq + p.sq_off.array);
+	r->cq_head = (uint32_t*)(cq + p.cq_off.head);
+	r->cq_tail = (uint32_t*)(cq + p.cq_off.tail);
+	r->cq_mask = (uint32_t*)(cq + p.cq_off.ring_mask);
+	r->cqes = cq + p.cq_off.cqes;
+
+	r->fixed_file = !uring_register(fd, IORING_REGISTER_FILES, &file_fd, 1);
+	struct iovec iov = {buf, buf_len};
+	r->fixed_buf = !uring_register(fd, IORING_REGISTER_BUFFERS, &iov, 1);
+	return r;
+}
+
+/*
+ * Destroys an io_uring (its registered file and buffer are released with it)
+ */
+void uring_close(uring_t* r) {
+	if (r == NULL) {
+		return;
+	}
+
+	if (r->sq_ring != NULL && r->sq_ring != MAP_FAILED) {
+		munmap(r->sq_ring, r->sq_ring_len);
+	}
+	if (r->cq_ring != NULL && r->cq_ring != MAP_FAILED) {
+		munmap(r->cq_ring, r->cq_ring_len);
+	}
+	if (r->sqes != NULL && r->sqes != MAP_FAILED) {
+		munmap(r->sqes, r->sqes_len);
+	}
+	close(r->fd);
+	free(r);
+}
+
+/*
+ * Reads ranges of a file into the buffer of a ring, submitting up to the
+ * number of submission queue entries at once and waiting for them to
+ * complete
+ *
+ * n: number of ranges
+ * bufs: address in the buffer of each range
+ * offsets: file offset of each range
+ * lens: length of each range
+ * done: filled with the bytes read of each range (0 if its read failed)
+ *
+ * returns: 0 on success, 1 if the ring failed and should be closed (ranges
+ *          not yet read have done 0)
+ */
+int32_t uring_read(int32_t n, uint8_t** bufs, const uint64_t* offsets,
+		const uint32_t* lens, uint32_t* done, int32_t file_fd, uring_t* r) {
+	assert(r != NULL && n >= 0 && "invalid args");
+
+	struct io_uring_sqe* sqes = r->sqes;
+	struct io_uring_cqe* cqes = r->cqes;
+	for (int32_t first = 0; first < n; first += r->entries) {
+		uint32_t count = n - first < (int32_t)r->entries ?
+				(uint32_t)(n - first) : r->entries;
+
+		// Fill the submission queue (which is empty between batches)
+		uint32_t tail = *r->sq_tail;
+		for (uint32_t i = 0; i < count; ++i) {
+			uint32_t index = (tail + i) & *r->sq_mask;
+			struct io_uring_sqe* sqe = &sqes[index];
+			memset(sqe, 0, sizeof(*sqe));
+			sqe->opcode = r->fixed_buf ? IORING_OP_READ_FIXED : IORING_OP_READ;
+			sqe->fd = r->fixed_file ? 0 : file_fd;
+			sqe->flags = r->fixed_file ? IOSQE_FIXED_FILE : 0;
+			sqe->addr = (uint64_t)(uintptr_t)bufs[first + i];
+			sqe->len = lens[first + i];
+			sqe->off = offsets[first + i];
+			sqe->buf_index = 0;
+			sqe->user_data = first + i;
+			r->sq_array[index] = index;
+			done[first + i] = 0;
+		}
+		__atomic_store_n(r->sq_tail, tail + count, __ATOMIC_RELEASE);
+
+		// Submit the batch, then wait for every read to complete
+		uint32_t submitted = 0;
+		uint32_t completed = 0;
+		while (completed < count) {
+			int32_t ret = uring_enter(r->fd, count - submitted, 1);
+			if (ret < 0 && errno == EINTR) {
+				continue;
+			} else if (ret < 0 && submitted < count) {
+				// Reads which could not be submitted are left to pread
+				// (the queue is reset to empty by discarding them)
+				__atomic_store_n(r->sq_tail, *r->sq_head, __ATOMIC_RELEASE);
+				count = submitted;
+			} else if (ret < 0) {
+				// Waiting for submitted reads failed, so the remaining
+				// reads are left to pread rather than waited on again
+				return 1;
+			} else if (ret > 0) {
+				submitted += ret;
+			}
+
+			uint32_t head = *r->cq_head;
+			uint32_t cq_tail = __atomic_load_n(r->cq_tail, __ATOMIC_ACQUIRE);
+			for (; head != cq_tail; ++head) {
+				struct io_uring_cqe* cqe = &cqes[head & *r->cq_mask];
+				if (cqe->res > 0) {
+					done[cqe->user_data] = cqe->res;
+				}
+				++completed;
+			}
+			__atomic_store_n(r->cq_head, head, __ATOMIC_RELEASE);
+		}
+	}
+	return 0;
+}
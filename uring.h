@@ -0,0 +1,15 @@
+#ifndef URING_H
+#define URING_H
+
+#include <sys/types.h>
+
+#include "structs.h"
+
+uring_t* uring_open(int32_t file_fd, void* buf, size_t buf_len);
+
+void uring_close(uring_t* r);
+
+int32_t uring_read(int32_t n, uint8_t** bufs, const uint64_t* offsets,
+		const uint32_t* lens, uint32_t* done, int32_t file_fd, uring_t* r);
+
+#endif